@@ -0,0 +1,81 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BEAGLEG_SPSC_QUEUE_H_
+#define _BEAGLEG_SPSC_QUEUE_H_
+
+#include <atomic>
+
+// A fixed size, compile-time allocated queue to hand over elements from
+// exactly one producer thread to exactly one consumer thread without locking.
+// It does not block; if a thread needs to wait for elements or space, it
+// needs to do so with its own means.
+// Holds up to CAPACITY - 1 elements.
+template <typename T, int CAPACITY>
+class SPSCQueue {
+public:
+  SPSCQueue() : write_pos_(0), read_pos_(0) {}
+
+  // -- Producer thread.
+
+  // Add a copy of the element to the queue. Returns false if full.
+  bool TryPush(const T &element) {
+    const unsigned write_pos = write_pos_.load(std::memory_order_relaxed);
+    const unsigned next = (write_pos + 1) % CAPACITY;
+    if (next == read_pos_.load(std::memory_order_acquire))
+      return false;
+    buffer_[write_pos] = element;
+    write_pos_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool full() const {
+    return ((write_pos_.load(std::memory_order_relaxed) + 1) % CAPACITY
+            == read_pos_.load(std::memory_order_acquire));
+  }
+
+  // -- Consumer thread.
+
+  // Move the oldest element into "element". Returns false if empty.
+  bool TryPop(T *element) {
+    const unsigned read_pos = read_pos_.load(std::memory_order_relaxed);
+    if (read_pos == write_pos_.load(std::memory_order_acquire))
+      return false;
+    *element = buffer_[read_pos];
+    read_pos_.store((read_pos + 1) % CAPACITY, std::memory_order_release);
+    return true;
+  }
+
+  // -- Any thread. Naturally only a snapshot.
+  bool empty() const {
+    return (read_pos_.load(std::memory_order_acquire)
+            == write_pos_.load(std::memory_order_acquire));
+  }
+  unsigned size() const {
+    return (write_pos_.load(std::memory_order_acquire) + CAPACITY
+            - read_pos_.load(std::memory_order_acquire)) % CAPACITY;
+  }
+
+private:
+  std::atomic<unsigned> write_pos_;
+  std::atomic<unsigned> read_pos_;
+  T buffer_[CAPACITY];
+};
+
+#endif  // _BEAGLEG_SPSC_QUEUE_H_
@@ -0,0 +1,76 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spsc-queue.h"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+TEST(SPSCQueueTest, PushPopSingleThread) {
+  SPSCQueue<int, 4> queue;
+  int value = -1;
+  EXPECT_TRUE(queue.empty());
+  EXPECT_FALSE(queue.TryPop(&value));
+
+  EXPECT_TRUE(queue.TryPush(1));
+  EXPECT_TRUE(queue.TryPush(2));
+  EXPECT_TRUE(queue.TryPush(3));
+  EXPECT_EQ(3u, queue.size());
+  EXPECT_TRUE(queue.full());
+  EXPECT_FALSE(queue.TryPush(4));   // Capacity - 1 elements.
+
+  EXPECT_TRUE(queue.TryPop(&value));
+  EXPECT_EQ(1, value);
+  EXPECT_FALSE(queue.full());
+  EXPECT_TRUE(queue.TryPush(4));    // Wrapping around.
+  EXPECT_EQ(3u, queue.size());
+
+  for (int expected = 2; expected <= 4; ++expected) {
+    EXPECT_TRUE(queue.TryPop(&value));
+    EXPECT_EQ(expected, value);
+  }
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(0u, queue.size());
+}
+
+TEST(SPSCQueueTest, ElementsArriveInOrderAcrossThreads) {
+  static constexpr int kCount = 100000;
+  SPSCQueue<int, 16> queue;
+  std::thread producer([&queue]() {
+      for (int i = 0; i < kCount; ++i) {
+        while (!queue.TryPush(i))
+          std::this_thread::yield();
+      }
+    });
+
+  int value;
+  for (int expected = 0; expected < kCount; ++expected) {
+    while (!queue.TryPop(&value))
+      std::this_thread::yield();
+    ASSERT_EQ(expected, value);
+  }
+  producer.join();
+  EXPECT_TRUE(queue.empty());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,117 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "delta-kinematics.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+// Segments are never shorter or longer than this (mm), no matter how
+// straight or curved the carriage paths are.
+static constexpr float kMinSegmentLength = 0.1;
+static constexpr float kMaxSegmentLength = 20;
+
+DeltaKinematics::DeltaKinematics(float radius, float rod_length,
+                                 float tolerance)
+  : rod_length_sq_(rod_length * rod_length),
+    segment_factor_(8 * tolerance / rod_length_sq_) {
+  const float angles[3] = { 210, 330, 90 };
+  for (int i = 0; i < 3; ++i) {
+    tower_x_[i] = radius * cosf(angles[i] * M_PI / 180);
+    tower_y_[i] = radius * sinf(angles[i] * M_PI / 180);
+  }
+}
+
+bool DeltaKinematics::CartesianToCarriages(float x, float y, float z,
+                                           float carriage[3]) const {
+  for (int i = 0; i < 3; ++i) {
+    const float dx = tower_x_[i] - x;
+    const float dy = tower_y_[i] - y;
+    const float h_sq = rod_length_sq_ - dx*dx - dy*dy;
+    if (h_sq <= 0) return false;
+    carriage[i] = z + sqrtf(h_sq);
+  }
+  return true;
+}
+
+// Intersection of the three spheres with the rod length around the carriage
+// joints. Of the two solutions, the effector is the lower one.
+bool DeltaKinematics::CarriagesToCartesian(const float carriage[3],
+                                           float *x, float *y, float *z) const {
+  const double p1[3] = { tower_x_[0], tower_y_[0], carriage[0] };
+  double ex[3], ey[3], ez[3], p13[3];
+  double d = 0;
+  for (int k = 0; k < 3; ++k) {
+    const double p2 = k == 0 ? tower_x_[1] : k == 1 ? tower_y_[1] : carriage[1];
+    const double p3 = k == 0 ? tower_x_[2] : k == 1 ? tower_y_[2] : carriage[2];
+    ex[k] = p2 - p1[k];
+    p13[k] = p3 - p1[k];
+    d += ex[k] * ex[k];
+  }
+  d = sqrt(d);
+  double i = 0;
+  for (int k = 0; k < 3; ++k) {
+    ex[k] /= d;
+    i += ex[k] * p13[k];
+  }
+  double ey_len = 0;
+  for (int k = 0; k < 3; ++k) {
+    ey[k] = p13[k] - i * ex[k];
+    ey_len += ey[k] * ey[k];
+  }
+  ey_len = sqrt(ey_len);
+  double j = 0;
+  for (int k = 0; k < 3; ++k) {
+    ey[k] /= ey_len;
+    j += ey[k] * p13[k];
+  }
+  ez[0] = ex[1] * ey[2] - ex[2] * ey[1];
+  ez[1] = ex[2] * ey[0] - ex[0] * ey[2];
+  ez[2] = ex[0] * ey[1] - ex[1] * ey[0];
+
+  // All spheres have the same radius, which simplifies the usual formulas.
+  const double a = d / 2;
+  const double b = (i*i + j*j) / (2 * j) - i * a / j;
+  const double c_sq = rod_length_sq_ - a*a - b*b;
+  if (c_sq < 0) return false;
+  const double c = ez[2] > 0 ? -sqrt(c_sq) : sqrt(c_sq);
+  *x = p1[0] + a * ex[0] + b * ey[0] + c * ez[0];
+  *y = p1[1] + a * ex[1] + b * ey[1] + c * ez[1];
+  *z = p1[2] + a * ex[2] + b * ey[2] + c * ez[2];
+  return true;
+}
+
+// The carriage height above the effector is h = sqrt(L^2 - d^2) with d the
+// horizontal distance to the tower. Moving along a line, it is most curved
+// moving towards the tower: |h''| = L^2 / h^3. A chord of length s then
+// deviates s^2 / 8 * |h''| from the curve; we choose s so that this stays
+// within the tolerance for the tower with the steepest rods.
+float DeltaKinematics::SegmentLength(float x, float y) const {
+  float min_h_sq = rod_length_sq_;
+  for (int i = 0; i < 3; ++i) {
+    const float dx = tower_x_[i] - x;
+    const float dy = tower_y_[i] - y;
+    min_h_sq = std::min(min_h_sq, rod_length_sq_ - dx*dx - dy*dy);
+  }
+  if (min_h_sq <= 0) return kMinSegmentLength;
+  const float h = sqrtf(min_h_sq);
+  const float length = sqrtf(segment_factor_ * h * h * h);
+  return std::max(kMinSegmentLength, std::min(kMaxSegmentLength, length));
+}
@@ -0,0 +1,61 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_DELTA_KINEMATICS_H_
+#define _BEAGLEG_DELTA_KINEMATICS_H_
+
+// Linear delta: three vertical towers at 210, 330 and 90 degrees around the
+// center, each with a carriage that is connected with diagonal rods of equal
+// length to the effector.
+//
+// Carriage heights are measured in the same coordinate system as the
+// effector: the carriage of a tower right above the effector is "rod length"
+// higher than the effector.
+//
+// A straight move of the effector is a curve for the carriages, so straight
+// moves are split into segments that are straight in carriage space; their
+// length depends on how steep the rods are at that position.
+class DeltaKinematics {
+public:
+  // "radius": horizontal distance of the rod joints on the carriages to the
+  // rod joints on the effector if the effector is in the center.
+  // "rod_length": length of the diagonal rods.
+  // "tolerance": how much (mm) a segment may deviate from the straight path.
+  DeltaKinematics(float radius, float rod_length, float tolerance);
+
+  // Carriage heights of the three towers with the effector at x, y, z.
+  // Returns false if the position can't be reached.
+  bool CartesianToCarriages(float x, float y, float z,
+                            float carriage[3]) const;
+
+  // Effector position for the given carriage heights. Returns false if the
+  // rods can't be connected.
+  bool CarriagesToCartesian(const float carriage[3],
+                            float *x, float *y, float *z) const;
+
+  // Length of the horizontal part of a segment that starts at x, y.
+  float SegmentLength(float x, float y) const;
+
+private:
+  float tower_x_[3];
+  float tower_y_[3];
+  float rod_length_sq_;
+  float segment_factor_;   // 8 * tolerance / rod_length^2
+};
+
+#endif
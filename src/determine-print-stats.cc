@@ -53,6 +53,7 @@ public:
   void set_fanspeed(float speed) final { delegatee_->set_fanspeed(speed);  }
   void wait_temperature() final { delegatee_->wait_temperature(); }
   void motors_enable(bool b) final { delegatee_->motors_enable(b); }
+  void set_path_blending(float t) final { delegatee_->set_path_blending(t); }
   void go_home(AxisBitmap_t axes) final { /* ignore */ }
   void inform_origin_offset(const AxesRegister& axes, const char *n) final {
     delegatee_->inform_origin_offset(axes, n);
@@ -72,6 +73,11 @@ public:
     update_coordinate_stats(axes);
     return delegatee_->coordinated_move(feed, axes);
   }
+  bool coordinated_curve_move(float feed, const AxesRegister &axes,
+                              float radius) final {
+    update_coordinate_stats(axes);
+    return delegatee_->coordinated_curve_move(feed, axes, radius);
+  }
 
   const char *unprocessed(char letter, float value, const char *remain) final {
     return delegatee_->unprocessed(letter, value, remain);
@@ -98,7 +104,8 @@ private:
 
 class StatsMotorOperations : public MotorOperations {
 public:
-  StatsMotorOperations(BeagleGPrintStats *stats) : print_stats_(stats) {}
+  StatsMotorOperations(BeagleGPrintStats *stats)
+    : print_stats_(stats), speed_factor_(1) {}
 
   bool Enqueue(const LinearSegmentSteps &param) final {
     int max_steps = 0;
@@ -109,7 +116,8 @@ public:
     }
 
     // max_steps = a/2*t^2 + v0*t; a = (v1-v0)/t
-    print_stats_->total_time_seconds += 2 * max_steps / (param.v0 + param.v1);
+    print_stats_->total_time_seconds
+      += 2 * max_steps / (speed_factor_ * (param.v0 + param.v1));
     //printf("HZ:v0=%7.1f v1=%7.1f steps=%d\n", param.v0, param.v1, max_steps);
     return true;
   }
@@ -118,9 +126,13 @@ public:
   void WaitQueueEmpty() final {}
   bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
   void SetExternalPosition(int axis, int pos) final {}
+  void SetSpeedFactor(float factor, float ramp_seconds) final {
+    if (factor > 0) speed_factor_ = factor;  // A feed hold is not print time.
+  }
 
 private:
   BeagleGPrintStats *const print_stats_;
+  float speed_factor_;
 };
 }
 
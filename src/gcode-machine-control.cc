@@ -24,16 +24,20 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
 
+#include <algorithm>
+
 #include "common/container.h"
 #include "common/logging.h"
 #include "common/string-util.h"
@@ -70,6 +74,7 @@ public:
   bool Init();
 
   ~Impl() {
+    if (start_wait_fd_ >= 0) close(start_wait_fd_);
     delete planner_;
   }
 
@@ -79,6 +84,7 @@ public:
   HomingState GetHomeStatus();
   bool GetMotorsEnabled();
   void GetCurrentPosition(AxesRegister *pos);
+  void GetPlannerStats(PlannerStats *stats) { planner_->GetStats(stats); }
 
   // -- GCodeParser::Events interface implementation --
   void gcode_start(GCodeParser *parser) final;
@@ -88,6 +94,7 @@ public:
 
   void gcode_command_done(char letter, float val) final;
   void input_idle(bool is_first) final;
+  int input_blocked_fd() final;
   void wait_for_start() final;
   void go_home(AxisBitmap_t axis_bitmap) final;
   bool probe_axis(float feed_mm_p_sec, enum GCodeParserAxis axis,
@@ -97,9 +104,12 @@ public:
   void set_temperature(float degrees_c) final;  // M104, M109: Set temp. in Celsius.
   void wait_temperature() final;                // M109, M116: Wait for temp. reached.
   void dwell(float time_ms) final;              // G4: dwell for milliseconds.
+  void set_path_blending(float tolerance_mm) final;   // G61, G64
   void motors_enable(bool enable) final;        // M17,M84,M18: Switch on/off motors
   void clamp_to_range(AxisBitmap_t affected, AxesRegister *axes) final;
   bool coordinated_move(float feed_mm_p_sec, const AxesRegister &target) final;
+  bool coordinated_curve_move(float feed_mm_p_sec, const AxesRegister &target,
+                              float curve_radius_mm) final;
   bool rapid_move(float feed_mm_p_sec, const AxesRegister &target) final;
   const char *unprocessed(char letter, float value, const char *) final;
 
@@ -109,6 +119,10 @@ private:
   bool clear_estop();
   bool check_for_estop();
   bool check_for_pause();
+  void check_for_feed_hold();
+  void feed_hold();
+  void start_waiting(bool is_feed_hold);
+  bool still_waiting_for_start();
   void issue_motor_move_if_possible();
   bool test_homing_status_ok();
   bool test_within_machine_limits(const AxesRegister &axes);
@@ -151,6 +165,13 @@ private:
   std::string coordinate_display_origin_name_;
   float current_feedrate_mm_per_sec_;    // Set via Fxxx and remembered
   float prog_speed_factor_;              // Speed factor set by program (M220)
+  float queue_speed_factor_;             // Part of it applied in motion queue.
+  float speed_ramp_seconds_;             // Time for queue speed 0 -> 1.
+  int64_t next_feed_hold_check_usec_;
+  int start_wait_fd_;                    // Timer while waiting for start.
+  int pause_cleared_count_;              // Debounce while waiting.
+  bool start_wait_led_on_;
+  bool in_feed_hold_;                    // Motion queue held while waiting.
   time_t next_auto_disable_motor_;
   time_t next_auto_disable_fan_;
   bool pause_enabled_;                  // Enabled via M120, disabled via M121
@@ -174,6 +195,13 @@ GCodeMachineControl::Impl::Impl(const MachineControlConfig &config,
     g0_feedrate_mm_per_sec_(-1),
     current_feedrate_mm_per_sec_(-1),
     prog_speed_factor_(1),
+    queue_speed_factor_(1),
+    speed_ramp_seconds_(0),
+    next_feed_hold_check_usec_(0),
+    start_wait_fd_(-1),
+    pause_cleared_count_(0),
+    start_wait_led_on_(false),
+    in_feed_hold_(false),
     homing_state_(GCodeMachineControl::HomingState::NEVER_HOMED) {
     pause_enabled_ = cfg_.enable_pause;
     next_auto_disable_motor_ = -1;
@@ -215,6 +243,11 @@ bool GCodeMachineControl::Impl::Init() {
                 cfg_.acceleration[axis], gcodep_axis2letter(axis));
       return false;
     }
+    if (cfg_.max_jerk[axis] < 0) {
+      Log_error("Invalid negative jerk %.1f for axis %c\n",
+                cfg_.max_jerk[axis], gcodep_axis2letter(axis));
+      return false;
+    }
   }
 
   for (const GCodeParserAxis axis : AllAxes()) {
@@ -224,8 +257,38 @@ bool GCodeMachineControl::Impl::Init() {
   }
   prog_speed_factor_ = 1.0f;
 
+  // Speed changes in the motion queue, such as a feed hold, ramp within the
+  // time the slowest accelerating axis needs to reach its top speed. That is
+  // the worst case of any queued segment, as none exceeds the top speed.
+  // The motion queue does not ramp while a segment changes speed in the same
+  // direction itself, so the ramp never adds to the planned acceleration.
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (cfg_.acceleration[axis] <= 0) continue;  // unlimited.
+    speed_ramp_seconds_ = std::max(speed_ramp_seconds_,
+                                   cfg_.max_feedrate[axis]
+                                   / cfg_.acceleration[axis]);
+  }
+
   int error_count = 0;
 
+  if (cfg_.junction_deviation < 0) {
+    Log_error("Error: [motion] junction-deviation-mm can't be negative (is %.3f)",
+              cfg_.junction_deviation);
+    ++error_count;
+  }
+
+  if (cfg_.merge_tolerance < 0) {
+    Log_error("Error: [motion] segment-merge-tolerance-mm can't be negative "
+              "(is %.3f)", cfg_.merge_tolerance);
+    ++error_count;
+  }
+
+  if (cfg_.lookahead < 1 || cfg_.lookahead > PLANNER_MAX_LOOKAHEAD) {
+    Log_error("Error: [motion] lookahead needs to be in range 1..%d (is %d)",
+              PLANNER_MAX_LOOKAHEAD, cfg_.lookahead);
+    ++error_count;
+  }
+
   // Check if things are plausible: we only allow one home endstop per axis.
   for (const GCodeParserAxis axis : AllAxes()) {
     const HardwareMapping::AxisTrigger homing_trigger = cfg_.homing_trigger[axis];
@@ -330,6 +393,58 @@ bool GCodeMachineControl::Impl::Init() {
     }
   }
 
+  if (hardware_mapping_->IsCoreXY()) {
+    // Both motors move X and Y, so the steps need to mean the same distance.
+    if (!hardware_mapping_->HasMotorFor(AXIS_X)
+        || !hardware_mapping_->HasMotorFor(AXIS_Y)) {
+      Log_error("ERROR: CoreXY/H-bot kinematics need motors for X and Y.");
+      ++error_count;
+    }
+    if (cfg_.steps_per_mm[AXIS_X] != cfg_.steps_per_mm[AXIS_Y]) {
+      Log_error("ERROR: CoreXY/H-bot kinematics need the same steps/mm "
+                "for X and Y (is %.4f and %.4f)",
+                cfg_.steps_per_mm[AXIS_X], cfg_.steps_per_mm[AXIS_Y]);
+      ++error_count;
+    }
+  }
+
+  if (hardware_mapping_->GetKinematics()
+      == HardwareMapping::Kinematics::DELTA) {
+    if (cfg_.delta_rod_length <= cfg_.delta_radius || cfg_.delta_radius <= 0
+        || cfg_.delta_segment_tolerance <= 0) {
+      Log_error("ERROR: Delta kinematics need [delta] radius > 0, a longer "
+                "rod-length and a positive segment-tolerance-mm.");
+      ++error_count;
+    }
+    if (cfg_.steps_per_mm[AXIS_X] != cfg_.steps_per_mm[AXIS_Z]
+        || cfg_.steps_per_mm[AXIS_Y] != cfg_.steps_per_mm[AXIS_Z]) {
+      Log_error("ERROR: Delta kinematics need the same steps/mm for all "
+                "towers X, Y and Z.");
+      ++error_count;
+    }
+  }
+
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (cfg_.shaper_type[axis] == InputShaper::NONE)
+      continue;
+    if (cfg_.shaper_frequency[axis] <= 0 || cfg_.shaper_damping[axis] < 0
+        || cfg_.shaper_damping[axis] >= 1) {
+      Log_error("ERROR: %c axis: shaper needs a shaper-frequency > 0 and a "
+                "shaper-damping in the range [0..1)",
+                gcodep_axis2letter(axis));
+      ++error_count;
+    }
+  }
+  if (hardware_mapping_->IsCoreXY()
+      && (cfg_.shaper_type[AXIS_X] != cfg_.shaper_type[AXIS_Y]
+          || cfg_.shaper_frequency[AXIS_X] != cfg_.shaper_frequency[AXIS_Y]
+          || cfg_.shaper_damping[AXIS_X] != cfg_.shaper_damping[AXIS_Y])) {
+    // Each motor moves both axes, so we can't shape them differently.
+    Log_error("ERROR: CoreXY/H-bot kinematics need the same shaper settings "
+              "for X and Y.");
+    ++error_count;
+  }
+
   if (error_count)
     return false;
 
@@ -379,34 +494,83 @@ void GCodeMachineControl::Impl::set_fanspeed(float speed) {
 // number of checks to ensure the pause switch is inactive
 #define PAUSE_ACTIVE_DETECT	2
 
+// Interval in which we check the switches and flash the LED while waiting.
+#define START_WAIT_INTERVAL_USEC (100 * 1000)
+
 void GCodeMachineControl::Impl::wait_for_start() {
+  start_waiting(false);
+}
+
+// Waiting for the operator must not block, so that the event loop keeps
+// serving everything else. We only start a timer here; input_blocked_fd()
+// holds off further G-code until still_waiting_for_start() is done.
+void GCodeMachineControl::Impl::start_waiting(bool is_feed_hold) {
+  if (start_wait_fd_ >= 0) return;  // Already waiting.
   // Interlock: can't start while wait is still active.
-  if (pause_enabled_ && check_for_pause()) {
-    mprintf("// BeagleG: pause switch active\n");
-    int pause_active = PAUSE_ACTIVE_DETECT;
-    // The switch reading is debounced. We add additional delay with
-    // the while loop to ensure that the pause switch has been cleared.
-    while (pause_active) {
-      usleep(1000);
-      if (check_for_pause())
-        pause_active = PAUSE_ACTIVE_DETECT;
-      else
-        pause_active--;
-    }
-    mprintf("// BeagleG: pause switch cleared\n");
+  const bool pause_active = pause_enabled_ && check_for_pause();
+  if (!pause_active && hardware_mapping_->TestStartSwitch() && !is_feed_hold)
+    return;
+
+  start_wait_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (start_wait_fd_ < 0) {
+    Log_error("Can't wait for start switch: %s", strerror(errno));
+    return;
   }
-  if (!hardware_mapping_->TestStartSwitch()) {
+  struct itimerspec interval = {};
+  interval.it_interval.tv_nsec = START_WAIT_INTERVAL_USEC * 1000;
+  interval.it_value = interval.it_interval;
+  timerfd_settime(start_wait_fd_, 0, &interval, NULL);
+
+  in_feed_hold_ = is_feed_hold;
+  start_wait_led_on_ = false;
+  if (pause_active) {
+    mprintf("// BeagleG: pause switch active\n");
+    pause_cleared_count_ = 0;
+  } else {
+    pause_cleared_count_ = PAUSE_ACTIVE_DETECT;
     mprintf("// BeagleG: waiting for start switch\n");
-    const int flash_usec = 100 * 1000;
-    while (!hardware_mapping_->TestStartSwitch()) {
-      set_output_flags(HardwareMapping::NamedOutput::LED, true);
-      hardware_mapping_->SetAuxOutputs();
-      usleep(flash_usec);
-      set_output_flags(HardwareMapping::NamedOutput::LED, false);
+  }
+}
+
+// Returns true as long as we still need to wait for the start switch.
+bool GCodeMachineControl::Impl::still_waiting_for_start() {
+  uint64_t expirations;
+  if (read(start_wait_fd_, &expirations, sizeof(expirations)) < 0)
+    return true;  // Timer did not fire yet, nothing new.
+
+  const bool estop = check_for_estop();
+  if (!estop) {
+    if (pause_cleared_count_ < PAUSE_ACTIVE_DETECT) {
+      // The switch reading is debounced. We add additional delay by
+      // requiring it to be clear a few times in a row.
+      pause_cleared_count_ = check_for_pause() ? 0 : pause_cleared_count_ + 1;
+      if (pause_cleared_count_ < PAUSE_ACTIVE_DETECT)
+        return true;
+      mprintf("// BeagleG: pause switch cleared\n");
+      if (!hardware_mapping_->TestStartSwitch())
+        mprintf("// BeagleG: waiting for start switch\n");
+    }
+    if (!hardware_mapping_->TestStartSwitch()) {
+      start_wait_led_on_ = !start_wait_led_on_;
+      set_output_flags(HardwareMapping::NamedOutput::LED, start_wait_led_on_);
       hardware_mapping_->SetAuxOutputs();
-      usleep(flash_usec);
+      return true;
     }
   }
+
+  if (start_wait_led_on_) {
+    set_output_flags(HardwareMapping::NamedOutput::LED, false);
+    hardware_mapping_->SetAuxOutputs();
+  }
+  close(start_wait_fd_);
+  start_wait_fd_ = -1;
+  if (in_feed_hold_) {
+    // After an E-Stop, the queue is gone; nothing left to ramp up.
+    motor_ops_->SetSpeedFactor(queue_speed_factor_,
+                               estop ? 0 : speed_ramp_seconds_);
+    in_feed_hold_ = false;
+  }
+  return false;
 }
 
 bool GCodeMachineControl::Impl::in_estop() {
@@ -451,6 +615,35 @@ bool GCodeMachineControl::Impl::check_for_pause() {
   return hardware_mapping_->TestPauseSwitch();
 }
 
+static int64_t get_monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Reading the (debounced) pause switch takes a while, so while G-code is
+// streaming in, we only look every now and then.
+void GCodeMachineControl::Impl::check_for_feed_hold() {
+  if (!pause_enabled_ || start_wait_fd_ >= 0) return;
+  const int64_t now = get_monotonic_usec();
+  if (now < next_feed_hold_check_usec_) return;
+  next_feed_hold_check_usec_ = now + 20 * 1000;
+  if (check_for_pause()) feed_hold();
+}
+
+// Bring the machine to a stop wherever it is, without losing the queued
+// path or the position: the motion queue decelerates to zero speed within
+// the acceleration limits. After the start signal, the motion continues from
+// there.
+void GCodeMachineControl::Impl::feed_hold() {
+  Log_debug("Pause input detected, feed hold. Waiting for Start");
+  motor_ops_->SetSpeedFactor(0, speed_ramp_seconds_);
+  start_waiting(true);
+  if (start_wait_fd_ < 0) {  // Can't wait; better keep going than be stuck.
+    motor_ops_->SetSpeedFactor(queue_speed_factor_, speed_ramp_seconds_);
+  }
+}
+
 void GCodeMachineControl::Impl::handle_M105() {
   mprintf("// ");
   for (int chan = 0; chan < 8; chan++) {
@@ -805,6 +998,12 @@ void GCodeMachineControl::Impl::clamp_to_range(AxisBitmap_t affected,
 
 bool GCodeMachineControl::Impl::coordinated_move(float feed,
                                                  const AxesRegister &axis) {
+  return coordinated_curve_move(feed, axis, 0);
+}
+
+bool GCodeMachineControl::Impl::coordinated_curve_move(float feed,
+                                                       const AxesRegister &axis,
+                                                       float curve_radius) {
   if (!test_homing_status_ok())
     return false;
   if (!test_within_machine_limits(axis))
@@ -818,7 +1017,7 @@ bool GCodeMachineControl::Impl::coordinated_move(float feed,
   }
 
   float feedrate = prog_speed_factor_ * current_feedrate_mm_per_sec_;
-  if (!planner_->Enqueue(axis, feedrate)) {
+  if (!planner_->Enqueue(axis, feedrate, curve_radius)) {
     if (check_for_estop()) return false;
   }
   return true;
@@ -864,8 +1063,17 @@ void GCodeMachineControl::Impl::dwell(float value) {
   }
 }
 
+// Asked before each line of G-code: a good moment to look for a feed hold,
+// as nothing new is enqueued until it is over.
+int GCodeMachineControl::Impl::input_blocked_fd() {
+  check_for_feed_hold();
+  if (start_wait_fd_ >= 0 && still_waiting_for_start())
+    return start_wait_fd_;
+  return planner_->QueueFullFd();
+}
+
 void GCodeMachineControl::Impl::input_idle(bool is_first) {
-  planner_->BringPathToHalt();
+  planner_->RequestPathHalt();
   if (cfg_.auto_motor_disable_seconds > 0) {
     if (is_first) {
       next_auto_disable_motor_ = time(NULL) + cfg_.auto_motor_disable_seconds;
@@ -883,7 +1091,11 @@ void GCodeMachineControl::Impl::input_idle(bool is_first) {
     set_fanspeed(0);
     next_auto_disable_fan_ = -1;
   }
-  check_for_estop();
+  if (!check_for_estop()) {
+    check_for_feed_hold();
+  }
+  // Without input, nobody else looks for the start switch.
+  if (start_wait_fd_ >= 0) still_waiting_for_start();
 }
 
 void GCodeMachineControl::Impl::set_speed_factor(float value) {
@@ -895,7 +1107,20 @@ void GCodeMachineControl::Impl::set_speed_factor(float value) {
             100.0f * value);
     return;
   }
-  prog_speed_factor_ = value;
+  // Slowing down is applied to the motion queue, so that it takes effect
+  // right away, including the moves that are already planned. Going faster
+  // than programmed has to be planned within the machine limits, so only
+  // applies to new moves.
+  prog_speed_factor_ = std::max(value, 1.0f);
+  queue_speed_factor_ = std::min(value, 1.0f);
+  motor_ops_->SetSpeedFactor(queue_speed_factor_, speed_ramp_seconds_);
+}
+
+void GCodeMachineControl::Impl::set_path_blending(float tolerance_mm) {
+  // Without given tolerance, we use what is configured for corners anyway.
+  planner_->SetPathBlending(tolerance_mm < 0
+                            ? cfg_.junction_deviation
+                            : tolerance_mm);
 }
 
 // Moves to endstop and returns how many steps it moved in the process.
@@ -912,6 +1137,25 @@ int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
   const int dir = trigger == HardwareMapping::TRIGGER_MIN ? -1 : 1;
   float v0 = 0;
   float v1 = feedrate;
+
+  // If the motion hardware can watch the switch, it stops right there
+  // without us polling it in between short moves.
+  EndstopSwitch endstop;
+  if (!hardware_mapping_->TestAxisSwitch(axis, trigger)
+      && hardware_mapping_->GetAxisSwitch(axis, trigger, &endstop)) {
+    const float max_distance = std::max(cfg_.move_range_mm[axis], kHomingMM);
+    bool triggered = false;
+    while (!triggered) {
+      if (hardware_mapping_->TestEStopSwitch()) return 0;
+      int steps;
+      if (!planner_->DirectDriveToEndstop(axis, dir * max_distance, v0, v1,
+                                          endstop, &steps, &triggered))
+        break;  // Not supported: poll below.
+      total_movement += steps;
+      v0 = v1;
+    }
+  }
+
   while (!hardware_mapping_->TestAxisSwitch(axis, trigger)) {
     if (hardware_mapping_->TestEStopSwitch()) return 0;
     total_movement += planner_->DirectDrive(axis, dir * kHomingMM, v0, v1);
@@ -1061,6 +1305,10 @@ void GCodeMachineControl::GetCurrentPosition(AxesRegister *pos) {
   impl_->GetCurrentPosition(pos);
 }
 
+void GCodeMachineControl::GetPlannerStats(PlannerStats *stats) {
+  impl_->GetPlannerStats(stats);
+}
+
 GCodeParser::EventReceiver *GCodeMachineControl::ParseEventReceiver() {
   return impl_;
 }
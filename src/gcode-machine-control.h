@@ -22,10 +22,12 @@
 #include "gcode-parser/gcode-parser.h"
 #include "common/container.h"
 #include "hardware-mapping.h"
+#include "input-shaper.h"
 
 #include <string>
 
 class MotorOperations;
+struct PlannerStats;
 class ConfigParser;
 class Spindle;
 typedef AxesRegister FloatAxisConfig;
@@ -46,12 +48,27 @@ struct MachineControlConfig {
 
   FloatAxisConfig max_feedrate;   // Max feedrate for axis (mm/s)
   FloatAxisConfig acceleration;   // Max acceleration for axis (mm/s^2)
+  FloatAxisConfig max_jerk;       // Max jerk for axis (mm/s^3). 0: no limit.
 
   FloatAxisConfig max_probe_feedrate; // Max probe feedrate for axis (mm/s)
 
+  // Input shaping of the motion of each axis, see InputShaper.
+  FixedArray<InputShaper::Type, GCODE_NUM_AXES> shaper_type;
+  FloatAxisConfig shaper_frequency;  // Resonance frequency (Hz)
+  FloatAxisConfig shaper_damping;    // Damping ratio of resonance (0..1)
+
+  float pressure_advance;     // Extruder advance per extrusion speed (s).
+
   float speed_factor;         // Multiply feed with. Should be 1.0 by default.
-  float threshold_angle;      // Threshold angle to ignore speed changes
-  float speed_tune_angle;     // Angle added to the angle between vectors for speed tuning
+  float junction_deviation;   // Deviation from corners (mm) to determine speed
+  int lookahead;              // Number of targets the planner looks ahead.
+  float merge_tolerance;      // Merge nearly collinear moves within (mm).
+  bool threaded_planner;      // Run planner in its own thread.
+
+  // Geometry of a linear delta; only used with delta kinematics.
+  float delta_radius;         // Horizontal rod length if effector centered.
+  float delta_rod_length;     // Length of the diagonal rods.
+  float delta_segment_tolerance;  // Deviation of segments from path (mm).
 
   std::string home_order;        // Order in which axes are homed.
 
@@ -69,6 +86,7 @@ struct MachineControlConfig {
   bool debug_print;             // Print step-tuples to output_fd if 1.
   bool synchronous;             // Don't queue, wait for command to finish if 1.
   bool enable_pause;            // Enable pause switch detection. Default 0.
+  std::string planner_trace_file; // If set, record planner in- and output.
 };
 
 // A class that controls a machine via gcode.
@@ -124,6 +142,9 @@ class GCodeMachineControl {
   // Can only be called in the same thread that also handles gcode updates.
   void GetCurrentPosition(AxesRegister *pos);
 
+  // Return what the planner did so far, see PlannerStats.
+  void GetPlannerStats(PlannerStats *stats);
+
  private:
   class Impl;
 
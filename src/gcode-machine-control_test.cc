@@ -31,8 +31,6 @@ static void init_test_config(struct MachineControlConfig *c,
     c->acceleration[axis] = 1000;  // mm/s^2
     c->max_feedrate[axis] = (i+1) * 1000;
   }
-  c->threshold_angle = 0;
-  c->speed_tune_angle = 0;
   c->require_homing = false;
 }
 
@@ -60,6 +58,7 @@ public:
   void WaitQueueEmpty() final {}
   bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
   void SetExternalPosition(int axis, int steps) final { }
+  void SetSpeedFactor(float factor, float ramp_seconds) final { }
 
 private:
   // Helpers to compare and print MotorMovements.
@@ -44,13 +44,17 @@
 // of arcs with the BeagleBone Black CPU. Sufficient :)
 #define MM_PER_ARC_SEGMENT      0.1
 
+// Callback receiving the segments of a curve: the end position of the
+// segment and the radius of curvature there.
+typedef std::function<bool(const AxesRegister&, float)> CurveSegmentOutput;
+
 // Generate an arc. Input is the
 static bool arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
                     bool is_cw,                        // 0 CCW, 1 CW
                     AxesRegister *position_out,   // start position. Will be updated.
                     const AxesRegister &center,     // Offset to center.
                     const AxesRegister &target,     // Target position.
-                    std::function<bool(const AxesRegister&)> segment_output) {
+                    const CurveSegmentOutput &segment_output) {
   // Depending on the normal vector, pre-calc plane
   enum GCodeParserAxis plane[3];
   switch (normal_axis) {
@@ -107,6 +111,14 @@ static bool arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
   const float theta_per_segment = angular_travel / segments;
   const float linear_per_segment = linear_travel / segments;
 
+  // A helix is curved a bit less than the circle it winds around:
+  // with a rise of h per radian, the radius of curvature is (r^2 + h^2) / r.
+  // Without radius, the arc is a straight move along the normal axis.
+  const float rise = linear_travel / angular_travel;
+  const float curve_radius = radius > 0
+    ? (radius * radius + rise * rise) / radius
+    : 0;
+
   for (int i = 1; i < segments; i++) { // Increment (segments-1)
     const float cos_Ti = cosf(i * theta_per_segment);
     const float sin_Ti = sinf(i * theta_per_segment);
@@ -119,14 +131,14 @@ static bool arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
     position[plane[2]] += linear_per_segment;
 
     // Emit
-    if (!segment_output(position)) return false;
+    if (!segment_output(position, curve_radius)) return false;
   }
 
   // Ensure last segment arrives at target location.
   for (int axis = AXIS_X; axis <= AXIS_Z; axis++) {
     position[(GCodeParserAxis)axis] = target[(GCodeParserAxis)axis];
   }
-  return segment_output(position);
+  return segment_output(position, curve_radius);
 }
 
 static AxesRegister calc_bezier_point(float t,
@@ -152,11 +164,57 @@ static AxesRegister calc_bezier_point(float t,
   return p;
 }
 
+// Radius of curvature of the bezier curve at "t" in the XY plane: the
+// inverse of |B' x B''| / |B'|^3. Returns false where it is not defined
+// as B' vanishes.
+static bool bezier_curve_radius_at(float t,
+                                   const AxesRegister &p0,
+                                   const AxesRegister &p1,
+                                   const AxesRegister &p2,
+                                   const AxesRegister &p3,
+                                   float *radius) {
+  const float u = 1.0f - t;
+  float d1[2], d2[2];   // First and second derivative.
+  for (int i = 0; i < 2; ++i) {
+    const GCodeParserAxis a = (i == 0) ? AXIS_X : AXIS_Y;
+    d1[i] = (3.0f * u * u * (p1[a] - p0[a])
+             + 6.0f * u * t * (p2[a] - p1[a])
+             + 3.0f * t * t * (p3[a] - p2[a]));
+    d2[i] = (6.0f * u * (p2[a] - 2.0f * p1[a] + p0[a])
+             + 6.0f * t * (p3[a] - 2.0f * p2[a] + p1[a]));
+  }
+  const float speed = hypotf(d1[0], d1[1]);
+  const float cross = fabsf(d1[0] * d2[1] - d1[1] * d2[0]);
+  if (speed < 1e-6f) return false;
+  if (cross < 1e-9f)
+    *radius = HUGE_VALF;   // Straight.
+  else
+    *radius = speed * speed * speed / cross;
+  return true;
+}
+
+// Radius of curvature at "t". At a cusp, or where a control point sits on its
+// end point, it is not defined right there; we take the radius next to it,
+// which is tiny for a cusp, so the move slows down as needed.
+static float calc_bezier_curve_radius(float t,
+                                      const AxesRegister &p0,
+                                      const AxesRegister &p1,
+                                      const AxesRegister &p2,
+                                      const AxesRegister &p3) {
+  float radius;
+  if (bezier_curve_radius_at(t, p0, p1, p2, p3, &radius))
+    return radius;
+  const float next_t = (t < 0.5f) ? t + 0.001f : t - 0.001f;
+  if (bezier_curve_radius_at(next_t, p0, p1, p2, p3, &radius))
+    return radius;
+  return 1e-3f;   // Barely moving around here.
+}
+
 static bool spline_gen(const AxesRegister &start,
                        const AxesRegister &cp1,
                        const AxesRegister &cp2,
                        const AxesRegister &target,
-                std::function<bool(const AxesRegister& pos)> segment_output) {
+                       const CurveSegmentOutput &segment_output) {
 #if 0
   Log_debug("spline_gen: start:%.3f,%.3f cp1:%.3f,%.3f cp2:%.3f,%.3f end:%.3f,%.3f\n",
             position[AXIS_X], position[AXIS_Y],
@@ -165,10 +223,15 @@ static bool spline_gen(const AxesRegister &start,
             target[AXIS_X], target[AXIS_Y]);
 #endif
 
+  // Each segment is labeled with the curvature in its middle.
   for (float t = 0; t < 1; t += 0.01f) {
-    if (!segment_output(calc_bezier_point(t, start, cp1, cp2, target))) return false;
+    const float radius = calc_bezier_curve_radius(t > 0 ? t - 0.005f : 0,
+                                                  start, cp1, cp2, target);
+    if (!segment_output(calc_bezier_point(t, start, cp1, cp2, target),
+                        radius)) return false;
   }
-  return segment_output(target);
+  return segment_output(target, calc_bezier_curve_radius(0.995f, start, cp1,
+                                                         cp2, target));
 }
 
 bool GCodeParser::EventReceiver::arc_move(float feed_mm_p_sec,
@@ -179,9 +242,10 @@ bool GCodeParser::EventReceiver::arc_move(float feed_mm_p_sec,
                                           const AxesRegister &end) {
   AxesRegister position = start;
   return arc_gen(normal_axis, clockwise, &position,
-                 center, end, [this, feed_mm_p_sec](const AxesRegister &pos) {
-                                return coordinated_move(feed_mm_p_sec, pos);
-                });
+                 center, end,
+                 [this, feed_mm_p_sec](const AxesRegister &pos, float radius) {
+                   return coordinated_curve_move(feed_mm_p_sec, pos, radius);
+                 });
 }
 
 bool GCodeParser::EventReceiver::spline_move(float feed_mm_p_sec,
@@ -190,7 +254,9 @@ bool GCodeParser::EventReceiver::spline_move(float feed_mm_p_sec,
                                              const AxesRegister &cp2,
                                              const AxesRegister &end) {
   return spline_gen(start, cp1, cp2, end,
-                    [this, feed_mm_p_sec](const AxesRegister &pos) {
-                      return coordinated_move(feed_mm_p_sec, pos);
+                    [this, feed_mm_p_sec](const AxesRegister &pos,
+                                          float radius) {
+                      return coordinated_curve_move(feed_mm_p_sec, pos,
+                                                    radius);
                     });
 }
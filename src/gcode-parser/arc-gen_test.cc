@@ -19,6 +19,7 @@
 #include "gcode-parser.h"
 
 #include <math.h>
+#include <algorithm>
 #include <iostream>
 #include <gtest/gtest.h>
 
@@ -35,7 +36,8 @@
 
 class TestArcAccumulator : public GCodeParser::EventReceiver {
 public:
-  TestArcAccumulator(const AxesRegister &start) : last_(start), total_len_(0) {}
+  TestArcAccumulator(const AxesRegister &start)
+    : last_(start), total_len_(0), min_radius_(HUGE_VALF), max_radius_(0) {}
 
   void gcode_start(GCodeParser *parser) final {}
   void go_home(AxisBitmap_t axis_bitmap) final {}
@@ -52,7 +54,16 @@ public:
     return true;
   }
 
+  bool coordinated_curve_move(float feed_mm_p_sec, const AxesRegister &pos,
+                              float radius) final {
+    min_radius_ = std::min(min_radius_, radius);
+    max_radius_ = std::max(max_radius_, radius);
+    return coordinated_move(feed_mm_p_sec, pos);
+  }
+
   float total_len() const { return total_len_; }
+  float min_radius() const { return min_radius_; }
+  float max_radius() const { return max_radius_; }
 
   bool rapid_move(float feed_mm_p_sec,
                   const AxesRegister &absolute_pos) final { return true; }
@@ -63,6 +74,8 @@ public:
 private:
   AxesRegister last_;
   float total_len_;
+  float min_radius_;
+  float max_radius_;
 };
 
 static void testHalfTurnAnyStartPosition(bool clockwise) {
@@ -186,6 +199,67 @@ TEST(ArcGenerator, FullTurn_CCW) {
   testFullTurn(false);
 }
 
+TEST(ArcGenerator, PassesRadiusOfCurvature) {
+  AxesRegister start, center, target;
+  start[AXIS_X] = 5.0;
+  target[AXIS_X] = -5.0;
+
+  TestArcAccumulator arc(start);
+  arc.arc_move(100, AXIS_Z, false, start, center, target);
+  EXPECT_NEAR(5.0, arc.min_radius(), 1e-4);
+  EXPECT_NEAR(5.0, arc.max_radius(), 1e-4);
+
+  // A helix is a little less curved than the circle it winds around.
+  target[AXIS_Z] = 5 * M_PI;   // Rising as much as it goes around.
+  TestArcAccumulator helix(start);
+  helix.arc_move(100, AXIS_Z, false, start, center, target);
+  EXPECT_NEAR(10.0, helix.min_radius(), 1e-3);
+  EXPECT_NEAR(10.0, helix.max_radius(), 1e-3);
+}
+
+TEST(SplineGenerator, PassesRadiusOfCurvature) {
+  // The common bezier approximation of a quarter circle with radius 10.
+  const float k = 10 * 0.5523f;
+  AxesRegister start, cp1, cp2, target;
+  start[AXIS_X] = 10;
+  cp1[AXIS_X] = 10; cp1[AXIS_Y] = k;
+  cp2[AXIS_X] = k;  cp2[AXIS_Y] = 10;
+  target[AXIS_Y] = 10;
+
+  TestArcAccumulator spline(start);
+  spline.spline_move(100, start, cp1, cp2, target);
+  EXPECT_NEAR(10.0, spline.min_radius(), 0.5);
+  EXPECT_NEAR(10.0, spline.max_radius(), 0.5);
+
+  // Straight line: no curvature.
+  cp1[AXIS_X] = 7.5; cp1[AXIS_Y] = 2.5;
+  cp2[AXIS_X] = 2.5; cp2[AXIS_Y] = 7.5;
+  TestArcAccumulator line(start);
+  line.spline_move(100, start, cp1, cp2, target);
+  EXPECT_GT(line.min_radius(), 1e6);
+}
+
+TEST(SplineGenerator, RadiusWhereDirectionIsUndefined) {
+  AxesRegister start, cp1, cp2, target;
+
+  // Control point on the start: the curve starts without a direction, but
+  // the radius is taken from right next to it.
+  cp2[AXIS_X] = 10;
+  target[AXIS_X] = 10; target[AXIS_Y] = 10;
+  TestArcAccumulator from_control_point(start);
+  from_control_point.spline_move(100, start, start, cp2, target);
+  EXPECT_GT(from_control_point.min_radius(), 0);
+
+  // A cusp in the middle is as sharp as it gets.
+  cp1[AXIS_X] = 10; cp1[AXIS_Y] = 10;
+  cp2[AXIS_X] = 0;  cp2[AXIS_Y] = 10;
+  target[AXIS_X] = 10; target[AXIS_Y] = 0;
+  TestArcAccumulator cusp(start);
+  cusp.spline_move(100, start, cp1, cp2, target);
+  EXPECT_GT(cusp.min_radius(), 0);
+  EXPECT_LT(cusp.min_radius(), 1);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -135,6 +135,7 @@ private:
     callbacks()->set_speed_factor(1.0);
     callbacks()->set_fanspeed(0);
     callbacks()->set_temperature(0);
+    callbacks()->set_path_blending(0);  // G61
   }
 
   void InitCoordSystems();
@@ -245,6 +246,7 @@ private:
   const char *handle_arc(const char *line, bool is_cw);
   const char *handle_spline(float sub_command, const char *line);
   const char *handle_z_probe(const char *line);
+  const char *handle_G64(const char *line);
   const char *handle_M111(const char *line);
 
   // Read parameter from letter "param_letter" and call the event callback
@@ -1822,6 +1824,21 @@ const char *GCodeParser::Impl::handle_z_probe(const char *line) {
   return line;
 }
 
+const char *GCodeParser::Impl::handle_G64(const char *line) {
+  char letter;
+  float value;
+  float tolerance = -1;
+  const char *remaining_line;
+  while ((remaining_line = gparse_pair(line, &letter, &value))) {
+    if (letter == 'P') tolerance = value * unit_to_mm_factor_;
+    else if (letter == 'Q') {}   // Naive CAM tolerance. Not supported; ignore.
+    else break;
+    line = remaining_line;
+  }
+  callbacks()->set_path_blending(tolerance);
+  return line;
+}
+
 const char *GCodeParser::Impl::handle_M111(const char *line) {
   if (config_.allow_m111) {
     int level = -1;
@@ -1885,6 +1902,8 @@ void GCodeParser::Impl::ParseBlock(GCodeParser *owner,
       case 54: case 55: case 56: case 57: case 58: case 59:
         change_coord_system(value);
         break;
+      case 61: callbacks()->set_path_blending(0); break;
+      case 64: line = handle_G64(line); break;
       case 70: unit_to_mm_factor_ = 25.4f; break;
       case 71: unit_to_mm_factor_ = 1.0f; break;
       case 90: case 91: handle_G90_G91(value);  break;
@@ -1972,6 +1991,17 @@ bool GCodeParser::ReadFile(FILE *input_gcode_stream, FILE *err_stream) {
   if (input_gcode_stream == nullptr) return false;
   char buffer[8192];   // "8kB ought to be enough for everybody"
   while (fgets(buffer, sizeof(buffer), input_gcode_stream) != nullptr) {
+    // Nothing else to do meanwhile, so we simply wait if the receiver
+    // is not ready.
+    int blocked_fd;
+    while ((blocked_fd = impl_->callbacks()->input_blocked_fd()) >= 0) {
+      fd_set read_fds;
+      FD_ZERO(&read_fds);
+      FD_SET(blocked_fd, &read_fds);
+      if (select(blocked_fd + 1, &read_fds, NULL, NULL, NULL) < 0
+          && errno != EINTR)
+        break;
+    }
     impl_->ParseBlock(this, buffer, err_stream);
   }
   if (err_stream) {
@@ -97,6 +97,7 @@ public:
   // Closes input stream after EOF.
   // The input is expected to be a stream with no stalls, so no input_idle()
   // will be called (Reading from a socket ? Use GCodeStreamer instead.).
+  // If the EventReceiver is not ready for more input, this blocks until it is.
   //
   // Error messages are sent to "err_stream" if non-NULL.
   // Returns true on success.
@@ -206,7 +207,14 @@ public:
   // will have "is_first" set.
   virtual void input_idle(bool is_first) {}
 
-  // G24: Start/resume. Waits for the start input if available.
+  // Flow control for input that arrives faster than it can be processed.
+  // Returns -1 if the receiver is ready for more. Otherwise, the input
+  // should not be processed further until the returned file descriptor
+  // becomes readable; then ask again.
+  virtual int input_blocked_fd() { return -1; }
+
+  // G24: Start/resume. Waits for the start input if available. Waiting can
+  // also be done by holding off further input with input_blocked_fd().
   virtual void wait_for_start() {}
 
   // G28: Home all the axis whose bit is set. e.g. (1<<AXIS_X) for X
@@ -234,6 +242,11 @@ public:
   virtual void set_temperature(float degrees_c)=0; // M104, M109: Set temp. in Celsius
   virtual void wait_temperature() = 0;    // M109, M116: Wait for temp. reached.
   virtual void dwell(float time_ms) = 0;     // G4: dwell for milliseconds.
+
+  // G61: exact path (tolerance 0), G64 P<tolerance>: corners of the path may
+  // be rounded within the given tolerance in mm to keep up the speed.
+  // G64 without P is passed as a negative tolerance: receiver's choice.
+  virtual void set_path_blending(float tolerance_mm) {}
   virtual void motors_enable(bool enable) = 0;   // M17, M84, M18: Switch on/off motors
 
   // Give receiver an opportunity to modify a target coordinate, e.g. clamp
@@ -259,6 +272,17 @@ public:
   virtual bool rapid_move(float feed_mm_p_sec,
                           const AxesRegister &absolute_pos) = 0;        // G0
 
+  // Like coordinated_move(), but the move is a piece of a curve (arc or
+  // spline) with the given radius of curvature in mm. Receivers can use
+  // this to limit the speed to what the centripetal acceleration allows.
+  // Radius zero is used if it is not known.
+  // The default implementation just calls coordinated_move().
+  virtual bool coordinated_curve_move(float feed_mm_p_sec,
+                                      const AxesRegister &absolute_pos,
+                                      float curve_radius_mm) {
+    return coordinated_move(feed_mm_p_sec, absolute_pos);
+  }
+
   // G2, G3
   // Arc in a circular motion from current position around the "center"
   // coordinate to the "end" coordinate. These coordinates are absolute.
@@ -266,8 +290,8 @@ public:
   // Movement outside the axes orthogonal to the normal axis are linearly
   // interpolated from their current position (e.g. creating a spiral).
   //
-  // The default implementation linearlizes it and calls coordinated_move()
-  // with small line segments.
+  // The default implementation linearlizes it and calls
+  // coordinated_curve_move() with small line segments.
   //
   // TODO(hzeller): We could probably generalize this by having a
   //  'normal vector' instead of normal_axis + clockwise. This would allow for
@@ -281,8 +305,8 @@ public:
   // G5, G5.1
   // Move in a cubic spine from absolute "start" to "end" given the absolute
   // control points "cp1" and "cp2".
-  // The default implementation linearlizes curve and calls coordinated_move()
-  // with the segments.
+  // The default implementation linearlizes curve and calls
+  // coordinated_curve_move() with the segments.
   virtual bool spline_move(float feed_mm_p_sec,
                            const AxesRegister &start,
                            const AxesRegister &cp1, const AxesRegister &cp2,
@@ -34,7 +34,7 @@ enum {
 
 class ParseTester : public GCodeParser::EventReceiver {
 public:
-  ParseTester() : feedrate(-1) {
+  ParseTester() : feedrate(-1), path_blending(-42) {
     bzero(call_count, sizeof(call_count));
     GCodeParser::Config config;
     // some arbitrary machine origins to see that they are honored.
@@ -94,6 +94,8 @@ public:
     return NULL;
   }
 
+  void set_path_blending(float tolerance) final { path_blending = tolerance; }
+
   // Not interested.
   void set_speed_factor(float factor) final {}
   void set_fanspeed(float value) final {}
@@ -107,6 +109,7 @@ public:
   AxesRegister abs_pos;         // last coordinates we got from a move.
   AxesRegister parser_offset;   // current offset in the parser
   float feedrate;
+  float path_blending;
 
 private:
   void Count(int what) { call_count[what]++; }
@@ -161,6 +164,24 @@ TEST(GCodeParserTest, setting_feedrate) {
   EXPECT_EQ(100.0f / 60.0f, counter.feedrate);
 }
 
+TEST(GCodeParserTest, path_blending_mode) {
+  ParseTester counter;
+  EXPECT_EQ(0, counter.path_blending);   // Program default: G61
+
+  counter.TestParseLine("G64 P0.05");
+  EXPECT_FLOAT_EQ(0.05f, counter.path_blending);
+
+  counter.TestParseLine("G61");
+  EXPECT_EQ(0, counter.path_blending);
+
+  counter.TestParseLine("G64");          // No tolerance given.
+  EXPECT_LT(counter.path_blending, 0);
+
+  counter.TestParseLine("G20 G64 P0.01 Q0.01");  // tolerance in inch.
+  EXPECT_FLOAT_EQ(0.254f, counter.path_blending);
+  EXPECT_EQ(0, counter.call_count[CALL_unprocessed]);
+}
+
 TEST(GCodeParserTest, ParsingCompactNumbers) {
   // Coordinates are valid without spaces in-between
   ParseTester counter;
@@ -25,7 +25,8 @@
 GCodeStreamer::GCodeStreamer(FDMultiplexer *event_server, GCodeParser *parser,
                              GCodeParser::EventReceiver *parse_events)
   : event_server_(event_server), parser_(parser), parse_events_(parse_events),
-    is_processing_(false), connection_fd_(-1), lines_processed_(0) {
+    is_processing_(false), input_blocked_(false),
+    connection_fd_(-1), lines_processed_(0) {
   // Let's start the input idle tasklet
   // TODO: the lifetime implications are a bit problematic as we need to
   // outlive the Loop() of the event server.
@@ -82,21 +83,55 @@ bool GCodeStreamer::ReadData() {
   }
 
   is_processing_ = true;
-  const char *line;
-  while ((line = reader_.ReadLine())) {
+  const int blocked_fd = ProcessLines();
+  if (blocked_fd >= 0) {
+    WaitForReceiver(blocked_fd);
+    return false;  // Don't read more until the receiver is ready.
+  }
+
+  // Loop again
+  return true;
+}
+
+// Parse the lines we have buffered as long as the receiver keeps up.
+// Returns -1 if all are parsed, otherwise the file descriptor the
+// receiver wants us to wait for.
+int GCodeStreamer::ProcessLines() {
+  for (;;) {
+    const int blocked_fd = parse_events_->input_blocked_fd();
+    if (blocked_fd >= 0) return blocked_fd;
+    const char *line = reader_.ReadLine();
+    if (!line) return -1;
     // NOTE:(important)
     // This should return true or false in case the line was movement or not
     // and only if is, reset the timer.
     parser_->ParseBlock(line, msg_stream_);
     ++lines_processed_;
   }
+}
 
-  // Loop again
-  return true;
+// While we wait, the connection is not read. This way, the sender notices
+// that we are busy, while the event loop is free to do other things.
+void GCodeStreamer::WaitForReceiver(int blocked_fd) {
+  input_blocked_ = true;
+  event_server_->RunOnReadable(blocked_fd, [this, blocked_fd]() {
+      const int still_blocked_fd = ProcessLines();
+      if (still_blocked_fd == blocked_fd) return true;  // Continue waiting.
+      if (still_blocked_fd >= 0) {
+        WaitForReceiver(still_blocked_fd);
+        return false;
+      }
+      input_blocked_ = false;
+      event_server_->RunOnReadable(connection_fd_, [this]() {
+          return ReadData();
+        });
+      return false;
+    });
 }
 
 // We didn't receive a line within x milliseconds.
 bool GCodeStreamer::Timeout() {
+  if (input_blocked_) return true;  // Not idle, we are just waiting.
   parse_events_->input_idle(is_processing_);
   is_processing_ = false;
   return true;
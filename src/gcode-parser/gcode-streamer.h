@@ -47,12 +47,15 @@ private:
 
   LinebufReader reader_;
   bool is_processing_;
+  bool input_blocked_;   // Receiver asked us to hold off reading.
 
   FILE *msg_stream_;
   int connection_fd_;
   int lines_processed_;
 
   bool ReadData();
+  int ProcessLines();
+  void WaitForReceiver(int blocked_fd);
   bool Timeout();
 };
 
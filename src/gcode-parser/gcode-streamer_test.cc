@@ -59,7 +59,9 @@ public:
   StreamTester()
     : parser_(new GCodeParser(GCodeParser::Config(), this)),
       streamer_(new GCodeStreamer(&event_server_, parser_.get(), this)),
-      stream_mock_(NULL) {}
+      stream_mock_(NULL) {
+    ON_CALL(*this, input_blocked_fd()).WillByDefault(::testing::Return(-1));
+  }
 
   bool OpenStream() {
     assert(stream_mock_ == NULL);
@@ -84,6 +86,7 @@ public:
   MOCK_METHOD1(gcode_start, void(GCodeParser *parser));
   MOCK_METHOD1(gcode_finished, void(bool end_of_stream));
   MOCK_METHOD1(input_idle, void(bool is_first));
+  MOCK_METHOD0(input_blocked_fd, int());
   MOCK_METHOD2(coordinated_move,
                bool(float feed_mm_p_sec, const AxesRegister &absolute_pos));
 
@@ -174,6 +177,37 @@ TEST(Streaming, basic_stream) {
   tester.Cycle(); // Wait the stream to close
 }
 
+// If the receiver can't keep up, we stop parsing and only continue once
+// it signals on the file descriptor it handed us. That is not idle time.
+TEST(Streaming, receiver_blocks_input) {
+  StreamTester tester;
+  int wake_fd[2];
+  ASSERT_EQ(0, pipe(wake_fd));
+
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, input_idle(_)).Times(0);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(1);
+  EXPECT_CALL(tester, input_blocked_fd())
+    .WillOnce(Return(-1))
+    .WillRepeatedly(Return(wake_fd[0]));
+  tester.OpenStream();
+  tester.SendString("G1X100F1000\nG1X200F1000\n");
+  tester.Cycle();  // Reads both lines, but only parses the first.
+  tester.Cycle();  // Timeout, but we are waiting for the receiver.
+  Mock::VerifyAndClearExpectations(&tester);
+
+  EXPECT_CALL(tester, input_blocked_fd()).WillRepeatedly(Return(-1));
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(1);
+  ASSERT_EQ(1, write(wake_fd[1], "x", 1));
+  tester.Cycle();  // Receiver is ready again: the second line is parsed.
+
+  EXPECT_CALL(tester, gcode_finished(_)).Times(1);
+  tester.CloseStream();
+  tester.Cycle();  // Reading from the stream again, it closes.
+  close(wake_fd[0]);
+  close(wake_fd[1]);
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
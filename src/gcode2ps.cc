@@ -871,6 +871,7 @@ public:
       EmitMovetoPos();
     }
   }
+  void SetSpeedFactor(float factor, float ramp_seconds) final {}  // We show planned speeds.
 
   void EmitMovetoPos() {
     fprintf(file_, "%f %f %f moveto3d  %% Homing one or more axes.\n",
@@ -970,8 +971,7 @@ static int usage(const char *progname, bool description = false) {
           "\t-o <output-file>  : Name of output file; stdout default.\n"
           "\t-c <config>       : BeagleG machine config.\n"
           "\t-T <tool-diameter>: Tool diameter in mm.\n"
-          "\t-t <threshold-angle>  : Threshold angle for accleration opt.\n"
-          "\t-A <speed-tune-angle> : Speed tuning angle for accleration opt.\n"
+          "\t-j <deviation-mm> : Junction deviation for cornering speed.\n"
           "\t-q                : Quiet.\n"
           "\t-s                : Visualize movement speeds.\n"
           "\t-D                : Don't show dimensions.\n"
@@ -1094,8 +1094,7 @@ int main(int argc, char *argv[]) {
   bool show_dimensions = true;
   bool show_machine_path = true;  // Also requires config.
   bool show_gcode_path = true;
-  float threshold_angle = 10;   // Same defaults as machine control.
-  float speed_tune_angle = 60;
+  float junction_deviation = -1;   // Default: use config file.
   bool range_check = false;
   float scale = 1.0f;
   float bounding_box_width_mm = -1;
@@ -1106,7 +1105,7 @@ int main(int argc, char *argv[]) {
   float grid = -1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "a:A:c:C:De:g:GilMo:P:qrR:sS:t:T:V:w:Y:")) != -1) {
+  while ((opt = getopt(argc, argv, "a:c:C:De:g:Gij:lMo:P:qrR:sS:T:V:w:Y:")) != -1) {
     switch (opt) {
     case 'o':
       out_filename = optarg;
@@ -1115,11 +1114,8 @@ int main(int argc, char *argv[]) {
     case 'q':
       quiet = true;
       break;
-    case 't':
-      threshold_angle = (float)atof(optarg);
-      break;
-    case 'A':
-      speed_tune_angle = (float)atof(optarg);
+    case 'j':
+      junction_deviation = (float)atof(optarg);
       break;
     case 'g':
       grid = (float)atof(optarg);
@@ -1280,8 +1276,8 @@ int main(int argc, char *argv[]) {
   if (show_dimensions) gcode_printer.ShowMesaureLines();
 
   if (config_file && show_machine_path) {
-    machine_config.threshold_angle = threshold_angle;
-    machine_config.speed_tune_angle = speed_tune_angle;
+    if (junction_deviation >= 0)
+      machine_config.junction_deviation = junction_deviation;
     machine_config.acknowledge_lines = false;
     machine_config.range_check = range_check;
 
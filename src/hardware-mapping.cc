@@ -31,7 +31,8 @@
 #include "motor-operations.h"  // LinearSegmentSteps
 
 HardwareMapping::HardwareMapping()
-  : estop_input_(0), pause_input_(0), start_input_(0), probe_input_(0),
+  : kinematics_(Kinematics::CARTESIAN),
+    estop_input_(0), pause_input_(0), start_input_(0), probe_input_(0),
     estop_state_(true), motors_enabled_(false), aux_bits_(0),
     is_hardware_initialized_(false) {
 }
@@ -269,26 +270,43 @@ std::string HardwareMapping::DebugMotorString(LogicAxis axis) {
 
 void HardwareMapping::AssignMotorSteps(LogicAxis axis, int steps,
                                        LinearSegmentSteps *out) {
-  const MotorBitmap motormap_for_axis = axis_to_driver_[axis];
-  for (int motor = 0; motor < NUM_MOTORS; ++motor) {
-    if (motormap_for_axis & (1 << motor)) {
-      out->steps[motor] = steps;
+  MotorBitmap plus = axis_to_driver_[axis];
+  MotorBitmap minus = 0;
+  if (IsCoreXY()) {
+    // A = X + Y; B = X - Y
+    if (axis == AXIS_X) plus = axis_to_driver_[AXIS_X] | axis_to_driver_[AXIS_Y];
+    if (axis == AXIS_Y) {
+      plus = axis_to_driver_[AXIS_X];
+      minus = axis_to_driver_[AXIS_Y];
     }
   }
+  for (int motor = 0; motor < NUM_MOTORS; ++motor) {
+    if (plus & (1 << motor)) out->steps[motor] += steps;
+    if (minus & (1 << motor)) out->steps[motor] -= steps;
+  }
+}
+
+int HardwareMapping::FirstMotorFor(LogicAxis axis) const {
+  for (int motor = 0; motor < NUM_MOTORS; ++motor) {
+    if (axis_to_driver_[axis] & (1 << motor)) return motor;
+  }
+  return -1;
 }
 
 int HardwareMapping::GetAxisSteps(LogicAxis axis, const PhysicalStatus &status) {
-  uint8_t mask = axis_to_driver_[axis];
-  int m = 0;
-  while (((mask & 0x01) != 0x01) && m < NUM_MOTORS) {
-    // while the first bit is not 1, iterate.
-    mask = mask >> 1;
-    m++;
+  if (IsCoreXY() && (axis == AXIS_X || axis == AXIS_Y)) {
+    // X = (A + B) / 2; Y = (A - B) / 2
+    const int a = FirstMotorFor(AXIS_X);
+    const int b = FirstMotorFor(AXIS_Y);
+    if (a < 0 || b < 0) return 0;
+    const int a_steps = status.pos_steps[a];
+    const int b_steps = status.pos_steps[b];
+    return (axis == AXIS_X ? a_steps + b_steps : a_steps - b_steps) / 2;
   }
 
   // Maybe this axis is not mapped to any motor.
-  if (m == NUM_MOTORS) return 0;
-  return status.pos_steps[m];
+  const int m = FirstMotorFor(axis);
+  return m < 0 ? 0 : status.pos_steps[m];
 }
 
 HardwareMapping::AxisTrigger HardwareMapping::AvailableAxisSwitch(LogicAxis axis) {
@@ -331,6 +349,22 @@ bool HardwareMapping::TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigg
   return result;
 }
 
+bool HardwareMapping::GetAxisSwitch(LogicAxis axis, AxisTrigger trigger,
+                                    EndstopSwitch *endstop) {
+  if (!is_hardware_initialized_) return false;
+  int switch_number;
+  switch (trigger) {
+  case TRIGGER_MIN: switch_number = axis_to_min_endstop_[axis]; break;
+  case TRIGGER_MAX: switch_number = axis_to_max_endstop_[axis]; break;
+  default: return false;
+  }
+  const GPIODefinition gpio_def = get_endstop_gpio_descriptor(switch_number);
+  if (gpio_def == GPIO_NOT_MAPPED) return false;
+  endstop->gpio = gpio_def;
+  endstop->trigger_level = trigger_level_[switch_number-1];
+  return true;
+}
+
 bool HardwareMapping::TestEStopSwitch() {
   return TestSwitch(estop_input_, false);
 }
@@ -379,6 +413,8 @@ public:
     }
 
     if (current_section_ == "motor-mapping") {
+      if (name == "kinematics")
+        return SetKinematics(line_no, value);
       for (int i = 1; i <= NUM_MOTORS; ++i) {
         if (name == StringPrintf("motor_%d", i))
           return SetMotorAxis(line_no, i, value);
@@ -441,6 +477,26 @@ private:
   }
 
 
+  bool SetKinematics(int line_no, const std::string &value) {
+    const std::string kinematics = ToLower(value);
+    if (kinematics == "cartesian") {
+      config_->SetKinematics(Kinematics::CARTESIAN);
+    } else if (kinematics == "corexy") {
+      config_->SetKinematics(Kinematics::COREXY);
+    } else if (kinematics == "hbot") {
+      config_->SetKinematics(Kinematics::HBOT);
+    } else if (kinematics == "delta") {
+      config_->SetKinematics(Kinematics::DELTA);
+    } else {
+      ReportError(line_no, StringPrintf("Unknown kinematics '%s'; choose one "
+                                        "of cartesian, corexy, hbot, delta",
+                                        value.c_str()));
+      return false;
+    }
+    Log_debug("Kinematics: %s", kinematics.c_str());
+    return true;
+  }
+
   bool SetMotorAxis(int line_no, int motor_number, const std::string &in_val) {
     std::vector<StringPiece> options = SplitString(in_val, " \t,");
     for (size_t i = 0; i < options.size(); ++i) {
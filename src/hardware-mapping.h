@@ -91,6 +91,20 @@ public:
     TRIGGER_ANY  = 0x03    // Any of the axis is triggering
   };
 
+  // How the axes translate to motor movements.
+  enum class Kinematics {
+    CARTESIAN,  // Each motor moves exactly one axis.
+    // The motors mapped to X and Y (A and B) both drive the XY gantry with
+    // one belt: A = X + Y, B = X - Y. The same transformation applies to
+    // H-bot; it only differs mechanically.
+    COREXY,
+    HBOT,
+    // Linear delta: the motors mapped to X, Y and Z drive the carriages of
+    // the towers; see DeltaKinematics. The planner does the conversion, so
+    // for the motors this looks like CARTESIAN.
+    DELTA,
+  };
+
   enum class NamedOutput {
     MIST,              // M7 = on; M9 = off
     FLOOD,             // M8 = on; M9 = off
@@ -138,6 +152,15 @@ public:
   // A value of 0 for 'motor' is accepted but does not connect it to anything.
   bool AddMotorMapping(LogicAxis axis, int motor, bool mirrored);
 
+  // Choose kinematics. Default is CARTESIAN.
+  void SetKinematics(Kinematics kinematics) { kinematics_ = kinematics; }
+  Kinematics GetKinematics() const { return kinematics_; }
+
+  // CoreXY and H-bot mix the X and Y axes in the motors.
+  bool IsCoreXY() const {
+    return kinematics_ == Kinematics::COREXY || kinematics_ == Kinematics::HBOT;
+  }
+
   // Determine if we have a motor configured for given axis.
   bool HasMotorFor(LogicAxis axis) const { return axis_to_driver_[axis] != 0; }
 
@@ -205,8 +228,10 @@ public:
   // Given the logic axis, return a mask of the physical output drivers.
   uint8_t GetMotorMap(LogicAxis axis) { return axis_to_driver_[axis]; }
 
-  // Given the logic axis and number of steps, assign these steps to the mapped
-  // motors in the LinearSegmentSteps
+  // Given the logic axis and number of steps, add these steps to the
+  // motors in the LinearSegmentSteps that move this axis according to the
+  // kinematics. To get the motor steps of a move, start with zero steps and
+  // call this for every axis.
   void AssignMotorSteps(LogicAxis axis, int steps, LinearSegmentSteps *out);
 
   // Returns the number of step for the requested logic axis from the physical status,
@@ -228,6 +253,12 @@ public:
   // this will always return false.
   bool TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigger);
 
+  // Get the input the MIN or MAX endstop of given axis is connected to, so
+  // that the motion hardware can watch it. Returns false if there is none
+  // or if the hardware is only simulated.
+  bool GetAxisSwitch(LogicAxis axis, AxisTrigger trigger,
+                     EndstopSwitch *endstop);
+
   // Returns true if the E-Stop input is active.
   bool TestEStopSwitch();
 
@@ -259,6 +290,9 @@ private:
   // hardware pin.
   typedef uint32_t GPIODefinition;
 
+  // Returns the first motor mapped to given axis or -1 if there is none.
+  int FirstMotorFor(LogicAxis axis) const;
+
   // Converts the human readable name of an output to the enumeration if possible.
   static bool NameToOutput(StringPiece str, NamedOutput *result);
   static const char *OutputToName(NamedOutput output);
@@ -284,6 +318,7 @@ private:
   // Bitmap of drivers output should go.
   FixedArray<MotorBitmap, GCODE_NUM_AXES> axis_to_driver_;
   FixedArray<int, NUM_MOTORS> driver_flip_;  // 1 or -1 for for individual driver
+  Kinematics kinematics_;
 
   FixedArray<int, GCODE_NUM_AXES> axis_to_min_endstop_;
   FixedArray<int, GCODE_NUM_AXES> axis_to_max_endstop_;
@@ -0,0 +1,273 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "input-shaper.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+// Points where the shaped speed changes its slope that are closer than this
+// are not worth an extra segment.
+static constexpr double kMinSegmentSeconds = 1e-4;
+
+bool InputShaper::ParseType(const std::string &name, Type *type) {
+  if (name == "none")     *type = NONE;
+  else if (name == "zv")  *type = ZV;
+  else if (name == "zvd") *type = ZVD;
+  else if (name == "mzv") *type = MZV;
+  else return false;
+  return true;
+}
+
+InputShaper::InputShaper(MotorOperations *out)
+  : out_(out), max_delay_(0), end_time_(0),
+    emitted_time_(0), segment_start_(0), aux_bits_(0) {
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    impulses_[i] = { { 0, 1 } };
+    total_[i] = 0;
+    emitted_steps_[i] = 0;
+  }
+}
+
+// Impulses as commonly used, see e.g. Singer & Seering, "Preshaping Command
+// Inputs to Reduce System Vibration".
+void InputShaper::SetMotorShaper(int motor, Type type,
+                                 float frequency, float damping) {
+  std::vector<Impulse> &impulses = impulses_[motor];
+  const double damped_period = 1.0 / (frequency * sqrt(1 - damping*damping));
+  const double k = exp(-damping * M_PI / sqrt(1 - damping*damping));
+  switch (type) {
+  case NONE:
+    impulses = { { 0, 1 } };
+    break;
+  case ZV:
+    impulses = { { 0, 1 }, { 0.5 * damped_period, k } };
+    break;
+  case ZVD:
+    impulses = { { 0, 1 }, { 0.5 * damped_period, 2 * k },
+                 { damped_period, k * k } };
+    break;
+  case MZV: {
+    const double mk = exp(-0.75 * damping * M_PI / sqrt(1 - damping*damping));
+    const double a1 = 1 - 1 / M_SQRT2;
+    impulses = { { 0, a1 }, { 0.375 * damped_period, (M_SQRT2 - 1) * mk },
+                 { 0.75 * damped_period, a1 * mk * mk } };
+    break;
+  }
+  }
+  double sum = 0;
+  for (const Impulse &i : impulses) sum += i.amplitude;
+  for (Impulse &i : impulses) i.amplitude /= sum;
+
+  max_delay_ = 0;
+  for (const std::vector<Impulse> &motor_impulses : impulses_) {
+    max_delay_ = std::max(max_delay_, motor_impulses.back().delay);
+  }
+}
+
+bool InputShaper::Enqueue(const LinearSegmentSteps &segment) {
+  return Enqueue(&segment, 1);
+}
+
+bool InputShaper::Enqueue(const LinearSegmentSteps *segments, int count) {
+  if (max_delay_ == 0)
+    return out_->EnqueueMany(segments, count);
+  for (int i = 0; i < count; ++i) {
+    Shape(segments[i]);
+  }
+  const bool ret = out_->EnqueueMany(output_.data(), output_.size());
+  output_.clear();
+  return ret;
+}
+
+void InputShaper::Shape(const LinearSegmentSteps &segment) {
+  int defining_steps = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    defining_steps = std::max(defining_steps, abs(segment.steps[i]));
+  }
+  if (defining_steps == 0 || segment.v0 + segment.v1 <= 0) {
+    // Only aux bits; the planner sends these while the path is halted.
+    Flush();
+    output_.push_back(segment);
+    return;
+  }
+
+  Piece piece;
+  piece.start = end_time_;
+  piece.duration = 2.0 * defining_steps / (segment.v0 + segment.v1);
+  piece.v0 = segment.v0;
+  piece.accel = (segment.v1 - segment.v0) / piece.duration;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    piece.start_pos[i] = total_[i];
+    piece.ratio[i] = 1.0 * segment.steps[i] / defining_steps;
+    total_[i] += segment.steps[i];
+  }
+  piece.aux_bits = segment.aux_bits;
+  pieces_.push_back(piece);
+  end_time_ += piece.duration;
+
+  EmitUntil(end_time_);
+  if (segment.v1 == 0) Flush();
+}
+
+const InputShaper::Piece *InputShaper::PieceAt(double t,
+                                               bool from_right) const {
+  auto comp = [](double t, const Piece &p) { return t < p.start; };
+  auto comp_left = [](const Piece &p, double t) { return p.start < t; };
+  auto it = from_right
+    ? std::upper_bound(pieces_.begin(), pieces_.end(), t, comp)
+    : std::lower_bound(pieces_.begin(), pieces_.end(), t, comp_left);
+  if (it == pieces_.begin())
+    return NULL;
+  return &*(it - 1);
+}
+
+double InputShaper::Position(int motor, double t) const {
+  if (t >= end_time_) return total_[motor];
+  const Piece *p = PieceAt(t, true);
+  if (p == NULL)
+    return pieces_.empty() ? 0 : pieces_.front().start_pos[motor];
+  const double dt = t - p->start;
+  return p->start_pos[motor] + p->ratio[motor] * (p->v0 + p->accel/2 * dt) * dt;
+}
+
+double InputShaper::Speed(int motor, double t, bool from_right) const {
+  if (from_right ? t >= end_time_ : t > end_time_) return 0;
+  const Piece *p = PieceAt(t, from_right);
+  if (p == NULL) return 0;
+  return p->ratio[motor] * (p->v0 + p->accel * (t - p->start));
+}
+
+double InputShaper::ShapedPosition(int motor, double t) const {
+  double result = 0;
+  for (const Impulse &i : impulses_[motor])
+    result += i.amplitude * Position(motor, t - i.delay);
+  return result;
+}
+
+double InputShaper::ShapedSpeed(int motor, double t, bool from_right) const {
+  double result = 0;
+  for (const Impulse &i : impulses_[motor])
+    result += i.amplitude * Speed(motor, t - i.delay, from_right);
+  return result;
+}
+
+// The shaped speed of each motor is the sum of time shifted copies of speed
+// profiles that change linearly within each piece. So it changes linearly as
+// well, except where one of the shifted pieces starts or ends. These are the
+// boundaries of output segments. Within them, a motor might reverse
+// direction, so we split there as well.
+void InputShaper::EmitUntil(double until) {
+  std::vector<double> points;
+  for (const std::vector<Impulse> &motor_impulses : impulses_) {
+    for (const Impulse &i : motor_impulses) {
+      for (const Piece &p : pieces_) {
+        for (const double t : { p.start + i.delay,
+                                p.start + p.duration + i.delay }) {
+          if (t > emitted_time_ && t < until) points.push_back(t);
+        }
+      }
+    }
+  }
+  std::sort(points.begin(), points.end());
+  points.push_back(until);
+
+  double t0 = emitted_time_;
+  for (const double t1 : points) {
+    if (t1 - t0 < kMinSegmentSeconds && t1 < until)
+      continue;
+    std::vector<double> splits;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      const double s0 = ShapedSpeed(m, t0, true);
+      const double s1 = ShapedSpeed(m, t1, false);
+      if (s0 * s1 < 0) splits.push_back(t0 + (t1 - t0) * s0 / (s0 - s1));
+    }
+    std::sort(splits.begin(), splits.end());
+    splits.push_back(t1);
+    for (const double t : splits) {
+      EmitSegment(t);
+    }
+    t0 = t1;
+  }
+
+  // Forget pieces that don't contribute to what is still to be sent.
+  while (pieces_.size() > 1
+         && pieces_.front().start + pieces_.front().duration
+         < segment_start_ - max_delay_) {
+    pieces_.pop_front();
+  }
+}
+
+void InputShaper::EmitSegment(double t1) {
+  LinearSegmentSteps segment = {};
+  int defining_motor = -1;
+  int defining_steps = 0;
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    segment.steps[m] = lround(ShapedPosition(m, t1)) - emitted_steps_[m];
+    if (abs(segment.steps[m]) > defining_steps) {
+      defining_steps = abs(segment.steps[m]);
+      defining_motor = m;
+    }
+  }
+  emitted_time_ = t1;
+  if (defining_motor < 0)
+    return;  // Not even a step yet; make the next segment longer.
+
+  const Piece *p = PieceAt(segment_start_, true);
+  if (p) aux_bits_ = p->aux_bits;
+  segment.aux_bits = aux_bits_;
+
+  // Rounding to whole steps and segments that are longer as they started
+  // without a step change the average speed a bit. Scale, so that the
+  // segment takes as long as intended.
+  const double duration = t1 - segment_start_;
+  double v0 = fabs(ShapedSpeed(defining_motor, segment_start_, true));
+  double v1 = fabs(ShapedSpeed(defining_motor, t1, false));
+  if (v0 + v1 > 0) {
+    const double factor = 2 * defining_steps / ((v0 + v1) * duration);
+    v0 *= factor;
+    v1 *= factor;
+  } else {
+    v0 = v1 = defining_steps / duration;
+  }
+  segment.v0 = v0;
+  segment.v1 = v1;
+
+  output_.push_back(segment);
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    emitted_steps_[m] += segment.steps[m];
+  }
+  segment_start_ = t1;
+}
+
+void InputShaper::Flush() {
+  if (pieces_.empty())
+    return;
+  // After the longest delay, every shifted copy reached the end position,
+  // so all steps are sent out.
+  EmitUntil(end_time_ + max_delay_);
+  pieces_.clear();
+  end_time_ = emitted_time_ = segment_start_ = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    total_[i] = 0;
+    emitted_steps_[i] = 0;
+  }
+}
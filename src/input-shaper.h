@@ -0,0 +1,124 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_INPUT_SHAPER_H_
+#define _BEAGLEG_INPUT_SHAPER_H_
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "motor-operations.h"
+
+// Input shaping to suppress ringing of a machine with a resonance.
+//
+// The motion of each motor is convolved with a series of impulses, that is,
+// the sum of a few time-shifted and scaled copies of the planned motion. The
+// impulses are chosen so that the oscillations they excite at the resonance
+// frequency cancel each other out. Moves get longer by the duration of the
+// shaper (half to one period of the resonance), and corners are rounded
+// slightly.
+//
+// Segments coming from the planner are split where the shaped velocity
+// changes its slope, so that the output again consists of segments of constant
+// acceleration that the motion queue can execute.
+//
+// Each path that comes to a full stop is shaped independently; the shaped
+// path is flushed when the planner stops.
+class InputShaper {
+public:
+  enum Type {
+    NONE = 0,
+    ZV,      // Zero vibration. Two impulses, shortest, sensitive to errors.
+    ZVD,     // Zero vibration and derivative. Three impulses, more robust.
+    MZV,     // Modified ZV. Three impulses, between ZV and ZVD.
+  };
+
+  // Parse the name of a shaper type (none, zv, zvd, mzv). Returns false
+  // if it is not known.
+  static bool ParseType(const std::string &name, Type *type);
+
+  // Shaped segments are sent to "out". Initially, no motor is shaped.
+  explicit InputShaper(MotorOperations *out);
+
+  // Shape the motion of "motor" with the given shaper, tuned to the
+  // resonance "frequency" (Hz) with the given damping ratio (0..1).
+  void SetMotorShaper(int motor, Type type, float frequency, float damping);
+
+  // Shape segment and send the result to the output, as far as it is
+  // known yet. A segment that ends in a full stop flushes the remaining
+  // shaped motion. Segments without steps are sent after flushing.
+  // Returns false if the motor operations were aborted.
+  bool Enqueue(const LinearSegmentSteps &segment);
+
+  // Shape "count" segments; the result is sent to the output in one go.
+  bool Enqueue(const LinearSegmentSteps *segments, int count);
+
+private:
+  struct Impulse {
+    double delay;       // seconds
+    double amplitude;   // All amplitudes of a shaper add up to one.
+  };
+
+  // A segment as received, as a function of time.
+  struct Piece {
+    double start;       // seconds since the path started.
+    double duration;
+    double v0;          // Speed of the motor with most steps (steps/s)
+    double accel;       // ... and its acceleration (steps/s^2)
+    double start_pos[BEAGLEG_NUM_MOTORS];  // Position in steps at start.
+    double ratio[BEAGLEG_NUM_MOTORS];      // Fraction of the speed.
+    unsigned short aux_bits;
+  };
+
+  // Unshaped position and speed of a motor at given time. The speed is
+  // the limit from the left or the right of "t".
+  double Position(int motor, double t) const;
+  double Speed(int motor, double t, bool from_right) const;
+  const Piece *PieceAt(double t, bool from_right) const;
+
+  // Shaped position and speed.
+  double ShapedPosition(int motor, double t) const;
+  double ShapedSpeed(int motor, double t, bool from_right) const;
+
+  void Shape(const LinearSegmentSteps &segment);
+
+  // Emit shaped motion up to time "until", in segments ending at "t1".
+  void EmitUntil(double until);
+  void EmitSegment(double t1);
+
+  // Emit everything and start a new path.
+  void Flush();
+
+  MotorOperations *const out_;
+  std::vector<Impulse> impulses_[BEAGLEG_NUM_MOTORS];
+  double max_delay_;
+
+  std::deque<Piece> pieces_;
+  double end_time_;                       // Known unshaped motion.
+  double total_[BEAGLEG_NUM_MOTORS];      // Steps at end_time_.
+
+  double emitted_time_;                   // Sent out shaped motion until.
+  double segment_start_;                  // Start of the next output segment.
+  int emitted_steps_[BEAGLEG_NUM_MOTORS];
+  unsigned short aux_bits_;               // Of the last segment sent.
+
+  std::vector<LinearSegmentSteps> output_;  // Emitted, not yet sent.
+};
+
+#endif  // _BEAGLEG_INPUT_SHAPER_H_
@@ -0,0 +1,170 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "input-shaper.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+class CollectingMotorOperations : public MotorOperations {
+public:
+  bool Enqueue(const LinearSegmentSteps &segment) final {
+    segments.push_back(segment);
+    return true;
+  }
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
+  void SetExternalPosition(int axis, int steps) final {}
+  void SetSpeedFactor(float factor, float ramp_seconds) final {}
+
+  std::vector<LinearSegmentSteps> segments;
+};
+
+static LinearSegmentSteps MakeSegment(float v0, float v1, int m0, int m1) {
+  LinearSegmentSteps segment = {};
+  segment.v0 = v0;
+  segment.v1 = v1;
+  segment.steps[0] = m0;
+  segment.steps[1] = m1;
+  return segment;
+}
+
+static double Duration(const std::vector<LinearSegmentSteps> &segments) {
+  double result = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    int defining_steps = 0;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m)
+      defining_steps = std::max(defining_steps, abs(s.steps[m]));
+    if (defining_steps) result += 2.0 * defining_steps / (s.v0 + s.v1);
+  }
+  return result;
+}
+
+// Accelerate, travel, decelerate.
+static const LinearSegmentSteps kTrapezoid[] = {
+  MakeSegment(0, 100000, 10000, 5000),
+  MakeSegment(100000, 100000, 40000, 20000),
+  MakeSegment(100000, 0, 10000, 5000),
+};
+
+TEST(InputShaper, NoShaperPassesThrough) {
+  CollectingMotorOperations out;
+  InputShaper shaper(&out);
+  for (const LinearSegmentSteps &s : kTrapezoid) {
+    EXPECT_TRUE(shaper.Enqueue(s));
+  }
+  ASSERT_EQ(3u, out.segments.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(kTrapezoid[i].v0, out.segments[i].v0);
+    EXPECT_EQ(kTrapezoid[i].v1, out.segments[i].v1);
+    EXPECT_EQ(kTrapezoid[i].steps[0], out.segments[i].steps[0]);
+  }
+}
+
+TEST(InputShaper, ShapedPathKeepsStepsAndIsLongerByShaperDuration) {
+  for (const InputShaper::Type type :
+         { InputShaper::ZV, InputShaper::ZVD, InputShaper::MZV }) {
+    CollectingMotorOperations out;
+    InputShaper shaper(&out);
+    shaper.SetMotorShaper(0, type, 50, 0.1);
+    shaper.SetMotorShaper(1, type, 50, 0.1);
+    for (const LinearSegmentSteps &s : kTrapezoid) {
+      EXPECT_TRUE(shaper.Enqueue(s));
+    }
+    // The full stop at the end flushes everything.
+    int steps[2] = { 0, 0 };
+    float last_v1 = 0;
+    for (const LinearSegmentSteps &s : out.segments) {
+      EXPECT_GE(s.steps[0], 0);
+      EXPECT_GE(s.steps[1], 0);
+      // Segments join smoothly: no speed jumps.
+      EXPECT_NEAR(last_v1, s.v0, 200) << "Type " << type;
+      last_v1 = s.v1;
+      steps[0] += s.steps[0];
+      steps[1] += s.steps[1];
+    }
+    EXPECT_EQ(60000, steps[0]);
+    EXPECT_EQ(30000, steps[1]);
+    EXPECT_NEAR(0, out.segments.back().v1, 200);
+    EXPECT_GT(out.segments.size(), 3u);
+
+    const double damped_period = 1 / (50 * sqrt(1 - 0.1 * 0.1));
+    const double shaper_duration = type == InputShaper::ZV ? damped_period / 2
+      : type == InputShaper::ZVD ? damped_period : damped_period * 0.75;
+    EXPECT_NEAR(Duration({ std::begin(kTrapezoid), std::end(kTrapezoid) })
+                + shaper_duration, Duration(out.segments), 1e-3)
+      << "Type " << type;
+  }
+}
+
+TEST(InputShaper, MotorReversingAtSpeedIsSplit) {
+  CollectingMotorOperations out;
+  InputShaper shaper(&out);
+  shaper.SetMotorShaper(0, InputShaper::ZV, 40, 0);
+  shaper.SetMotorShaper(1, InputShaper::ZV, 40, 0);
+  // Motor 1 reverses direction while we don't stop.
+  EXPECT_TRUE(shaper.Enqueue(MakeSegment(0, 5000, 500, 500)));
+  EXPECT_TRUE(shaper.Enqueue(MakeSegment(5000, 0, 500, -500)));
+
+  int pos = 0;
+  int max_pos = 0;
+  for (const LinearSegmentSteps &s : out.segments) {
+    pos += s.steps[1];
+    max_pos = std::max(max_pos, pos);
+  }
+  EXPECT_EQ(0, pos);
+  // Rounded corner: it doesn't go all the way to where it reversed.
+  EXPECT_LT(max_pos, 500);
+  EXPECT_GT(max_pos, 300);
+}
+
+TEST(InputShaper, AuxBitsPassAfterFlush) {
+  CollectingMotorOperations out;
+  InputShaper shaper(&out);
+  shaper.SetMotorShaper(0, InputShaper::ZV, 40, 0);
+  LinearSegmentSteps first = MakeSegment(0, 5000, 500, 0);
+  first.aux_bits = 1;
+  EXPECT_TRUE(shaper.Enqueue(first));
+  const size_t shaped_so_far = out.segments.size();
+
+  LinearSegmentSteps aux = {};
+  aux.aux_bits = 3;
+  EXPECT_TRUE(shaper.Enqueue(aux));
+  ASSERT_GT(out.segments.size(), shaped_so_far + 1);
+  int steps = 0;
+  for (size_t i = 0; i < out.segments.size() - 1; ++i) {
+    EXPECT_EQ(1, out.segments[i].aux_bits);
+    steps += out.segments[i].steps[0];
+  }
+  EXPECT_EQ(500, steps);
+  EXPECT_EQ(3, out.segments.back().aux_bits);
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -42,11 +42,20 @@ MachineControlConfig::MachineControlConfig() {
   require_homing = true;
   enable_pause = false;
   home_order = kHomeOrder;
-  threshold_angle = -1;
-  speed_tune_angle = 0;
+  junction_deviation = 0.01;
+  lookahead = 128;
+  merge_tolerance = 0;
+  threaded_planner = false;
+  delta_radius = 0;
+  delta_rod_length = 0;
+  delta_segment_tolerance = 0.01;
+  pressure_advance = 0;
   auto_motor_disable_seconds = -1;
   auto_fan_disable_seconds = -1;
   auto_fan_pwm = 0;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    shaper_damping[axis] = 0.1;
+  }
 }
 
 namespace {
@@ -58,7 +67,8 @@ public:
 
   bool SeenSection(int line_no, const std::string &section_name) final {
     current_section_ = section_name;
-    if (section_name == "general")
+    if (section_name == "general" || section_name == "motion"
+        || section_name == "delta")
       return true;
 
     // See if this is a valid axis section.
@@ -93,6 +103,21 @@ public:
       return false;
     }
 
+    if (current_section_ == "motion") {
+      ACCEPT_VALUE("lookahead",      Int,    &config_->lookahead);
+      ACCEPT_EXPR("junction-deviation-mm", &config_->junction_deviation);
+      ACCEPT_VALUE("planner-thread", Bool,   &config_->threaded_planner);
+      ACCEPT_EXPR("segment-merge-tolerance-mm", &config_->merge_tolerance);
+      return false;
+    }
+
+    if (current_section_ == "delta") {
+      ACCEPT_EXPR("radius",           &config_->delta_radius);
+      ACCEPT_EXPR("rod-length",       &config_->delta_rod_length);
+      ACCEPT_EXPR("segment-tolerance-mm", &config_->delta_segment_tolerance);
+      return false;
+    }
+
     if (current_axis_ != GCODE_NUM_AXES) {
       ACCEPT_EXPR("steps-per-mm",     &config_->steps_per_mm[current_axis_]);
       ACCEPT_EXPR("steps-per-degree", &config_->steps_per_mm[current_axis_]);
@@ -103,9 +128,25 @@ public:
       ACCEPT_EXPR("max-probe-feedrate", &config_->max_probe_feedrate[current_axis_]);
 
       ACCEPT_EXPR("max-acceleration", &config_->acceleration[current_axis_]);
+      ACCEPT_EXPR("max-jerk",         &config_->max_jerk[current_axis_]);
 
       ACCEPT_EXPR("range",            &config_->move_range_mm[current_axis_]);
 
+      ACCEPT_EXPR("shaper-frequency", &config_->shaper_frequency[current_axis_]);
+      ACCEPT_EXPR("shaper-damping",   &config_->shaper_damping[current_axis_]);
+      if (current_axis_ == AXIS_E) {
+        ACCEPT_EXPR("pressure-advance", &config_->pressure_advance);
+      }
+      if (name == "shaper") {
+        if (InputShaper::ParseType(ToLower(value),
+                                   &config_->shaper_type[current_axis_]))
+          return true;
+        ReportError(line_no, StringPrintf("shaper: valid values are 'none', "
+                                          "'zv', 'zvd' or 'mzv', but got '%s'",
+                                          value.c_str()));
+        return false;
+      }
+
       if (name == "home-pos")
         return SetHomePos(line_no, current_axis_, value);
     }
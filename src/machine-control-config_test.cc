@@ -51,6 +51,7 @@ TEST(MachineControlConfig, AxisMapping) {
                "steps-per-mm = 200 / (2 * 60)\n"   // simple expression support.
                "max-feedrate = 42\n"
                "max-acceleration = 4242\n"
+               "max-jerk = 100000\n"
                "range = 987\n"
                "home-pos = max\n"
 
@@ -64,11 +65,31 @@ TEST(MachineControlConfig, AxisMapping) {
   EXPECT_FLOAT_EQ(200.0f / (2 * 60.0f), config.steps_per_mm[AXIS_X]);
   EXPECT_FLOAT_EQ(42.0f, config.max_feedrate[AXIS_X]);
   EXPECT_FLOAT_EQ(4242.0f, config.acceleration[AXIS_X]);
+  EXPECT_FLOAT_EQ(100000.0f, config.max_jerk[AXIS_X]);
+  EXPECT_FLOAT_EQ(0.0f, config.max_jerk[AXIS_Y]);  // default: no limit.
   EXPECT_FLOAT_EQ(987.0f, config.move_range_mm[AXIS_X]);
   EXPECT_EQ(HardwareMapping::TRIGGER_MAX, config.homing_trigger[AXIS_X]);
   EXPECT_EQ(HardwareMapping::TRIGGER_MIN, config.homing_trigger[AXIS_Y]);
 }
 
+TEST(MachineControlConfig, MotionSection) {
+  ConfigParser p;
+  p.SetContent("[ motion ]\n"
+               "lookahead = 256\n"
+               "junction-deviation-mm = 0.05\n"
+               "planner-thread = yes\n"
+               "segment-merge-tolerance-mm = 0.002\n"
+               );
+  MachineControlConfig config;
+  EXPECT_EQ(128, config.lookahead);   // default.
+  EXPECT_FALSE(config.threaded_planner);
+  EXPECT_TRUE(config.ConfigureFromFile(&p));
+  EXPECT_EQ(256, config.lookahead);
+  EXPECT_FLOAT_EQ(0.05f, config.junction_deviation);
+  EXPECT_TRUE(config.threaded_planner);
+  EXPECT_FLOAT_EQ(0.002f, config.merge_tolerance);
+}
+
 #if 0
 // TODO: needs to move to hardware mapping test
 TEST(MachineControlConfig, MotorMapping) {
@@ -47,6 +47,7 @@
 #include "hardware-mapping.h"
 #include "motion-queue.h"
 #include "motor-operations.h"
+#include "planner.h"
 #include "pru-hardware-interface.h"
 #include "sim-firmware.h"
 #include "spindle-control.h"
@@ -73,10 +74,7 @@ static int usage(const char *prog, const char *msg) {
           "  -P                         : Verbose: Show some more debug output (Default: off).\n"
           "  -S                         : Synchronous: don't queue (Default: off).\n"
           "      --allow-m111           : Allow changing the debug level with M111 (Default: off).\n"
-          "\nSegment acceleration tuning:\n"
-          "     --threshold-angle       : Specifies the threshold angle used for segment acceleration (Default: 10 degrees).\n"
-          "     --speed-tune-angle      : Specifies the angle used for proportional speed-tuning. (Default: 60 degrees)\n\n"
-          "                               The --threshold-angle + --speed-tune-angle must be less than 90 degrees.\n"
+          "      --planner-trace <file> : Record planner in- and output for planner-replay.\n"
           "\nConfiguration file overrides:\n"
           "     --homing-required       : Require homing before any moves (require-homing = yes).\n"
           "     --nohoming-required     : (Opposite of above^): Don't require homing before any moves (require-homing = no).\n"
@@ -233,7 +231,7 @@ static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
 // THIS IS A SAMPLE ONLY at this point. We need to come up with a proper
 // definition first what we want from a status server.
 // At this point: whenever it receives the character 'p' it prints the
-// position as json.
+// position as json, 's' the machine status, 'l' the planner statistics.
 static void run_status_server(const char *bind_addr, int port,
                               FDMultiplexer *event_server,
                               GCodeMachineControl *machine) {
@@ -283,6 +281,28 @@ static void run_status_server(const char *bind_addr, int port,
                     home_status == GCodeMachineControl::HomingState::HOMED ? "yes" : "unknown",
 		    machine->GetMotorsEnabled() ? "true" : "false");
           }
+          if (query == 'l') {
+            PlannerStats st;
+            machine->GetPlannerStats(&st);
+            // JSON with the planner counters, see PlannerStats.
+            dprintf(conn, "{\"targets\":%lld, \"merged\":%lld, "
+                    "\"segments\":{\"accel\":%lld, \"travel\":%lld, "
+                    "\"decel\":%lld}, "
+                    "\"stops\":{\"path_start\":%lld, \"reversal\":%lld, "
+                    "\"non_euclidian\":%lld, \"corner\":%lld}, "
+                    "\"lookahead_limited\":%lld, \"feed_ratio\":%.3f}\n",
+                    (long long)st.targets, (long long)st.merged_targets,
+                    (long long)st.accel_segments,
+                    (long long)st.travel_segments,
+                    (long long)st.decel_segments,
+                    (long long)st.stops_path_start,
+                    (long long)st.stops_reversal,
+                    (long long)st.stops_non_euclidian,
+                    (long long)st.stops_corner,
+                    (long long)st.lookahead_limited,
+                    st.planned_seconds > 0
+                    ? st.requested_seconds / st.planned_seconds : 1.0);
+          }
           return true;
         });
       return true;
@@ -311,8 +331,6 @@ int main(int argc, char *argv[]) {
   // Less common options don't have a short option.
   enum LongOptionsOnly {
     OPT_HELP = 1000,
-    OPT_SET_THRESHOLD_ANGLE,
-    OPT_SET_SPEED_TUNE_ANGLE,
     OPT_REQUIRE_HOMING,
     OPT_DONT_REQUIRE_HOMING,
     OPT_DISABLE_RANGE_CHECK,
@@ -320,7 +338,10 @@ int main(int argc, char *argv[]) {
     OPT_PRIVS,
     OPT_ENABLE_M111,
     OPT_PARAM_FILE,
-    OPT_STATUS_SERVER
+    OPT_STATUS_SERVER,
+    OPT_PLANNER_TRACE,
+    OPT_SET_THRESHOLD_ANGLE,
+    OPT_SET_SPEED_TUNE_ANGLE,
   };
 
   static struct option long_options[] = {
@@ -344,8 +365,9 @@ int main(int argc, char *argv[]) {
     { "priv",               required_argument, NULL, OPT_PRIVS },
     { "allow-m111",         no_argument,       NULL, OPT_ENABLE_M111 },
     { "status-server",      required_argument, NULL, OPT_STATUS_SERVER },
+    { "planner-trace",      required_argument, NULL, OPT_PLANNER_TRACE },
 
-    // possibly deprecated soon.
+    // Ignored since junction deviation determines the corner speed.
     { "threshold-angle",    required_argument, NULL, OPT_SET_THRESHOLD_ANGLE },
     { "speed-tune-angle",   required_argument, NULL, OPT_SET_SPEED_TUNE_ANGLE },
 
@@ -359,8 +381,7 @@ int main(int argc, char *argv[]) {
   bool dont_require_homing = false;
   bool disable_range_check = false;
   bool allow_m111 = false;
-  config.threshold_angle = 10;
-  config.speed_tune_angle = 60;
+  const char *ignored_angle_option = NULL;
   int opt;
   while ((opt = getopt_long(argc, argv, "p:b:SPnNf:l:dc:",
                             long_options, NULL)) != -1) {
@@ -370,12 +391,6 @@ int main(int argc, char *argv[]) {
       if (config.speed_factor <= 0)
         return usage(argv[0], "Speedfactor cannot be <= 0");
       break;
-    case OPT_SET_THRESHOLD_ANGLE:
-      config.threshold_angle = (float)atof(optarg);
-      break;
-    case OPT_SET_SPEED_TUNE_ANGLE:
-      config.speed_tune_angle = (float)atof(optarg);
-      break;
     case OPT_REQUIRE_HOMING:
       require_homing = true;
       break;
@@ -431,6 +446,15 @@ int main(int argc, char *argv[]) {
     case OPT_ENABLE_M111:
       allow_m111 = true;
       break;
+    case OPT_PLANNER_TRACE:
+      config.planner_trace_file = MakeAbsoluteFile(optarg);
+      break;
+    case OPT_SET_THRESHOLD_ANGLE:
+      ignored_angle_option = "--threshold-angle";
+      break;
+    case OPT_SET_SPEED_TUNE_ANGLE:
+      ignored_angle_option = "--speed-tune-angle";
+      break;
     case OPT_HELP:
       return usage(argv[0], NULL);
     default:
@@ -439,10 +463,6 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (config.threshold_angle + config.speed_tune_angle >= 90) {
-    return usage(argv[0], "--threshold-angle + --speed-tune-angle must be < 90 degrees.");
-  }
-
   if (require_homing && dont_require_homing) {
     return usage(argv[0], "Choose one: --homing-required or --nohoming-required.");
   }
@@ -458,17 +478,19 @@ int main(int argc, char *argv[]) {
   Log_info("BeagleG " BEAGLEG_VERSION " startup; "
            CAPE_NAME " hardware interface.");
 
-  if (config.threshold_angle > 0) {
-    const double deg2rad = M_PI / 180.0;
-    const double min_speed_adj = std::cos(config.speed_tune_angle * deg2rad);
-    const double max_speed_adj = std::cos((config.threshold_angle + config.speed_tune_angle) * deg2rad);
-    Log_debug("Speed-tuning from %.2f to %.2f for angles +/-%.2f degrees (speed-tune @ %.2f degrees)\n",
-              min_speed_adj, max_speed_adj, config.threshold_angle, config.speed_tune_angle);
+  if (ignored_angle_option) {
+    Log_error("Warning: %s is ignored; the speed in corners is now "
+              "determined by junction-deviation-mm in the [motion] section.",
+              ignored_angle_option);
   }
 
   // If reading from file: don't print 'ok' for every line.
   config.acknowledge_lines = !has_filename;
 
+  // Keep the event loop (gcode input, status server) responsive while
+  // the motor queue is full. Can be switched off in the [motion] section.
+  config.threaded_planner = true;
+
   if (!config_file) {
     Log_error("Expected config file -c <config>");
     return 1;
@@ -0,0 +1,49 @@
+// -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This file is part of BeagleG. http://github.com/hzeller/beagleg
+//
+// BeagleG is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// BeagleG is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Constants of the motion queue shared between the host and the PRU, that
+// don't depend on the cape. To be read by *.cc and *.p file, so only //
+// comments and simple defines.
+
+#ifndef __MOTION_QUEUE_CONSTANTS_H
+#define __MOTION_QUEUE_CONSTANTS_H
+
+// Frequency we use for our timer. The CPU uses two CPU cycles per busy loop,
+// so we divide CPU freq by that.
+// A hardware timer might run natively at full speed.
+#define TIMER_FREQUENCY (200000000 / 2)
+
+// Endstop to watch in a homing segment. The segment is ended early,
+// decelerating, once the endstop input is at the given level.
+#define ENDSTOP_NONE      0   // Not a homing segment.
+#define ENDSTOP_LOW       1   // Triggered if the input is low.
+#define ENDSTOP_HIGH      2   // Triggered if the input is high.
+#define ENDSTOP_TRIGGERED 3   // Set by PRU once the endstop triggered.
+
+// Bit set in the endstop status reported by the PRU if a homing segment
+// was ended early; the lower bits are the number of loops skipped.
+#define ENDSTOP_STATUS_TRIGGERED_BIT 31
+
+#define QUEUE_LEN 16
+
+// The speed factor the PRU applies to all delays is a fixed point value with
+// this many fractional bits: (1 << SPEED_FACTOR_SHIFT) is full speed.
+#define SPEED_FACTOR_SHIFT 8
+
+#endif // __MOTION_QUEUE_CONSTANTS_H
@@ -20,8 +20,11 @@
 #define _BEAGLEG_MOTION_QUEUE_H_
 
 #include <stdint.h>
+#include <atomic>
+
 #include "common/container.h"
 
+#include "motion-queue-constants.h"
 #include "pru-hardware-interface.h"
 
 // Number of motors handled by motion segment.
@@ -47,17 +50,22 @@
 // using a microcontroller or FPGA.
 // Also useful for testing.
 
+// Maximum loops in the phases of a MotionSegment. All of them together need
+// to fit in the 24 bit counter of the status register.
+#define MAX_ACCEL_LOOPS  0xffff     // loops_accel, loops_decel
+#define MAX_SEGMENT_LOOPS 0xffffff  // loops_accel + loops_travel + loops_decel
+
 struct MotionSegment {
-  // Queue header
+  // Queue header (needs to match QueueHeader in motor-interface-pru.p)
   uint8_t state;           // see motor-interface-constants.h STATE_* constants.
 
   uint8_t direction_bits;
+  uint16_t aux;            // all 16 bits can be used
 
   // TravelParameters (needs to match TravelParameters in motor-interface-pru.p)
   uint16_t loops_accel;    // Phase 1: loops spent in acceleration
-  uint16_t loops_travel;   // Phase 2: lops spent in travel
   uint16_t loops_decel;    // Phase 3: loops spent in deceleration
-  uint16_t aux;            // all 16 bits can be used
+  uint32_t loops_travel;   // Phase 2: loops spent in travel
   uint32_t accel_series_index;  // index in taylor
 
   uint32_t hires_accel_cycles;  // acceleration delay cycles.
@@ -65,14 +73,12 @@ struct MotionSegment {
 
   uint32_t fractions[MOTION_MOTOR_COUNT]; // fixed point fractions to add each step.
 
-#if JERK_EXPERIMENT
-  /*
-   * The following not handled yet in PRU, just experimental in sim right now.
-   */
-  uint16_t jerk_start;
-  uint16_t jerk_stop;
-  float jerk_motion;
-#endif
+  // EndstopParameters. Homing segments watch an endstop: once it triggers,
+  // the rest of the acceleration and travel is skipped and the motors
+  // decelerate to a stop.
+  uint16_t endstop_trigger;     // ENDSTOP_* constant; ENDSTOP_NONE if not homing.
+  uint16_t reserved;
+  uint32_t endstop_gpio;        // GPIO of the endstop input, e.g. IN_1_GPIO
 } __attribute__((packed));
 
 namespace internal {
@@ -85,6 +91,26 @@ struct QueueStatus {
   uint32_t counter : 24; // remaining number of cycles to be performed
   uint32_t index : 8;    // represent the executing slot [0 to QUEUE_LEN - 1]
 };
+
+// Speed factor in the fixed point representation the hardware uses; see
+// SPEED_FACTOR_SHIFT. Clamped to the supported range [0..1]; only an actual
+// zero (feed hold) maps to zero.
+inline uint32_t SpeedFactorToFixedPoint(float factor) {
+  const float full_speed = 1 << SPEED_FACTOR_SHIFT;
+  if (factor <= 0.0f) return 0;
+  if (factor >= 1.0f) return full_speed;
+  const uint32_t result = factor * full_speed;
+  return result > 0 ? result : 1;
+}
+
+// Number of delay loops of planned motion after which the applied speed
+// factor moves by one fixed point unit, so that a full change from 0 to 1
+// takes "ramp_seconds".
+inline uint32_t SpeedRampToLoops(float ramp_seconds) {
+  const float loops =
+    ramp_seconds * TIMER_FREQUENCY / (1 << SPEED_FACTOR_SHIFT);
+  return loops > 1.0f ? (uint32_t) loops : 1;
+}
 }
 
 typedef FixedArray<int, MOTION_MOTOR_COUNT> MotorsRegister;
@@ -100,15 +126,48 @@ public:
   // Returns true if segment was added, false if PRU abort was detected
   virtual bool Enqueue(MotionSegment *segment) = 0;
 
+  // Enqueue "count" segments. Blocks until there is space for all of them,
+  // so "count" must not be larger than the queue. They are then made
+  // available to the hardware in one go.
+  // Returns true if all segments were added, false if an abort was detected,
+  // in which case none was added.
+  virtual bool EnqueueMany(MotionSegment *segments, int count) {
+    for (int i = 0; i < count; ++i) {
+      if (!Enqueue(&segments[i])) return false;
+    }
+    return true;
+  }
+
   // Block and wait for queue to be empty.
   virtual void WaitQueueEmpty() = 0;
 
+  // Returns true if the hardware watches the endstops of homing segments
+  // (see MotionSegment::endstop_trigger).
+  virtual bool SupportsEndstopWatch() { return false; }
+
+  // Returns true if the endstop of the last homing segment triggered, and
+  // how many of its loops were skipped because of that in "skipped_loops".
+  // Only meaningful once the queue is empty.
+  virtual bool GetEndstopTrigger(uint32_t *skipped_loops) { return false; }
+
   // Immediately enable motors, indepenent of queue.
   virtual void MotorEnable(bool on) = 0;
 
   // Shutdown. If !flush_queue: immediate, even if motors are still moving.
   virtual void Shutdown(bool flush_queue) = 0;
 
+  // Scale the speed of the motion with the given factor [0..1]. Unlike
+  // planning with a different speed, this applies to the segments already
+  // in the queue. The change is ramped in: a change of the full range 0..1
+  // takes "ramp_seconds" of (unscaled) motion time. The ramp pauses while
+  // the segments themselves change speed in the same direction, so that
+  // it never adds to their acceleration or deceleration.
+  // Accelerations scale with the square of the factor.
+  // A factor of zero is a feed hold: the motion comes to a stop
+  // and stays there, with the rest of the queue intact, until a
+  // non-zero factor is set again.
+  virtual void SetSpeedFactor(float factor, float ramp_seconds) = 0;
+
   // Returns the number of motion segments that are pending in the queue
   // behind the one currently executing. So if we are currently executing
   // the last element or are idle after the last element, this will return
@@ -116,6 +175,12 @@ public:
   // The return parameter head_item_progress is set to the number
   // of not yet executed loops in the item currenly being executed.
   virtual int GetPendingElements(uint32_t *head_item_progress) = 0;
+
+  // Get the segment the hardware is executing, or executed last if it is
+  // idle. Segments are counted in the order they are enqueued, starting
+  // with 1; 0 is before the first one. The loops it still has to do are
+  // returned in "loops_left", from the same moment.
+  virtual void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left) = 0;
 };
 
 // Standard implementation.
@@ -131,14 +196,22 @@ public:
   ~PRUMotionQueue();
 
   bool Enqueue(MotionSegment *segment);
+  bool EnqueueMany(MotionSegment *segments, int count);
   void WaitQueueEmpty();
+  bool SupportsEndstopWatch() { return true; }
+  bool GetEndstopTrigger(uint32_t *skipped_loops);
   void MotorEnable(bool on);
   void Shutdown(bool flush_queue);
+  void SetSpeedFactor(float factor, float ramp_seconds);
   int GetPendingElements(uint32_t *head_item_progress);
+  void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left);
 
 private:
   bool Init();
 
+  // Wait until the next "count" slots are free. Returns false on abort.
+  bool WaitForFreeSlots(int count);
+
   void ClearPRUAbort(unsigned int idx);
 
   HardwareMapping *const hardware_mapping_;
@@ -146,21 +219,35 @@ private:
 
   volatile struct PRUCommunication *pru_data_;
   unsigned int queue_pos_;
+
+  // Number of the segment in each slot, see GetExecutingSegment(). Read
+  // from the thread asking for the status.
+  uint32_t enqueued_segments_;
+  std::atomic<uint32_t> slot_segment_[QUEUE_LEN];
 };
 
 
 // Queue that does nothing. For testing purposes.
 class DummyMotionQueue : public MotionQueue {
 public:
-  bool Enqueue(MotionSegment *segment) { return true; }
+  DummyMotionQueue() : segments_(0) {}
+  bool Enqueue(MotionSegment *segment) { ++segments_; return true; }
   void WaitQueueEmpty() {}
   void MotorEnable(bool on) {}
   void Shutdown(bool flush_queue) {}
+  void SetSpeedFactor(float factor, float ramp_seconds) {}
   int GetPendingElements(uint32_t *head_item_progress) {
     if (head_item_progress)
       *head_item_progress = 0;
     return 1;
   }
+  void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left) {
+    *segment = segments_;
+    *loops_left = 0;
+  }
+
+private:
+  uint32_t segments_;
 };
 
 #endif  // _BEAGLEG_MOTION_QUEUE_H_
@@ -22,18 +22,13 @@
 #ifndef __MOTOR_INTERFACE_CONSTANTS_H
 #define __MOTOR_INTERFACE_CONSTANTS_H
 
-// Frequency we use for our timer. The CPU uses two CPU cycles per busy loop,
-// so we divide CPU freq by that.
-// A hardware timer might run natively at full speed.
-#define TIMER_FREQUENCY (200000000 / 2)
+#include "motion-queue-constants.h"
 
 #define STATE_EMPTY  0   // Queue element empty, ready to be filled by host
 #define STATE_FILLED 1   // Queue element filled by host, to be picked up by PRU
 #define STATE_EXIT   2   // Filled by host, no parameters; tells PRU to exit.
 #define STATE_ABORT  3   // Filled by PRU when Estop is detected
 
-#define QUEUE_LEN 16
-
 // In calculation of delay cycles: number of bits shifted
 // for higher resolution.
 #define DELAY_CYCLE_SHIFT 5
@@ -27,20 +27,27 @@
 #define PRU0_ARM_INTERRUPT 19
 #define CONST_PRUDRAM	   C24
 
-#define QUEUE_ELEMENT_SIZE (SIZE(QueueHeader) + SIZE(TravelParameters))
+#define QUEUE_ELEMENT_SIZE (SIZE(QueueHeader) + SIZE(TravelParameters) \
+			    + SIZE(EndstopParameters))
 #define QUEUE_OFFSET 4
 
+;; Speed factor requested by the host; right after the queue.
+#define SPEED_FACTOR_OFFSET (QUEUE_OFFSET + QUEUE_LEN * QUEUE_ELEMENT_SIZE)
+#define SPEED_FACTOR_REG r29	; currently applied speed factor.
+
+;; Status of the last homing segment; after speed factor, ramp and progress.
+#define ENDSTOP_STATUS_OFFSET (SPEED_FACTOR_OFFSET + 12)
+
 #define PARAM_START r7
 #define PARAM_END  r19
 .struct TravelParameters
-	// We do at most 2^16 loops to avoid accumulating too much rounding
-	// error in the fraction addition. Longer moves are split into separate
-	// requests by the host.
+	// The sum of all loops needs to fit in the 24 bit of the status
+	// register. Acceleration and deceleration are limited to 2^16 loops,
+	// there are not enough registers for all of them in 32 bit. Longer
+	// moves are split into separate requests by the host.
 	.u16 loops_accel	 // Phase 1: steps spent in acceleration.
-	.u16 loops_travel	 // Phase 2: steps spent in travel.
 	.u16 loops_decel         // Phase 3: steps spent in deceleration.
-
-	.u16 aux		 // all 16 bits can be used
+	.u32 loops_travel	 // Phase 2: steps spent in travel.
 
 	.u32 accel_series_index  // index into the taylor series.
 	.u32 hires_accel_cycles  // initial delay cycles, for acceleration
@@ -63,8 +70,17 @@
 .struct QueueHeader
 	.u8 state
 	.u8 direction_bits
+	.u16 aux		 // all 16 bits can be used
 .ends
 
+;; After the TravelParameters; not kept in registers.
+.struct EndstopParameters
+	.u16 endstop_trigger	 // ENDSTOP_* constant
+	.u16 reserved
+	.u32 endstop_gpio	 // Endstop to watch in homing segments.
+.ends
+#define ENDSTOP_PARAM_OFFSET (SIZE(QueueHeader) + SIZE(TravelParameters))
+
 ;; counter states of the motors
 #define STATE_START r20   	; after PARAM_END
 #define STATE_END r27
@@ -179,12 +195,132 @@ DONE_CALCULATE_DELAY:
 	SUB r1, r1, (4 / 2) ; Subtract the loops consumed for this macro.
 .endm
 
+;;; In homing segments, watch the endstop given in the EndstopParameters.
+;;; Once it triggers, the remaining acceleration and travel is skipped and
+;;; we decelerate for as many loops as we have accelerated (or what is left,
+;;; or what fits in loops_decel).
+;;; The number of skipped loops is reported in the endstop status, and the
+;;; segment is marked as triggered, so that we only do this once.
+;;; Uses r0 and r4..r6; needs to be called after CalculateDelay.
+.macro CheckEndstop
+.mparam delay_reg
+	ADD r0, r2, ENDSTOP_PARAM_OFFSET
+	LBCO r4, CONST_PRUDRAM, r0, 8		; r4.w0 trigger, r5 gpio
+	QBEQ endstop_done, r4.w0, ENDSTOP_NONE
+	QBEQ endstop_done, r4.w0, ENDSTOP_TRIGGERED
+	LSR r6, r5, 12				; gpio bank base ...
+	LSL r6, r6, 12
+	MOV r0, GPIO_DATAIN			; ... and its input register.
+	ADD r6, r6, r0
+	LBBO r6, r6, 0, 4
+	AND r5, r5, 0x1f			; bit of the endstop
+	LSR r6, r6, r5
+	AND r6, r6, 1
+	ADD r6, r6, 1			; ENDSTOP_LOW (1) or ENDSTOP_HIGH (2) level
+	QBNE endstop_done, r6, r4.w0
+
+	;; Triggered. Don't check again in this segment.
+	MOV r4.w0, ENDSTOP_TRIGGERED
+	SBCO r4.w0, CONST_PRUDRAM, r0, 2
+
+	;; r0 = loops left; r5 = loops to decelerate.
+	ADD r0, travel_params.loops_accel, travel_params.loops_travel
+	ADD r0, r0, travel_params.loops_decel
+	MOV r5, travel_params.accel_series_index
+	QBGE endstop_decel_fits, r5, r0
+	MOV r5, r0
+endstop_decel_fits:
+	MOV r6, 0xffff
+	QBGE endstop_decel_loops, r6, r5
+	MOV r5, r6
+endstop_decel_loops:
+	SUB r0, r0, r5				; skipped loops
+	SUB r28, r28, r0			; remove them from the status.
+	MOV travel_params.loops_accel, 0
+	MOV travel_params.loops_travel, 0
+	MOV travel_params.loops_decel, r5.w0
+
+	SET r0, r0, ENDSTOP_STATUS_TRIGGERED_BIT
+	MOV r4, ENDSTOP_STATUS_OFFSET
+	SBCO r0, CONST_PRUDRAM, r4, 4
+endstop_done:
+	SUB delay_reg, delay_reg, (8 / 2)	; cycles in the usual case.
+.endm
+
+;;; Scale the delay with the speed factor, so that the host can change the
+;;; speed of segments that are already in the queue. The applied factor
+;;; approaches the one requested by the host by one unit each time the
+;;; planned delays add up to the ramp loops the host requested, so speed
+;;; changes are ramps within the acceleration limits.
+;;; The ramp does not progress while the segment accelerates (ramping up) or
+;;; decelerates (ramping down) itself, so the two never add up. We tell
+;;; by the loops left after this step, so the last step of the acceleration
+;;; counts as travel, the last travel step as deceleration.
+;;; Factor zero is a feed hold: we wait here, before the next step, until the
+;;; host requests a speed again. The status register is up-to-date, so the host
+;;; knows the exact position meanwhile.
+;;; The delay_reg is converted to units of 1/(1 << SPEED_FACTOR_SHIFT) loops;
+;;; the delay loop then counts up counter_reg by the factor until it reaches
+;;; it. So each loop still takes two cycles.
+;;; tmp_reg, ramp_reg and progress_reg need to be consecutive registers.
+.macro ApplySpeedFactor
+.mparam delay_reg, counter_reg, tmp_reg, ramp_reg, progress_reg
+	MOV counter_reg, SPEED_FACTOR_OFFSET
+	LBCO tmp_reg, CONST_PRUDRAM, counter_reg, 12 ; requested, ramp, progress
+	QBEQ speed_factor_ramp_reached, SPEED_FACTOR_REG, tmp_reg
+	QBLT speed_factor_ramp_up_phase, tmp_reg, SPEED_FACTOR_REG
+	QBNE speed_factor_ramp_progress, travel_params.loops_accel, 0
+	QBEQ speed_factor_ramp_store, travel_params.loops_travel, 0 ; decel.
+	JMP speed_factor_ramp_progress
+speed_factor_ramp_up_phase:
+	QBNE speed_factor_ramp_store, travel_params.loops_accel, 0  ; accel.
+speed_factor_ramp_progress:
+	ADD progress_reg, progress_reg, delay_reg
+speed_factor_ramp_next:
+	QBLT speed_factor_ramp_store, ramp_reg, progress_reg
+	SUB progress_reg, progress_reg, ramp_reg
+	QBLT speed_factor_ramp_up, tmp_reg, SPEED_FACTOR_REG
+	SUB SPEED_FACTOR_REG, SPEED_FACTOR_REG, 1
+	QBNE speed_factor_ramp_next, SPEED_FACTOR_REG, tmp_reg
+	JMP speed_factor_ramp_reached
+speed_factor_ramp_up:
+	ADD SPEED_FACTOR_REG, SPEED_FACTOR_REG, 1
+	QBNE speed_factor_ramp_next, SPEED_FACTOR_REG, tmp_reg
+speed_factor_ramp_reached:
+	ZERO &progress_reg, 4
+speed_factor_ramp_store:
+	ADD counter_reg, counter_reg, 8
+	SBCO progress_reg, CONST_PRUDRAM, counter_reg, 4
+
+	QBNE speed_factor_ramp_done, SPEED_FACTOR_REG, 0
+speed_factor_hold:
+	MOV r0, 0
+	CALL CheckForEStop              ; uses r0 and scratch registers.
+	QBEQ STEP_GEN, r0, 1            ; E-Stop: abort over there.
+	MOV counter_reg, SPEED_FACTOR_OFFSET
+	LBCO tmp_reg, CONST_PRUDRAM, counter_reg, 4
+	QBEQ speed_factor_hold, tmp_reg, 0
+	MOV SPEED_FACTOR_REG, 1         ; resume: ramp up from slowest speed.
+speed_factor_ramp_done:
+	SUB delay_reg, delay_reg, (26 / 2)     ; substract cycles spent here.
+
+	;; Delays beyond that are more than 0.16 seconds per step; clamp
+	;; instead of overflowing when shifting.
+	MOV tmp_reg, 0xffffff
+	QBGE delay_in_range, delay_reg, tmp_reg
+	MOV delay_reg, tmp_reg
+delay_in_range:
+	LSL delay_reg, delay_reg, SPEED_FACTOR_SHIFT
+	ZERO &counter_reg, 4
+.endm
+
 INIT:
 	;; Clear STANDBY_INIT in SYSCFG register.
 	LBCO r0, C4, 4, 4
 	CLR r0, r0, 4
 	SBCO r0, C4, 4, 4
 
+	MOV SPEED_FACTOR_REG, 1 << SPEED_FACTOR_SHIFT ; full speed.
 	MOV r2, QUEUE_OFFSET ; Queue address in PRU memory
 	MOV r28, 0           ; Status register in PRU memory,
 	                     ; r28.b3 for current queue position,
@@ -195,7 +331,7 @@ QUEUE_READ:
 	;;
 
 	;; Check queue header at our read-position until it contains something.
-	.assign QueueHeader, r1.w0, r1.w0, queue_header
+	.assign QueueHeader, r1, r1, queue_header
 	LBCO queue_header, CONST_PRUDRAM, r2, SIZE(queue_header)
 	QBEQ QUEUE_READ, queue_header.state, STATE_EMPTY ; wait until got data.
 	QBEQ QUEUE_READ, queue_header.state, STATE_ABORT
@@ -206,23 +342,23 @@ QUEUE_READ:
 	MOV r3, queue_header.direction_bits
 	CALL SetDirections
 
+	;; Set the Aux bits
+	MOV r3, queue_header.aux
+	CALL SetAuxBits
+
 	;; queue_header processed, r1 is free to use
 	ADD r1, r2, SIZE(QueueHeader) ; r2 stays at queue pos
 	.assign TravelParameters, PARAM_START, PARAM_END, travel_params
 	LBCO travel_params, CONST_PRUDRAM, r1, SIZE(travel_params)
 
-	;; Set the Aux bits
-	MOV r3, travel_params.aux
-	CALL SetAuxBits
-
 	ZERO &mstate, SIZE(mstate)	; clear the motor states
 	ZERO &r3, 4			; initialize delay calculation state register.
 
 	;; STATUS REGISTER
 	;; ! We are assuming that writing the 4 bytes status register is atomic
 	;; and we guarantee that the bottom three bytes are all zero so we just need
-	;; to sum up the 3 loop counters. The upper bound of this sum will always be
-	;; less than 2^18, thus fit in the lower 24 bits allocated for it.
+	;; to sum up the 3 loop counters. The host makes sure that this sum is
+	;; less than 2^24, thus fits in the lower 24 bits allocated for it.
 	;; At each loop executed this counter is decreased of one unit.
 	ADD r28, r28, travel_params.loops_accel
 	ADD r28, r28, travel_params.loops_travel
@@ -239,6 +375,7 @@ QUEUE_READ:
 	;; parameter:         r7..r19
 	;; motor-state:       r20..r27
 	;; status-variable:   r28
+	;; speed factor:      r29
 	;; call/ret:          r30
 STEP_GEN:
 	MOV r0, 0
@@ -272,11 +409,13 @@ DO_STEP_GEN:
 
 	CalculateDelay r1, travel_params, r3, r5, r6
 	QBEQ DONE_STEP_GEN, r1, 0       ; special value 0: all steps consumed.
+	CheckEndstop r1
 	UpdateQueueStatus
+	ApplySpeedFactor r1, r0, r4, r5, r6
 
 STEP_DELAY:				; Create time delay between steps.
-	SUB r1, r1, 1                   ; two cycles per loop.
-	QBNE STEP_DELAY, r1, 0
+	ADD r0, r0, SPEED_FACTOR_REG    ; two cycles per loop.
+	QBLT STEP_DELAY, r1, r0
 
 	JMP STEP_GEN
 
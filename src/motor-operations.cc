@@ -27,7 +27,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
-#include <deque>
+
+#include <algorithm>
 
 #include "common/logging.h"
 
@@ -41,9 +42,32 @@
 // more than one bit output per step (probably only with hand-built drivers).
 #define LOOPS_PER_STEP (1 << 1)
 
-// If we do more than these number of steps, the fixed point fraction
-// accumulate too much error.
-#define MAX_STEPS_PER_SEGMENT (65535 / LOOPS_PER_STEP)
+// Moves with more steps than fit in the loop counters of a segment are split.
+// Acceleration is limited to 16 bit loop counters; travel only by the total
+// loops the status register can count. The fixed point fractions accumulate
+// an error of at most 4 * steps / 2^32 of a step, so are exact for either.
+#define MAX_ACCEL_STEPS_PER_SEGMENT (MAX_ACCEL_LOOPS / LOOPS_PER_STEP)
+#define MAX_TRAVEL_STEPS_PER_SEGMENT (MAX_SEGMENT_LOOPS / LOOPS_PER_STEP)
+
+// Acceleration, travel and deceleration of a move go into one segment if
+// the deceleration ends within this many loops of the acceleration series
+// where it should. When stopping, that is the speed after about one step
+// from standstill.
+#define MAX_TRAPEZOID_INDEX_ERROR 4
+
+// Segments are handed to the backend in batches of up to this size. The
+// backend waits until there is space for the whole batch, so we keep it
+// small compared to the queue: the hardware should never run dry meanwhile.
+#define MAX_BATCH_SIZE (QUEUE_LEN / 4)
+
+// Size of the shadow queue: all segments the backend queue can hold, a batch
+// not accepted by it yet and the one before, which is where they start off.
+// Power of two, so that positions can wrap around.
+#define HISTORY_LEN (2 * QUEUE_LEN)
+static_assert(HISTORY_LEN > QUEUE_LEN + MAX_BATCH_SIZE,
+              "Shadow queue must cover the motion queue and a batch");
+static_assert((HISTORY_LEN & (HISTORY_LEN - 1)) == 0,
+              "Shadow queue size must be power of two");
 
 // TODO: don't store this singleton like, but keep in user_data of the MotorOperations
 static float hardware_frequency_limit_ = 1e6;    // Don't go over 1 Mhz
@@ -57,13 +81,62 @@ static float clip_hardware_frequency_limit(float v) {
   return v < hardware_frequency_limit_ ? v : hardware_frequency_limit_;
 }
 
+// Number of entries in the table of the acceleration curve. Segments start
+// at the series index of their initial speed; at typical accelerations and
+// speeds, that is within the first few thousand.
+#define ACCEL_CURVE_TABLE_SIZE 4096
+
+namespace {
+// The acceleration curve at a series index is a factor depending on the
+// acceleration times sqrt(index + 1) - sqrt(index). The latter is
+// precomputed here, in exactly the same way, so that results don't change.
+// Entries are not interpolated: that would not be exact, and the delays
+// emitted for a segment must stay the same.
+class AccelerationCurveTable {
+public:
+  AccelerationCurveTable() {
+    for (int i = 0; i < ACCEL_CURVE_TABLE_SIZE; ++i) {
+      sqrt_delta_[i] = sqrtf(i + 1) - sqrtf(i);
+    }
+  }
+
+  float SqrtDelta(int index) const {
+    if (index < ACCEL_CURVE_TABLE_SIZE)
+      return sqrt_delta_[index];
+    return sqrtf(index + 1) - sqrtf(index);
+  }
+
+private:
+  float sqrt_delta_[ACCEL_CURVE_TABLE_SIZE];
+};
+}  // namespace
+
+static const AccelerationCurveTable accel_curve_table;
+
 static float calcAccelerationCurveValueAt(int index, float acceleration) {
-  // counter_freq * sqrt(2 / accleration)
-  const float accel_factor = TIMER_FREQUENCY
-    * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
+  // counter_freq * sqrt(2 / accleration). Consecutive segments often have
+  // the same acceleration, so remember the factor for the last one.
+  static thread_local float last_acceleration = -1;
+  static thread_local float last_accel_factor = 0;
+  if (acceleration != last_acceleration) {
+    last_accel_factor = TIMER_FREQUENCY
+      * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
+    last_acceleration = acceleration;
+  }
+  const float accel_factor = last_accel_factor;
   // The approximation is pretty far off in the first step; adjust.
   const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
-  return c0 * (sqrtf(index + 1) - sqrtf(index));
+  return c0 * accel_curve_table.SqrtDelta(index);
+}
+
+static int get_defining_axis_steps(const LinearSegmentSteps &param) {
+  int defining_axis_steps = abs(param.steps[0]);
+  for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (abs(param.steps[i]) > defining_axis_steps) {
+      defining_axis_steps = abs(param.steps[i]);
+    }
+  }
+  return defining_axis_steps;
 }
 
 #if 0
@@ -100,28 +173,96 @@ struct HistoryPositionInfo {
 struct MotionQueueMotorOperations::HistorySegment {
   HistoryPositionInfo pos_info[MOTION_MOTOR_COUNT];
   unsigned short aux_bits;
+  uint32_t loops;     // All loops of the segment.
+};
+
+// Steps done in the first "loops" of a segment: the rising edges of the
+// top bit while the fraction accumulates.
+static uint32_t steps_in_loops(uint32_t loops, uint32_t fraction) {
+  return ((uint64_t) loops * fraction + (1u << 31)) >> 32;
+}
+
+// Segments not yet sent to the backend, with their history.
+struct MotionQueueMotorOperations::Batch {
+  Batch() : count(0), has_moves(false) {}
+  MotionSegment segments[MAX_BATCH_SIZE];
+  HistorySegment history[MAX_BATCH_SIZE];
+  int count;
+  bool has_moves;   // Not only aux bits: motors need to be enabled.
 };
 
 MotionQueueMotorOperations::
 MotionQueueMotorOperations(HardwareMapping *hw, MotionQueue *backend)
   : hardware_mapping_(hw),
     backend_(backend),
-    shadow_queue_(new std::deque<struct HistorySegment>()) {
-  // Initialize the history queue.
-  shadow_queue_->push_front({});
+    shadow_queue_(new HistorySegment[HISTORY_LEN]()),
+    newest_history_(0) {
 }
 
 MotionQueueMotorOperations::~MotionQueueMotorOperations() {
-  delete shadow_queue_;
+  delete [] shadow_queue_;
 }
 
-bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
-                                                 int defining_axis_steps) {
-  struct MotionSegment new_element = {};
-  new_element.direction_bits = 0;
+void MotionQueueMotorOperations::PushHistory(const HistorySegment &history) {
+  ++newest_history_;
+  shadow_queue_[newest_history_ % HISTORY_LEN] = history;
+}
 
-  // The new segment is based on the previous position.
-  struct HistorySegment history_segment = shadow_queue_->front();
+MotionQueueMotorOperations::HistorySegment *
+MotionQueueMotorOperations::History(unsigned int age) {
+  if (age >= HISTORY_LEN) age = HISTORY_LEN - 1;  // Only known that far.
+  return &shadow_queue_[(newest_history_ - age) % HISTORY_LEN];
+}
+
+MotionQueueMotorOperations::HistorySegment
+MotionQueueMotorOperations::GetLastHistory(const Batch &batch) {
+  if (batch.count > 0)
+    return batch.history[batch.count - 1];
+  std::lock_guard<std::mutex> l(shadow_mutex_);
+  return *History(0);
+}
+
+bool MotionQueueMotorOperations::AddToBatch(const MotionSegment &segment,
+                                            const HistorySegment &history,
+                                            Batch *batch) {
+  if (batch->count == MAX_BATCH_SIZE && !SendBatch(batch))
+    return false;
+  batch->segments[batch->count] = segment;
+  batch->history[batch->count] = history;
+  batch->history[batch->count].loops =
+    segment.loops_accel + segment.loops_travel + segment.loops_decel;
+  ++batch->count;
+  return true;
+}
+
+bool MotionQueueMotorOperations::SendBatch(Batch *batch) {
+  if (batch->count == 0)
+    return true;
+  {
+    std::lock_guard<std::mutex> l(shadow_mutex_);
+    for (int i = 0; i < batch->count; ++i) {
+      PushHistory(batch->history[i]);
+    }
+  }
+  if (batch->has_moves) backend_->MotorEnable(true);
+  // Don't hold the lock here: this blocks while the backend queue is full.
+  const bool ret = backend_->EnqueueMany(batch->segments, batch->count);
+  if (!ret) {
+    // The backend did not take any of them (e.g. E-Stop), so they don't get
+    // a segment number. Keep the history numbered like the backend.
+    std::lock_guard<std::mutex> l(shadow_mutex_);
+    newest_history_ -= batch->count;
+  }
+  batch->count = 0;
+  batch->has_moves = false;
+  return ret;
+}
+
+void MotionQueueMotorOperations::SetMotorSteps(const LinearSegmentSteps &param,
+                                               int defining_axis_steps,
+                                               MotionSegment *element,
+                                               HistorySegment *history) {
+  element->direction_bits = 0;
 
   // The defining_axis_steps is the number of steps of the axis that requires
   // the most number of steps. All the others are a fraction of the steps.
@@ -133,132 +274,250 @@ bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param
   for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
     bool flip = hardware_mapping_->IsMotorFlipped(i);
     if (param.steps[i] < 0) {
-      if (!flip) new_element.direction_bits |= (1 << i);
-      history_segment.pos_info[i].sign = -1;
+      if (!flip) element->direction_bits |= (1 << i);
+      history->pos_info[i].sign = -1;
     } else {
-      if (flip) new_element.direction_bits |= (1 << i);
-      history_segment.pos_info[i].sign = 1;
+      if (flip) element->direction_bits |= (1 << i);
+      history->pos_info[i].sign = 1;
     }
-    history_segment.pos_info[i].position_steps += param.steps[i];
+    history->pos_info[i].position_steps += param.steps[i];
     const uint64_t delta = abs(param.steps[i]);
-    new_element.fractions[i] = delta * max_fraction / defining_axis_steps;
-    history_segment.pos_info[i].fraction = new_element.fractions[i];
+    element->fractions[i] = delta * max_fraction / defining_axis_steps;
+    history->pos_info[i].fraction = element->fractions[i];
   }
 
-  history_segment.aux_bits = param.aux_bits;
-  shadow_queue_->push_front(history_segment);
+  history->aux_bits = param.aux_bits;
+}
 
+// Start the acceleration series of "element" at speed "v".
+static void set_accel_series_start(float v, float acceleration,
+                                   MotionSegment *element) {
+  // If we accelerated from zero to our first speed, this is how many steps
+  // we needed. We need to go this index into our taylor series.
+  const int accel_loops_from_zero =
+    round2int(LOOPS_PER_STEP * (sq(v - 0) / (2.0f * acceleration)));
+
+  element->accel_series_index = accel_loops_from_zero;
+  element->hires_accel_cycles =
+    round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(element->accel_series_index, acceleration));
+}
+
+// Set up the phase of "element" that "param" describes. There are three
+// cases: either we accelerate, travel or decelerate. A deceleration after an
+// acceleration continues in the acceleration series where it ended.
+static void add_phase(const LinearSegmentSteps &param, int defining_axis_steps,
+                      MotionSegment *element) {
   // TODO: clamp acceleration to be a minimum value.
   const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
-  // There are three cases: either we accelerate, travel or decelerate.
   if (param.v0 == param.v1) {
     // Travel
-    new_element.loops_accel = new_element.loops_decel = 0;
-    new_element.loops_travel = total_loops;
+    element->loops_travel = total_loops;
     const float travel_speed = clip_hardware_frequency_limit(param.v0);
-    new_element.travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
+    element->travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
   } else if (param.v0 < param.v1) {
     // acclereate
-    new_element.loops_travel = new_element.loops_decel = new_element.travel_delay_cycles = 0;
-    new_element.loops_accel = total_loops;
+    element->loops_accel = total_loops;
 
     // v1 = v0 + a*t -> t = (v1 - v0)/a
     // s = a/2 * t^2 + v0 * t; subsitution t from above.
     // a = (v1^2-v0^2)/(2*s)
     float acceleration = (sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
     //fprintf(stderr, "M-OP HZ: defining=%d ; accel=%.2f\n", defining_axis_steps, acceleration);
-    // If we accelerated from zero to our first speed, this is how many steps
-    // we needed. We need to go this index into our taylor series.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
+    set_accel_series_start(param.v0, acceleration, element);
   } else {  // v0 > v1
     // decelerate
-    new_element.loops_travel = new_element.loops_accel = new_element.travel_delay_cycles = 0;
-    new_element.loops_decel = total_loops;
+    element->loops_decel = total_loops;
+    if (element->loops_accel > 0)
+      return;
 
     float acceleration = (sq(param.v0) - sq(param.v1)) / (2.0f * defining_axis_steps);
     //fprintf(stderr, "M-OP HZ: defining=%d ; decel=%.2f\n", defining_axis_steps, acceleration);
     // We are into the taylor sequence this value up and reduce from there.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
+    set_accel_series_start(param.v0, acceleration, element);
+  }
+}
 
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
+// Can the first "count" segments run as the phases of one MotionSegment ?
+// They need to accelerate, travel and decelerate (each optional, but in this
+// order) along the same line. The deceleration continues in the acceleration
+// series, so it needs to end close to the speed it is meant to reach.
+static bool is_trapezoid(const LinearSegmentSteps *phases, int count) {
+  LinearSegmentSteps total = phases[0];
+  int phase_steps[3];
+  int loops[3] = { 0, 0, 0 };   // Acceleration, travel, deceleration.
+  int accel_phase = -1, decel_phase = -1;
+  int last_kind = -1;
+  int sum_steps = 0;
+  for (int p = 0; p < count; ++p) {
+    const LinearSegmentSteps &segment = phases[p];
+    const int kind = (segment.v0 < segment.v1) ? 0
+      : (segment.v0 == segment.v1) ? 1 : 2;
+    if (kind <= last_kind)
+      return false;
+    if (p > 0 && (segment.v0 != phases[p-1].v1
+                  || segment.aux_bits != total.aux_bits))
+      return false;
+    last_kind = kind;
+    phase_steps[p] = get_defining_axis_steps(segment);
+    if (phase_steps[p] == 0)
+      return false;
+    sum_steps += phase_steps[p];
+    loops[kind] = LOOPS_PER_STEP * phase_steps[p];
+    if (kind == 0) accel_phase = p;
+    if (kind == 2) decel_phase = p;
+    if (p == 0)
+      continue;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      total.steps[i] += segment.steps[i];
+    }
+  }
+  if (loops[0] > MAX_ACCEL_LOOPS || loops[2] > MAX_ACCEL_LOOPS
+      || loops[0] + loops[1] + loops[2] > MAX_SEGMENT_LOOPS)
+    return false;
+
+  // Same line: each phase has its share of the steps on every motor, give
+  // or take the rounding to full steps.
+  const int total_steps = get_defining_axis_steps(total);
+  if (total_steps != sum_steps)
+    return false;
+  for (int p = 0; p < count; ++p) {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const int64_t deviation = (int64_t) phases[p].steps[i] * total_steps
+        - (int64_t) total.steps[i] * phase_steps[p];
+      if (llabs(deviation) > total_steps)
+        return false;
+    }
   }
 
+  if (accel_phase < 0 || decel_phase < 0)
+    return true;
+
+  // Where the series ends when decelerating after the acceleration, compared
+  // to the index of the final speed.
+  const LinearSegmentSteps &accel = phases[accel_phase];
+  const float acceleration = (sq(accel.v1) - sq(accel.v0))
+    / (2.0f * phase_steps[accel_phase]);
+  const int end_index =
+    round2int(LOOPS_PER_STEP * (sq(accel.v0) / (2.0f * acceleration)))
+    + loops[0] - loops[2];
+  const double final_index =
+    LOOPS_PER_STEP * sqd(phases[decel_phase].v1) / (2.0 * acceleration);
+  return end_index >= 0
+    && fabs(end_index - final_index) <= MAX_TRAPEZOID_INDEX_ERROR;
+}
+
+bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
+                                                 int defining_axis_steps,
+                                                 Batch *batch) {
+  struct MotionSegment new_element = {};
+
+  // The new segment is based on the previous position.
+  struct HistorySegment history_segment = GetLastHistory(*batch);
+  SetMotorSteps(param, defining_axis_steps, &new_element, &history_segment);
+  add_phase(param, defining_axis_steps, &new_element);
+
   new_element.aux = param.aux_bits;
   new_element.state = STATE_FILLED;
-  backend_->MotorEnable(true);
-  return backend_->Enqueue(&new_element);
+  if (!AddToBatch(new_element, history_segment, batch))
+    return false;
+  batch->has_moves = true;
+  return true;
+}
+
+bool MotionQueueMotorOperations::EnqueueTrapezoid(const LinearSegmentSteps *phases,
+                                                  int count, Batch *batch) {
+  LinearSegmentSteps total = phases[0];
+  for (int p = 1; p < count; ++p) {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      total.steps[i] += phases[p].steps[i];
+    }
+  }
+
+  struct MotionSegment new_element = {};
+  struct HistorySegment history_segment = GetLastHistory(*batch);
+  SetMotorSteps(total, get_defining_axis_steps(total),
+                &new_element, &history_segment);
+  for (int p = 0; p < count; ++p) {
+    add_phase(phases[p], get_defining_axis_steps(phases[p]), &new_element);
+  }
+
+  new_element.aux = total.aux_bits;
+  new_element.state = STATE_FILLED;
+  if (!AddToBatch(new_element, history_segment, batch))
+    return false;
+  batch->has_moves = true;
+  return true;
 }
 
 bool MotionQueueMotorOperations::GetPhysicalStatus(PhysicalStatus *status) {
-  // Shrink the queue
-  uint32_t loops;
-  const int buffer_size = backend_->GetPendingElements(&loops);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
-
-  // Get the last element
-  const HistorySegment &hs = shadow_queue_->back();
-  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  std::lock_guard<std::mutex> l(shadow_mutex_);
+  uint32_t segment, loops_left;
+  backend_->GetExecutingSegment(&segment, &loops_left);
+
+  // Histories are added before the backend sees the segments (and taken back
+  // if it rejects them), so we know the one executed: the history is
+  // numbered like the backend segments.
+  const HistorySegment &hs = *History(newest_history_ - segment);
+  const uint32_t loops_done = hs.loops - std::min(loops_left, hs.loops);
 
   // NOTE: Assuming MOTION_MOTOR_COUNT == BEAGLEG_NUM_MOTORS
-  uint64_t steps;
   for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
-    const HistoryPositionInfo pos_info = hs.pos_info[i];
-    // Let's round-up the division, 5.1 is still a toggle, so it's 6 loops.
-    steps = loops / LOOPS_PER_STEP;
-    steps *= pos_info.fraction;
-    steps += max_fraction - 1;
-    steps /= max_fraction;
-    status->pos_steps[i] = pos_info.position_steps - pos_info.sign * (int) steps;
+    const HistoryPositionInfo &pos_info = hs.pos_info[i];
+    const int steps_left = steps_in_loops(hs.loops, pos_info.fraction)
+      - steps_in_loops(loops_done, pos_info.fraction);
+    status->pos_steps[i] = pos_info.position_steps - pos_info.sign * steps_left;
   }
   status->aux_bits = hs.aux_bits;
   return true;
 }
 
 void MotionQueueMotorOperations::SetExternalPosition(int axis, int steps) {
-  struct HistorySegment history_segment = shadow_queue_->front();
+  std::lock_guard<std::mutex> l(shadow_mutex_);
+  // Position at the end of the newest segment; the history is kept in
+  // step with the segments of the backend.
+  struct HistorySegment *history_segment = History(0);
   if (steps < 0) {
-    history_segment.pos_info[axis].sign = -1;
-    history_segment.pos_info[axis].position_steps = -steps;
+    history_segment->pos_info[axis].sign = -1;
+    history_segment->pos_info[axis].position_steps = -steps;
   } else {
-    history_segment.pos_info[axis].sign = 1;
-    history_segment.pos_info[axis].position_steps = steps;
+    history_segment->pos_info[axis].sign = 1;
+    history_segment->pos_info[axis].position_steps = steps;
   }
-  shadow_queue_->push_front(history_segment);
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
 }
 
-static int get_defining_axis_steps(const LinearSegmentSteps &param) {
-  int defining_axis_steps = abs(param.steps[0]);
-  for (int i = 1; i < BEAGLEG_NUM_MOTORS; ++i) {
-    if (abs(param.steps[i]) > defining_axis_steps) {
-      defining_axis_steps = abs(param.steps[i]);
-    }
+bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
+  return EnqueueMany(&param, 1);
+}
+
+bool MotionQueueMotorOperations::EnqueueMany(const LinearSegmentSteps *segments,
+                                             int count) {
+  Batch batch;
+  bool ret = true;
+  int i = 0;
+  while (ret && i < count) {
+    // Phases of one move run from one segment of the backend queue.
+    int phases = std::min(count - i, 3);
+    while (phases > 1 && !is_trapezoid(segments + i, phases))
+      --phases;
+    ret = (phases > 1)
+      ? EnqueueTrapezoid(segments + i, phases, &batch)
+      : EnqueueOne(segments[i], &batch);
+    i += phases;
   }
-  return defining_axis_steps;
+  return ret && SendBatch(&batch);
 }
 
-bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
+bool MotionQueueMotorOperations::EnqueueOne(const LinearSegmentSteps &param,
+                                            Batch *batch) {
   const int defining_axis_steps = get_defining_axis_steps(param);
+  const int max_steps = (param.v0 == param.v1)
+    ? MAX_TRAVEL_STEPS_PER_SEGMENT
+    : MAX_ACCEL_STEPS_PER_SEGMENT;
   bool ret;
 
   if (defining_axis_steps == 0) {
     // The new segment is based on the previous position.
-    struct HistorySegment history_segment = shadow_queue_->front();
+    struct HistorySegment history_segment = GetLastHistory(*batch);
 
     // No move, but we still have to set the bits.
     struct MotionSegment empty_element = {};
@@ -266,15 +525,13 @@ bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
     empty_element.state = STATE_FILLED;
 
     history_segment.aux_bits = param.aux_bits;
-    shadow_queue_->push_front(history_segment);
-
-    ret = backend_->Enqueue(&empty_element);
+    ret = AddToBatch(empty_element, history_segment, batch);
   }
-  else if (defining_axis_steps > MAX_STEPS_PER_SEGMENT) {
+  else if (defining_axis_steps > max_steps) {
     // We have more steps that we can enqueue in one chunk, so let's cut
     // it in pieces.
     const double a = (sqd(param.v1) - sqd(param.v0))/(2.0*defining_axis_steps);
-    const int divisions = (defining_axis_steps / MAX_STEPS_PER_SEGMENT) + 1;
+    const int divisions = (defining_axis_steps / max_steps) + 1;
     int64_t hires_steps_per_div[BEAGLEG_NUM_MOTORS];
     for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
       // (+1 to fix rounding trouble in the LSB)
@@ -304,24 +561,92 @@ bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
       const double v1 = v1squared > 0.0 ? sqrt(v1squared) : 0;
       output.v0 = previous_speed;
       output.v1 = v1;
-      ret = EnqueueInternal(output, division_steps);
+      ret = EnqueueInternal(output, division_steps, batch);
       if (!ret) break;
       previous = accumulator;
       previous_speed = v1;
     }
   } else {
-    ret = EnqueueInternal(param, defining_axis_steps);
+    ret = EnqueueInternal(param, defining_axis_steps, batch);
   }
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
   return ret;
 }
 
+bool MotionQueueMotorOperations::MoveUntilEndstop(const LinearSegmentSteps &param,
+                                                  const EndstopSwitch &endstop,
+                                                  float deceleration,
+                                                  HomingResult *result) {
+  if (!backend_->SupportsEndstopWatch())
+    return false;
+
+  // The endstop status is about the last homing segment; so we don't mix
+  // this with other segments in the queue.
+  backend_->WaitQueueEmpty();
+
+  // One segment, so that the hardware can decelerate right away. Longer
+  // moves are shortened; the caller will just continue.
+  LinearSegmentSteps segment = param;
+  int defining_axis_steps = get_defining_axis_steps(param);
+  if (defining_axis_steps == 0 || param.v1 <= 0)
+    return false;
+  if (defining_axis_steps > MAX_TRAVEL_STEPS_PER_SEGMENT) {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      segment.steps[i] = (int64_t) param.steps[i] * MAX_TRAVEL_STEPS_PER_SEGMENT
+        / defining_axis_steps;
+    }
+    defining_axis_steps = get_defining_axis_steps(segment);
+  }
+
+  Batch batch;
+  struct MotionSegment element = {};
+  struct HistorySegment history_segment = GetLastHistory(batch);
+  SetMotorSteps(segment, defining_axis_steps, &element, &history_segment);
+
+  element.endstop_trigger = endstop.trigger_level ? ENDSTOP_HIGH : ENDSTOP_LOW;
+  element.endstop_gpio = endstop.gpio;
+
+  // Accelerate from v0 to v1 as far as the move allows, then travel. The
+  // acceleration series position is kept up-to-date in both phases, so that
+  // the hardware can decelerate from wherever the endstop triggers.
+  const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
+  const float v1 = clip_hardware_frequency_limit(segment.v1);
+  if (deceleration > 0) {
+    const int index_v0 =
+      round2int(LOOPS_PER_STEP * (sq(segment.v0) / (2.0f * deceleration)));
+    const int index_v1 =
+      round2int(LOOPS_PER_STEP * (sq(v1) / (2.0f * deceleration)));
+    element.accel_series_index = std::min(index_v0, index_v1);
+    element.loops_accel = std::min({ index_v1 - (int)element.accel_series_index,
+                                     total_loops, MAX_ACCEL_LOOPS });
+    element.hires_accel_cycles =
+      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(element.accel_series_index, deceleration));
+  }
+  element.loops_travel = total_loops - element.loops_accel;
+  element.travel_delay_cycles =
+    round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * v1));
+  element.aux = segment.aux_bits;
+  element.state = STATE_FILLED;
+
+  if (!AddToBatch(element, history_segment, &batch))
+    return false;
+  batch.has_moves = true;
+  if (!SendBatch(&batch))
+    return false;
+  backend_->WaitQueueEmpty();
+
+  uint32_t skipped_loops = 0;
+  result->triggered = backend_->GetEndstopTrigger(&skipped_loops);
+  const uint32_t executed_loops = total_loops - skipped_loops;
+  std::lock_guard<std::mutex> l(shadow_mutex_);
+  HistorySegment *done = History(0);
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    const int steps = steps_in_loops(executed_loops, element.fractions[i]);
+    result->steps[i] = segment.steps[i] < 0 ? -steps : steps;
+    done->pos_info[i].position_steps += result->steps[i] - segment.steps[i];
+  }
+  return true;
+}
+
 void MotionQueueMotorOperations::MotorEnable(bool on) {
   backend_->WaitQueueEmpty();
   backend_->MotorEnable(on);
@@ -330,3 +655,8 @@ void MotionQueueMotorOperations::MotorEnable(bool on) {
 void MotionQueueMotorOperations::WaitQueueEmpty() {
   backend_->WaitQueueEmpty();
 }
+
+void MotionQueueMotorOperations::SetSpeedFactor(float factor,
+                                                float ramp_seconds) {
+  backend_->SetSpeedFactor(factor, ramp_seconds);
+}
@@ -19,10 +19,12 @@
 #ifndef _BEAGLEG_MOTOR_OPERATIONS_H_
 #define _BEAGLEG_MOTOR_OPERATIONS_H_
 
+#include <stdint.h>
 #include <stdio.h>
-#include <deque>
+#include <mutex>
 
 class MotionQueue;
+struct MotionSegment;
 
 enum {
   BEAGLEG_NUM_MOTORS = 8
@@ -53,6 +55,20 @@ struct PhysicalStatus {
   unsigned short aux_bits;            // Auxes status
 };
 
+// An endstop switch as seen by the hardware: the GPIO it is connected to and
+// the level the input has when the switch is triggered.
+struct EndstopSwitch {
+  uint32_t gpio;
+  bool trigger_level;
+};
+
+// Outcome of a move that stops at an endstop.
+struct HomingResult {
+  bool triggered;                  // Stopped because the endstop triggered.
+  int steps[BEAGLEG_NUM_MOTORS];   // Steps actually done, including the
+                                   // deceleration after the trigger.
+};
+
 class MotorOperations {  // Rename SegmentQueue ?
 public:
   virtual ~MotorOperations() {}
@@ -65,6 +81,16 @@ public:
   // Returns true if the move was added, false if aborted
   virtual bool Enqueue(const LinearSegmentSteps &segment) = 0;
 
+  // Enqueue "count" move commands in this order. Same as calling Enqueue()
+  // for each of them, but implementations can hand them on in bulk.
+  // Returns true if all moves were added, false if aborted.
+  virtual bool EnqueueMany(const LinearSegmentSteps *segments, int count) {
+    for (int i = 0; i < count; ++i) {
+      if (!Enqueue(segments[i])) return false;
+    }
+    return true;
+  }
+
   // Waits for the queue to be empty and Enables/disables motors according to the
   // given boolean value (Right now, motors cannot be individually addressed).
   virtual void MotorEnable(bool on) = 0;
@@ -78,9 +104,32 @@ public:
   virtual bool GetPhysicalStatus(PhysicalStatus *status) = 0;
 
   virtual void SetExternalPosition(int axis, int steps) = 0;
+
+  // Scale the speed of all motion with the given factor [0..1], including
+  // the segments that are already enqueued. Meant for operator override.
+  // The change is ramped in over "ramp_seconds" for the full range.
+  // Zero is a feed hold: motion stops, the queue is kept.
+  virtual void SetSpeedFactor(float factor, float ramp_seconds) = 0;
+
+  // Move like "segment" until the "endstop" triggers, watched by the
+  // hardware without host round trips. Accelerates from v0 to v1 and
+  // travels at v1; once the endstop triggers, decelerates with
+  // "deceleration" (steps/s^2; <= 0 stops right away). Long moves might
+  // be shortened to what the hardware can do in one go.
+  // Waits until the motors stop and reports what was done in "result".
+  // Returns false if the hardware can't watch endstops or on abort.
+  virtual bool MoveUntilEndstop(const LinearSegmentSteps &segment,
+                                const EndstopSwitch &endstop,
+                                float deceleration, HomingResult *result) {
+    return false;
+  }
 };
 
 class HardwareMapping;
+
+// Converts segments into MotionSegments for the MotionQueue. Acceleration,
+// travel and deceleration of a move that are enqueued together (as the
+// planner does) run from one MotionSegment if possible, phase by phase.
 class MotionQueueMotorOperations : public MotorOperations {
 public:
   // Initialize motor operations, sending planned results into the motion backend.
@@ -88,20 +137,57 @@ public:
   ~MotionQueueMotorOperations() override;
 
   bool Enqueue(const LinearSegmentSteps &segment) final;
+  bool EnqueueMany(const LinearSegmentSteps *segments, int count) final;
   void MotorEnable(bool on) final;
   void WaitQueueEmpty() final;
   bool GetPhysicalStatus(PhysicalStatus *status) final;
   void SetExternalPosition(int axis, int pos) final;
+  void SetSpeedFactor(float factor, float ramp_seconds) final;
+  bool MoveUntilEndstop(const LinearSegmentSteps &segment,
+                        const EndstopSwitch &endstop,
+                        float deceleration, HomingResult *result) final;
 
 private:
+  struct HistorySegment;
+  struct Batch;
+
+  // Set direction bits and step fractions of "element" and the position
+  // in "history" for a move of "param".
+  void SetMotorSteps(const LinearSegmentSteps &param, int defining_axis_steps,
+                     MotionSegment *element, HistorySegment *history);
+
+  bool EnqueueOne(const LinearSegmentSteps &param, Batch *batch);
   bool EnqueueInternal(const LinearSegmentSteps &param,
-                       int defining_axis_steps);
+                       int defining_axis_steps, Batch *batch);
+
+  // Enqueue acceleration, travel and deceleration of a move, given in
+  // "count" segments, as one segment that the backend runs phase by phase.
+  bool EnqueueTrapezoid(const LinearSegmentSteps *phases, int count,
+                        Batch *batch);
+
+  // Segments are collected in a batch and handed to the backend together.
+  // Adding to a full batch sends it first.
+  bool AddToBatch(const MotionSegment &segment, const HistorySegment &history,
+                  Batch *batch);
+  bool SendBatch(Batch *batch);
+
+  // Access to the shadow queue. The planner might enqueue from a different
+  // thread than the one asking for the physical status.
+  HistorySegment GetLastHistory(const Batch &batch);
+
+  // The shadow queue is a ring with the history of the newest segments,
+  // enough to cover all in the backend. Both require shadow_mutex_ held.
+  void PushHistory(const HistorySegment &history);
+  HistorySegment *History(unsigned int age);  // age 0: newest.
 
   HardwareMapping *const hardware_mapping_;
   MotionQueue *backend_;
 
-  struct HistorySegment;
-  std::deque<struct HistorySegment> *shadow_queue_;
+  std::mutex shadow_mutex_;
+  HistorySegment *const shadow_queue_;
+  // Newest entry in shadow_queue_; entries are numbered like the segments
+  // of the backend, see MotionQueue::GetExecutingSegment().
+  unsigned int newest_history_;
 };
 
 #endif  // _BEAGLEG_MOTOR_OPERATIONS_H_
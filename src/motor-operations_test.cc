@@ -7,36 +7,56 @@
  */
 #include "motion-queue.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <set>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
 #include "common/container.h"
 #include "common/logging.h"
 #include "hardware-mapping.h"
+#include "motor-interface-constants.h"
 #include "motor-operations.h"
+#include "sim-firmware.h"
 
 class MockMotionQueue : public MotionQueue {
 public:
-  MockMotionQueue() : remaining_loops_(0), queue_size_(0) {}
+  MockMotionQueue()
+    : batches(0), reject_batches(false),
+      remaining_loops_(0), queue_size_(0), segments_(0) {}
 
   bool Enqueue(MotionSegment *segment) {
+    last_segment = *segment;
     remaining_loops_ = segment->loops_accel
       + segment->loops_travel + segment->loops_decel;
     queue_size_++;
+    segments_++;
     return true;
   }
 
+  bool EnqueueMany(MotionSegment *segments, int count) {
+    batches++;
+    if (reject_batches) return false;  // Like the PRU after an E-Stop.
+    return MotionQueue::EnqueueMany(segments, count);
+  }
+
   void WaitQueueEmpty() {};
   void MotorEnable(bool on) {};
   void Shutdown(bool flush_queue) {};
+  void SetSpeedFactor(float factor, float ramp_seconds) {};
   int GetPendingElements(uint32_t *head_item_progress) {
       if (head_item_progress)
         *head_item_progress = remaining_loops_;
       return queue_size_;
   }
+  void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left) {
+    *segment = segments_ - (queue_size_ > 0 ? queue_size_ - 1 : 0);
+    *loops_left = queue_size_ > 0 ? remaining_loops_ : 0;
+  }
 
   void SimRun(const uint32_t executed_loops, const unsigned int buffer_size) {
     assert(buffer_size <= queue_size_);
@@ -46,9 +66,14 @@ public:
     queue_size_ = buffer_size;
   }
 
+  int batches;
+  bool reject_batches;
+  MotionSegment last_segment;
+
 private:
   uint32_t remaining_loops_;
   unsigned int queue_size_;
+  uint32_t segments_;
 };
 
 // Check that on init, the initial position is 0.
@@ -161,8 +186,10 @@ TEST(RealtimePosition, sample_pos) {
   PhysicalStatus status;
   motor_operations.GetPhysicalStatus(&status);
   {
+    // Exactly the steps done in the first 140 of 160 loops; the first
+    // motor has its steps at loop 8, 24, ... 136.
     const int expected[BEAGLEG_NUM_MOTORS] =
-      {8, -17, 26, -35, 0, -52, 61, -70};
+      {9, -17, 26, -35, 0, -52, 61, -70};
     EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
   }
 
@@ -205,6 +232,355 @@ TEST(RealtimePosition, zero_loops_edge) {
   EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
 }
 
+// At any point of a segment, the position is the steps the hardware did:
+// one on each rising edge of the top bit of the accumulated fraction.
+TEST(RealtimePosition, exact_steps) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segment = {};
+  segment.v0 = 100;
+  segment.v1 = 5000;
+  segment.steps[0] = 1000;
+  segment.steps[1] = 333;
+  segment.steps[2] = -77;
+  motor_operations.Enqueue(segment);
+  const MotionSegment &element = motion_backend.last_segment;
+  const uint32_t total_loops = element.loops_accel;
+  ASSERT_EQ(2000u, total_loops);
+
+  uint32_t accumulator[3] = { 0, 0, 0 };
+  int steps[3] = { 0, 0, 0 };
+  for (uint32_t loops_left = total_loops; /**/; --loops_left) {
+    motion_backend.SimRun(loops_left, 1);
+    PhysicalStatus status;
+    motor_operations.GetPhysicalStatus(&status);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ(segment.steps[i] < 0 ? -steps[i] : steps[i],
+                status.pos_steps[i]) << "loops left " << loops_left;
+    }
+    if (loops_left == 0) break;
+    for (int i = 0; i < 3; ++i) {
+      const uint32_t before = accumulator[i];
+      accumulator[i] += element.fractions[i];
+      if (!(before & 0x80000000) && (accumulator[i] & 0x80000000))
+        ++steps[i];
+    }
+  }
+  EXPECT_EQ(1000, steps[0]);
+  EXPECT_EQ(333, steps[1]);
+  EXPECT_EQ(77, steps[2]);
+}
+
+// Segments enqueued together are handed to the motion queue in a few
+// batches, keeping track of the position across them.
+TEST(RealtimePosition, enqueue_many) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segments[10] = {};
+  for (int i = 0; i < 10; ++i) {
+    segments[i].v0 = segments[i].v1 = 1000;
+    segments[i].steps[0] = 100;
+    segments[i].steps[1] = (i % 2) ? 10 : -20;
+  }
+  EXPECT_TRUE(motor_operations.EnqueueMany(segments, 10));
+  EXPECT_EQ(3, motion_backend.batches);
+
+  motion_backend.SimRun(0, 0);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  const int expected[BEAGLEG_NUM_MOTORS] = {1000, -50, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+}
+
+// If the backend rejects a batch, the history stays numbered like the
+// segments of the backend, so a new position set afterwards is reported.
+TEST(RealtimePosition, rejected_batch) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segments[3] = {};
+  for (LinearSegmentSteps &segment : segments) {
+    segment.v0 = segment.v1 = 1000;
+    segment.steps[0] = 100;
+  }
+  EXPECT_TRUE(motor_operations.Enqueue(segments[0]));
+  motion_backend.reject_batches = true;
+  EXPECT_FALSE(motor_operations.EnqueueMany(segments, 3));
+  motion_backend.reject_batches = false;
+  motion_backend.SimRun(0, 0);
+
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(100, status.pos_steps[0]);
+
+  motor_operations.SetExternalPosition(0, 42);
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(42, status.pos_steps[0]);
+
+  EXPECT_TRUE(motor_operations.Enqueue(segments[0]));
+  motion_backend.SimRun(0, 0);
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(142, status.pos_steps[0]);
+}
+
+// The history of positions wraps around after many segments and still
+// gives the position of the segment executed.
+TEST(RealtimePosition, long_history) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segment = {};
+  segment.v0 = segment.v1 = 1000;
+  segment.steps[0] = 10;
+  for (int i = 0; i < 100; ++i) {
+    motor_operations.Enqueue(segment);
+  }
+  motion_backend.SimRun(0, 3);  // Two more waiting after the executed one.
+
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(980, status.pos_steps[0]);
+}
+
+static LinearSegmentSteps MakeSegment(float v0, float v1, int m0, int m1) {
+  LinearSegmentSteps segment = {};
+  segment.v0 = v0;
+  segment.v1 = v1;
+  segment.steps[0] = m0;
+  segment.steps[1] = m1;
+  return segment;
+}
+
+// Acceleration, travel and deceleration of a move end up in one segment.
+TEST(Trapezoid, one_segment) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps move[3] = {
+    MakeSegment(0, 10000, 1000, 500),
+    MakeSegment(10000, 10000, 3000, 1500),
+    MakeSegment(10000, 0, 1000, 500),
+  };
+  EXPECT_TRUE(motor_operations.EnqueueMany(move, 3));
+  EXPECT_EQ(1, motion_backend.GetPendingElements(NULL));
+  const MotionSegment &segment = motion_backend.last_segment;
+  EXPECT_EQ(2000, segment.loops_accel);
+  EXPECT_EQ(6000u, segment.loops_travel);
+  EXPECT_EQ(2000, segment.loops_decel);
+  // Decelerating back down the acceleration series ends at speed zero.
+  EXPECT_EQ(0u, segment.accel_series_index);
+
+  // The phases are the same as when enqueued one by one.
+  MockMotionQueue single_backend = MockMotionQueue();
+  MotionQueueMotorOperations single_operations(&hw, &single_backend);
+  single_operations.Enqueue(move[0]);
+  EXPECT_EQ(single_backend.last_segment.hires_accel_cycles,
+            segment.hires_accel_cycles);
+  single_operations.Enqueue(move[1]);
+  EXPECT_EQ(single_backend.last_segment.travel_delay_cycles,
+            segment.travel_delay_cycles);
+
+  // Executing the deceleration.
+  motion_backend.SimRun(1000, 1);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(4500, status.pos_steps[0]);
+  EXPECT_EQ(2250, status.pos_steps[1]);
+}
+
+// Segments that are not phases of a move along one line stay separate.
+TEST(Trapezoid, separate_segments) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  // Extra steps of the second motor while accelerating.
+  const LinearSegmentSteps advanced[3] = {
+    MakeSegment(0, 10000, 1000, 600),
+    MakeSegment(10000, 10000, 3000, 1500),
+    MakeSegment(10000, 0, 1000, 400),
+  };
+  EXPECT_TRUE(motor_operations.EnqueueMany(advanced, 3));
+  EXPECT_EQ(3, motion_backend.GetPendingElements(NULL));
+
+  // Decelerating faster than accelerating: the deceleration can't continue
+  // in the acceleration series.
+  const LinearSegmentSteps fast_stop[3] = {
+    MakeSegment(0, 10000, 1000, 500),
+    MakeSegment(10000, 10000, 3000, 1500),
+    MakeSegment(10000, 0, 500, 250),
+  };
+  EXPECT_TRUE(motor_operations.EnqueueMany(fast_stop, 3));
+  EXPECT_EQ(5, motion_backend.GetPendingElements(NULL));
+  EXPECT_EQ(1000, motion_backend.last_segment.loops_decel);
+  EXPECT_EQ(0, motion_backend.last_segment.loops_accel);
+}
+
+// The acceleration curve is looked up in a table; it needs to be the same
+// as calculated directly.
+TEST(AccelerationCurve, same_as_calculated) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  for (float v0 : { 0.0f, 100.0f, 1234.5f, 10000.0f, 80000.0f }) {
+    for (int steps : { 1, 7, 100, 3000 }) {
+      LinearSegmentSteps segment = {};
+      segment.v0 = v0;
+      segment.v1 = v0 + 5000;
+      segment.steps[0] = steps;
+      motor_operations.Enqueue(segment);
+
+      const float acceleration = (segment.v1 * segment.v1 - v0 * v0)
+        / (2.0f * steps);
+      const int index = roundf(2 * (v0 * v0 / (2.0f * acceleration)));
+      const float accel_factor = TIMER_FREQUENCY
+        * (sqrtf(2 * 2.0f / acceleration)) / 2;
+      const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
+      const float expected = c0 * (sqrtf(index + 1) - sqrtf(index));
+      EXPECT_EQ((uint32_t) index,
+                motion_backend.last_segment.accel_series_index);
+      EXPECT_EQ((uint32_t) roundf((1 << DELAY_CYCLE_SHIFT) * expected),
+                motion_backend.last_segment.hires_accel_cycles)
+        << "v0=" << v0 << " steps=" << steps;
+    }
+  }
+}
+
+// Long travel fits in one segment, acceleration only up to 16 bit loops.
+TEST(SegmentSplit, long_travel_is_one_segment) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segment = {};
+  segment.v0 = segment.v1 = 10000;
+  segment.steps[0] = 1000000;
+  segment.steps[1] = -300000;
+  motor_operations.Enqueue(segment);
+  EXPECT_EQ(1, motion_backend.GetPendingElements(NULL));
+  EXPECT_EQ(2000000u, motion_backend.last_segment.loops_travel);
+  EXPECT_EQ(0, motion_backend.last_segment.loops_accel);
+
+  motion_backend.SimRun(0, 0);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(1000000, status.pos_steps[0]);
+  EXPECT_EQ(-300000, status.pos_steps[1]);
+
+  segment.v0 = 0;
+  segment.steps[0] = 40000;
+  segment.steps[1] = 0;
+  motor_operations.Enqueue(segment);
+  EXPECT_EQ(2, motion_backend.GetPendingElements(NULL));
+  EXPECT_EQ(40000u, motion_backend.last_segment.loops_accel);
+}
+
+// Segments starting at series indexes around the end of the table get the
+// same acceleration curve as calculated directly.
+TEST(AccelerationCurve, same_at_table_boundary) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  std::set<uint32_t> seen_index;
+  // With 1000 steps from v0 to v0 + 1000, the series index is about
+  // v0^2 / (v0 + 500), which passes 4096 around v0 = 4546.
+  for (float v0 = 4540.0f; v0 < 4555.0f; v0 += 0.25f) {
+    for (float v : { v0, 80 * v0 }) {
+      LinearSegmentSteps segment = {};
+      segment.v0 = v;
+      segment.v1 = v + 1000;
+      segment.steps[0] = 1000;
+      motor_operations.Enqueue(segment);
+
+      const float acceleration = (segment.v1 * segment.v1 - v * v)
+        / (2.0f * 1000);
+      const int index = roundf(2 * (v * v / (2.0f * acceleration)));
+      const float accel_factor = TIMER_FREQUENCY
+        * (sqrtf(2 * 2.0f / acceleration)) / 2;
+      const float expected = accel_factor * (sqrtf(index + 1) - sqrtf(index));
+      EXPECT_EQ((uint32_t) index,
+                motion_backend.last_segment.accel_series_index);
+      EXPECT_EQ((uint32_t) roundf((1 << DELAY_CYCLE_SHIFT) * expected),
+                motion_backend.last_segment.hires_accel_cycles)
+        << "v0=" << v;
+      seen_index.insert(index);
+    }
+  }
+  for (uint32_t index : { 4094, 4095, 4096, 4097 }) {
+    EXPECT_EQ(1u, seen_index.count(index)) << index;
+  }
+}
+
+// Without support of the motion queue, there are no moves to endstops.
+TEST(MoveUntilEndstop, not_supported) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segment = {};
+  segment.v0 = segment.v1 = 1000;
+  segment.steps[0] = 100;
+  HomingResult result;
+  EXPECT_FALSE(motor_operations.MoveUntilEndstop(segment, { 42, true }, 0,
+                                                 &result));
+  EXPECT_EQ(0, motion_backend.batches);
+}
+
+// Moves stop at the endstop of the simulated firmware; the steps reported
+// are the steps done.
+TEST(MoveUntilEndstop, stops_at_endstop) {
+  HardwareMapping hw;
+  FILE *devnull = fopen("/dev/null", "w");
+  SimFirmwareQueue motion_backend(devnull, 1);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  motion_backend.SimulateEndstop(42, 0, 3000, true);
+
+  // Accelerate to 10000 steps/s, which takes 500 steps; same to decelerate.
+  LinearSegmentSteps segment = {};
+  segment.v0 = 0;
+  segment.v1 = 10000;
+  segment.steps[0] = 10000;
+  segment.steps[1] = 5000;
+  HomingResult result;
+  ASSERT_TRUE(motor_operations.MoveUntilEndstop(segment, { 42, true }, 1e5,
+                                                &result));
+  EXPECT_TRUE(result.triggered);
+  EXPECT_NEAR(3500, result.steps[0], 10);
+  EXPECT_NEAR(result.steps[0] / 2, result.steps[1], 1);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(result.steps[0], status.pos_steps[0]);
+  EXPECT_EQ(result.steps[1], status.pos_steps[1]);
+
+  // Going back to an endstop 100 steps from where we stopped, without
+  // deceleration, we get there exactly.
+  motion_backend.SimulateEndstop(43, 0, result.steps[0] - 100, false);
+  segment.v0 = segment.v1 = 1000;
+  segment.steps[0] = -1000;
+  segment.steps[1] = 0;
+  ASSERT_TRUE(motor_operations.MoveUntilEndstop(segment, { 43, false }, 0,
+                                                &result));
+  EXPECT_TRUE(result.triggered);
+  EXPECT_EQ(-100, result.steps[0]);
+
+  // Not triggered, the full move is done.
+  segment.steps[0] = 200;
+  ASSERT_TRUE(motor_operations.MoveUntilEndstop(segment, { 44, false }, 0,
+                                                &result));
+  EXPECT_FALSE(result.triggered);
+  EXPECT_EQ(200, result.steps[0]);
+  fclose(devnull);
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,266 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Feed a trace recorded with machine-control --planner-trace back through
+// the current planner and compare the segments it emits with the recorded
+// ones. Use it to see how a change to the planner affects real jobs.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common/logging.h"
+
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "planner-trace.h"
+#include "planner.h"
+
+namespace {
+// Collects the segments the planner emits.
+class CollectingMotorOperations : public MotorOperations {
+public:
+  explicit CollectingMotorOperations(std::vector<LinearSegmentSteps> *out)
+    : out_(out) {}
+
+  bool Enqueue(const LinearSegmentSteps &segment) final {
+    out_->push_back(segment);
+    return true;
+  }
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
+  void SetExternalPosition(int axis, int steps) final {}
+  void SetSpeedFactor(float factor, float ramp_seconds) final {}
+
+private:
+  std::vector<LinearSegmentSteps> *const out_;
+};
+}  // namespace
+
+static int64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Time the motors take for a segment: they change speed linearly over the
+// steps of the defining axis.
+static double segment_seconds(const LinearSegmentSteps &s) {
+  int defining_steps = 0;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (abs(s.steps[i]) > defining_steps) defining_steps = abs(s.steps[i]);
+  }
+  if (defining_steps == 0 || s.v0 + s.v1 <= 0) return 0;
+  return 2.0 * defining_steps / (s.v0 + s.v1);
+}
+
+static double total_seconds(const std::vector<LinearSegmentSteps> &segments) {
+  double result = 0;
+  for (const LinearSegmentSteps &s : segments) result += segment_seconds(s);
+  return result;
+}
+
+static bool same_speed(float a, float b) {
+  return fabsf(a - b) <= 1e-3 * std::max(fabsf(a), fabsf(b)) + 1e-3;
+}
+
+static bool same_segment(const LinearSegmentSteps &a,
+                         const LinearSegmentSteps &b) {
+  if (a.aux_bits != b.aux_bits) return false;
+  if (!same_speed(a.v0, b.v0) || !same_speed(a.v1, b.v1)) return false;
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    if (a.steps[i] != b.steps[i]) return false;
+  }
+  return true;
+}
+
+static void print_segment(const char *prefix, const LinearSegmentSteps &s) {
+  printf("%s v0=%9.1f v1=%9.1f aux=0x%04x steps=[", prefix, s.v0, s.v1,
+         s.aux_bits);
+  for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+    printf("%s%d", i == 0 ? "" : ", ", s.steps[i]);
+  }
+  printf("]\n");
+}
+
+static void set_aux_bits(HardwareMapping *hardware, uint16_t bits) {
+  for (int pin = 1; pin <= 16; ++pin) {
+    hardware->UpdateAuxBits(pin, bits & (1 << (pin - 1)));
+  }
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <trace-file>\n"
+          "Options:\n"
+          "\t-c <config> : Machine config the trace was recorded with.\n"
+          "\t-n <count>  : Print at most this many differing segments "
+          "(default 10).\n"
+          "\t-t          : Run planner in its own thread.\n"
+          "Exit code is 0 if the segments are the same, 2 if not.\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  MachineControlConfig config;
+  const char *config_file = NULL;
+  int max_print_diff = 10;
+  bool threaded = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:t")) != -1) {
+    switch (opt) {
+    case 'c': config_file = optarg; break;
+    case 'n': max_print_diff = atoi(optarg); break;
+    case 't': threaded = true; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    return usage(argv[0]);
+
+  if (!config_file) {
+    fprintf(stderr, "Expected config file -c <config>\n");
+    return 1;
+  }
+
+  Log_init("/dev/null");
+
+  ConfigParser config_parser;
+  HardwareMapping hardware;
+  if (!config_parser.SetContentFromFile(config_file)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    return 1;
+  }
+  if (!config.ConfigureFromFile(&config_parser)
+      || !hardware.ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
+            config_file);
+    return 1;
+  }
+  config.threaded_planner = threaded;
+
+  PlannerTraceReader *trace = PlannerTraceReader::Create(argv[optind]);
+  if (!trace) {
+    fprintf(stderr, "Cannot read planner trace '%s'\n", argv[optind]);
+    return 1;
+  }
+
+  // Inputs are replayed as they come; the recorded segments are kept for
+  // comparison.
+  std::vector<LinearSegmentSteps> recorded, replayed;
+  CollectingMotorOperations motor_ops(&replayed);
+  int64_t targets = 0;
+  int64_t planner_nanos = 0;
+  {
+    Planner planner(&config, &hardware, &motor_ops);
+
+    // Consecutive targets with the same aux bits are handed over in one go.
+    std::vector<PlannerTarget> batch;
+    uint16_t batch_aux_bits = 0;
+    auto enqueue_batch = [&]() {
+      if (batch.empty()) return;
+      set_aux_bits(&hardware, batch_aux_bits);
+      const int64_t start = now_nanos();
+      planner.EnqueueBatch(batch.data(), batch.size());
+      planner_nanos += now_nanos() - start;
+      targets += batch.size();
+      batch.clear();
+    };
+
+    PlannerTraceRecord record;
+    while (trace->Next(&record)) {
+      if (record.type == PlannerTraceRecord::SEGMENT) {
+        recorded.push_back(record.segment);
+        continue;
+      }
+      if (record.type == PlannerTraceRecord::TARGET) {
+        if (!batch.empty() && record.aux_bits != batch_aux_bits)
+          enqueue_batch();
+        batch_aux_bits = record.aux_bits;
+        batch.push_back({ record.target, record.feedrate,
+                          record.curve_radius });
+        continue;
+      }
+      enqueue_batch();
+      if (record.type == PlannerTraceRecord::HALT
+          || record.type == PlannerTraceRecord::DIRECT_DRIVE) {
+        set_aux_bits(&hardware, record.aux_bits);
+      }
+      const int64_t start = now_nanos();
+      switch (record.type) {
+      case PlannerTraceRecord::TARGET:
+        break;
+      case PlannerTraceRecord::HALT:
+        planner.BringPathToHalt();
+        break;
+      case PlannerTraceRecord::PATH_BLENDING:
+        planner.SetPathBlending(record.value);
+        break;
+      case PlannerTraceRecord::DIRECT_DRIVE:
+        planner.DirectDrive(record.axis, record.value, record.v0, record.v1);
+        break;
+      case PlannerTraceRecord::EXTERNAL_POSITION:
+        planner.SetExternalPosition(record.axis, record.value);
+        break;
+      case PlannerTraceRecord::SEGMENT:
+        break;
+      }
+      planner_nanos += now_nanos() - start;
+    }
+    enqueue_batch();
+    const int64_t start = now_nanos();
+    planner.BringPathToHalt();
+    planner_nanos += now_nanos() - start;
+  }
+  delete trace;
+
+  int differences = 0;
+  const size_t common = std::min(recorded.size(), replayed.size());
+  for (size_t i = 0; i < common; ++i) {
+    if (same_segment(recorded[i], replayed[i])) continue;
+    if (differences++ < max_print_diff) {
+      printf("Segment #%zu differs:\n", i);
+      print_segment("  recorded:", recorded[i]);
+      print_segment("  replayed:", replayed[i]);
+    }
+  }
+  differences += std::max(recorded.size(), replayed.size()) - common;
+
+  const double recorded_seconds = total_seconds(recorded);
+  const double replayed_seconds = total_seconds(replayed);
+  printf("%12s %10s %10s\n", "", "recorded", "replayed");
+  printf("%12s %10zu %10zu\n", "segments", recorded.size(), replayed.size());
+  printf("%12s %10.3f %10.3f (%+.2f%%)\n", "time (s)",
+         recorded_seconds, replayed_seconds,
+         recorded_seconds > 0
+         ? 100.0 * (replayed_seconds - recorded_seconds) / recorded_seconds
+         : 0.0);
+  printf("%lld targets, %d differing segments; planner %.0f ns/target\n",
+         (long long)targets, differences,
+         targets > 0 ? 1.0 * planner_nanos / targets : 0.0);
+  return differences == 0 ? 0 : 2;
+}
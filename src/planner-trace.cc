@@ -0,0 +1,191 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "planner-trace.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "common/logging.h"
+
+// File header: magic, format version, number of axes and motors.
+static constexpr char kTraceMagic[4] = { 'B', 'G', 'P', 'T' };
+static constexpr uint8_t kTraceVersion = 1;
+
+// Largest record: type, axis, aux bits, and up to GCODE_NUM_AXES or
+// BEAGLEG_NUM_MOTORS values of four bytes plus a few floats.
+static constexpr int kMaxRecordSize = 4 + 4 * (GCODE_NUM_AXES
+                                               + BEAGLEG_NUM_MOTORS + 4);
+
+namespace {
+// Serialize values into a record buffer.
+class RecordBuilder {
+public:
+  RecordBuilder() : pos_(0) {}
+  template <typename T> void Add(const T &value) {
+    memcpy(buffer_ + pos_, &value, sizeof(value));
+    pos_ += sizeof(value);
+  }
+  const char *data() const { return buffer_; }
+  size_t size() const { return pos_; }
+
+private:
+  char buffer_[kMaxRecordSize];
+  size_t pos_;
+};
+
+template <typename T> static bool ReadValue(FILE *in, T *value) {
+  return fread(value, sizeof(*value), 1, in) == 1;
+}
+}  // namespace
+
+PlannerTraceWriter *PlannerTraceWriter::Create(const char *filename) {
+  FILE *out = fopen(filename, "wb");
+  if (!out) {
+    Log_error("Can't open planner trace %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  const uint8_t header[] = { kTraceVersion, GCODE_NUM_AXES,
+                             BEAGLEG_NUM_MOTORS, 0 };
+  fwrite(kTraceMagic, sizeof(kTraceMagic), 1, out);
+  fwrite(header, sizeof(header), 1, out);
+  return new PlannerTraceWriter(out);
+}
+
+PlannerTraceWriter::PlannerTraceWriter(FILE *out) : out_(out) {}
+
+PlannerTraceWriter::~PlannerTraceWriter() {
+  fclose(out_);
+}
+
+void PlannerTraceWriter::Write(const PlannerTraceRecord &r) {
+  RecordBuilder b;
+  b.Add((uint8_t) r.type);
+  switch (r.type) {
+  case PlannerTraceRecord::TARGET:
+    b.Add(r.aux_bits);
+    b.Add(r.feedrate);
+    b.Add(r.curve_radius);
+    for (const GCodeParserAxis a : AllAxes())
+      b.Add(r.target[a]);
+    break;
+  case PlannerTraceRecord::HALT:
+    b.Add(r.aux_bits);
+    break;
+  case PlannerTraceRecord::PATH_BLENDING:
+    b.Add(r.value);
+    break;
+  case PlannerTraceRecord::DIRECT_DRIVE:
+    b.Add((uint8_t) r.axis);
+    b.Add(r.aux_bits);
+    b.Add(r.value);
+    b.Add(r.v0);
+    b.Add(r.v1);
+    break;
+  case PlannerTraceRecord::EXTERNAL_POSITION:
+    b.Add((uint8_t) r.axis);
+    b.Add(r.value);
+    break;
+  case PlannerTraceRecord::SEGMENT:
+    b.Add(r.segment.aux_bits);
+    b.Add(r.segment.v0);
+    b.Add(r.segment.v1);
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+      b.Add(r.segment.steps[i]);
+    break;
+  }
+  std::lock_guard<std::mutex> l(mutex_);
+  fwrite(b.data(), b.size(), 1, out_);
+}
+
+PlannerTraceReader *PlannerTraceReader::Create(const char *filename) {
+  FILE *in = fopen(filename, "rb");
+  if (!in) {
+    Log_error("Can't open planner trace %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  char magic[sizeof(kTraceMagic)];
+  uint8_t header[4];
+  if (!ReadValue(in, &magic) || !ReadValue(in, &header)
+      || memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+    Log_error("%s: not a planner trace.", filename);
+    fclose(in);
+    return NULL;
+  }
+  if (header[0] != kTraceVersion || header[1] != GCODE_NUM_AXES
+      || header[2] != BEAGLEG_NUM_MOTORS) {
+    Log_error("%s: trace version %d with %d axes, %d motors; "
+              "expected version %d with %d axes, %d motors.", filename,
+              header[0], header[1], header[2],
+              kTraceVersion, GCODE_NUM_AXES, BEAGLEG_NUM_MOTORS);
+    fclose(in);
+    return NULL;
+  }
+  return new PlannerTraceReader(in);
+}
+
+PlannerTraceReader::PlannerTraceReader(FILE *in) : in_(in) {}
+
+PlannerTraceReader::~PlannerTraceReader() {
+  fclose(in_);
+}
+
+bool PlannerTraceReader::Next(PlannerTraceRecord *r) {
+  uint8_t type, axis;
+  if (!ReadValue(in_, &type))
+    return false;
+  r->type = (PlannerTraceRecord::Type) type;
+  switch (r->type) {
+  case PlannerTraceRecord::TARGET:
+    if (!ReadValue(in_, &r->aux_bits) || !ReadValue(in_, &r->feedrate)
+        || !ReadValue(in_, &r->curve_radius))
+      return false;
+    for (const GCodeParserAxis a : AllAxes()) {
+      if (!ReadValue(in_, &r->target[a]))
+        return false;
+    }
+    return true;
+  case PlannerTraceRecord::HALT:
+    return ReadValue(in_, &r->aux_bits);
+  case PlannerTraceRecord::PATH_BLENDING:
+    return ReadValue(in_, &r->value);
+  case PlannerTraceRecord::DIRECT_DRIVE:
+    if (!ReadValue(in_, &axis) || axis >= GCODE_NUM_AXES)
+      return false;
+    r->axis = (GCodeParserAxis) axis;
+    return (ReadValue(in_, &r->aux_bits) && ReadValue(in_, &r->value)
+            && ReadValue(in_, &r->v0) && ReadValue(in_, &r->v1));
+  case PlannerTraceRecord::EXTERNAL_POSITION:
+    if (!ReadValue(in_, &axis) || axis >= GCODE_NUM_AXES)
+      return false;
+    r->axis = (GCodeParserAxis) axis;
+    return ReadValue(in_, &r->value);
+  case PlannerTraceRecord::SEGMENT:
+    if (!ReadValue(in_, &r->segment.aux_bits) || !ReadValue(in_, &r->segment.v0)
+        || !ReadValue(in_, &r->segment.v1))
+      return false;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      if (!ReadValue(in_, &r->segment.steps[i]))
+        return false;
+    }
+    return true;
+  }
+  Log_error("Planner trace: unknown record type %d", type);
+  return false;
+}
@@ -0,0 +1,96 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_PLANNER_TRACE_H_
+#define _BEAGLEG_PLANNER_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <mutex>
+
+#include "gcode-parser/gcode-parser.h"  // AxesRegister
+#include "motor-operations.h"           // LinearSegmentSteps
+
+// A binary trace of everything that goes into the Planner and every segment
+// that comes out of it. Recorded on the machine, it can be fed back through
+// the planner with the planner-replay tool to see how changes to the
+// planner affect real-world jobs.
+//
+// The file starts with a header, followed by records that each start with a
+// type byte. Values are in host byte order, so traces are meant to be
+// replayed on a machine with the same endianness.
+struct PlannerTraceRecord {
+  enum Type {
+    TARGET = 1,         // Planner::Enqueue(): target, feedrate, curve_radius
+    HALT,               // Planner::BringPathToHalt() or RequestPathHalt()
+    PATH_BLENDING,      // Planner::SetPathBlending(): value
+    DIRECT_DRIVE,       // Planner::DirectDrive(): axis, value=distance, v0, v1
+    EXTERNAL_POSITION,  // Planner::SetExternalPosition(): axis, value=pos
+    SEGMENT,            // Output: segment sent to the MotorOperations,
+                        // before input shaping.
+  };
+
+  Type type;
+  AxesRegister target;                // TARGET
+  float feedrate;                     // TARGET
+  float curve_radius;                 // TARGET
+  uint16_t aux_bits;                  // Aux bits at the time of the call.
+  GCodeParserAxis axis;               // DIRECT_DRIVE, EXTERNAL_POSITION
+  float value;
+  float v0, v1;                       // DIRECT_DRIVE
+  LinearSegmentSteps segment;         // SEGMENT
+};
+
+// Writes records to a file. Can be called from different threads: inputs
+// are recorded from the caller of the Planner, segments from the planner
+// thread.
+class PlannerTraceWriter {
+public:
+  // Open file for writing. Returns NULL on failure.
+  static PlannerTraceWriter *Create(const char *filename);
+  ~PlannerTraceWriter();
+
+  void Write(const PlannerTraceRecord &record);
+
+private:
+  explicit PlannerTraceWriter(FILE *out);
+
+  std::mutex mutex_;
+  FILE *const out_;
+};
+
+// Reads back a trace written by PlannerTraceWriter.
+class PlannerTraceReader {
+public:
+  // Open file for reading. Returns NULL if it can't be opened or is not a
+  // trace recorded with the same number of axes and motors.
+  static PlannerTraceReader *Create(const char *filename);
+  ~PlannerTraceReader();
+
+  // Read the next record. Returns false at the end of the file or if the
+  // file is truncated or corrupt.
+  bool Next(PlannerTraceRecord *record);
+
+private:
+  explicit PlannerTraceReader(FILE *in);
+
+  FILE *const in_;
+};
+
+#endif
@@ -16,14 +16,29 @@
  * You should have received a copy of the GNU General Public License
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>  // We use these functions as they work type-agnostic
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 #include "common/logging.h"
 #include "common/container.h"
+#include "common/spsc-queue.h"
 
 #include "planner.h"
+#include "planner-trace.h"
+#include "delta-kinematics.h"
+#include "input-shaper.h"
 #include "hardware-mapping.h"
 #include "gcode-machine-control.h"
 #include "motor-operations.h"
@@ -33,70 +48,189 @@ namespace {
 // GCODE_NUM_AXES-dimensional space.
 //
 // An AxisTarget has a position vector, in absolute machine coordinates, and a
-// speed when arriving at that position.
+// desired speed to travel to that position.
 //
-// The speed is initially the aimed goal; if it cannot be reached, the
-// AxisTarget will be modified to contain the actually reachable value. That is
-// used in planning along the path.
+// While the target sits in the planning buffer, the reverse and forward
+// planning passes determine the speed with which we enter the move; the speed
+// with which we leave it is the entry speed of the next target. Neighboring
+// targets can have different defining axes, so the entry speeds are in
+// euclidian mm/s (see defining_to_euclid()) and only converted to steps of
+// the defining axis when the move is sent to the motors.
+template <typename real>
 struct AxisTarget {
   int position_steps[GCODE_NUM_AXES];  // Absolute position at end of segment. In steps.
 
   // Derived values
   int delta_steps[GCODE_NUM_AXES];     // Difference to previous position.
   enum GCodeParserAxis defining_axis;  // index into defining axis.
-  double speed;                         // (desired) speed in steps/s on defining axis.
+  real speed;                           // (desired) speed in steps/s on defining axis.
+  real accel;                           // acceleration in steps/s^2 on defining axis.
+  real jerk;                            // jerk in steps/s^3 on defining axis; 0: none
+  real max_entry_speed;                 // Highest speed to join previous move.
+  real entry_speed;                     // Planned speed at begin of move.
   unsigned short aux_bits;             // Auxillary bits in this segment; set with M42
-  double dx, dy, dz;                    // 3D delta_steps in real units
-  double len;                           // 3D length
+  float feedrate;                       // Requested feedrate in mm/s.
+  real dx, dy, dz;                      // 3D delta_steps in real units
+  real len;                             // 3D length
+};
+
+// Work item handed from the caller to the planner thread.
+struct PlannerRequest {
+  enum Type { MOVE, HALT } type;
+  AxesRegister target;                  // MOVE: target position in mm.
+  float feedrate;                       // MOVE: desired feedrate in mm/s.
+  float curve_radius;                   // MOVE: radius of curvature; 0: none
+  float blend_tolerance;                // MOVE: corner rounding (mm); 0: none
+  HardwareMapping::AuxBitmap aux_bits;  // Aux bits at the time of the request.
+};
+
+// Reason why two moves can only be joined at a full stop.
+enum JunctionStop {
+  NO_STOP,
+  STOP_NON_EUCLIDIAN,
+  STOP_REVERSAL,
+  STOP_CORNER,
 };
 }  // end anonymous namespace
 
-class Planner::Impl {
+// Number of requests that can be in flight to the planner thread. If the
+// planner thread is busy, the caller blocks once this is full.
+static constexpr int kPlannerRequestQueueSize = 256;
+
+// QueueFullFd() asks the caller to hold off beyond this many queued requests
+// and lets it continue once the planner thread is down to the low water mark.
+// The headroom above is for callers that can only stop between input lines
+// that each can result in many requests; only if a single line does not fit,
+// the caller blocks.
+static constexpr unsigned kRequestsHighWater = kPlannerRequestQueueSize / 2;
+static constexpr unsigned kRequestsLowWater = kPlannerRequestQueueSize / 4;
+
+// Batched targets are handed to the planner thread in chunks of this size.
+static constexpr int kMaxSubmitChunk = 32;
+
+// Segments of the planned path are sent to the motor operations in bulk,
+// at the latest after each target or if there are this many.
+static constexpr int kMaxPendingSegments = 32;
+
+// Maximum number of targets that are merged into one straight move.
+static constexpr int kMaxMergedTargets = 32;
+
+// Rounded corners are approximated with chords that each turn at most this
+// much (radians).
+static constexpr double kMaxBlendChordTurn = M_PI / 18;
+
+template <typename real>
+class PlannerBase<real>::Impl {
 public:
   Impl(const MachineControlConfig *config,
        HardwareMapping *hardware_mapping,
        MotorOperations *motor_backend);
   ~Impl();
 
-  bool move_machine_steps(const struct AxisTarget *last_pos,
-                          struct AxisTarget *target_pos,
-                          const struct AxisTarget *upcoming);
+  bool move_machine_steps(const AxisTarget<real> *target_pos,
+                          real v0, real *v1);
 
   void assign_steps_to_motors(struct LinearSegmentSteps *command,
                               enum GCodeParserAxis axis,
                               int steps);
 
-  bool issue_motor_move_if_possible();
-  bool machine_move(const AxesRegister &axis, float feedrate);
-  void bring_path_to_halt();
+  bool enqueue_speed_change(const struct LinearSegmentSteps &segment,
+                            int defining_steps, real jerk);
+  // Send segment to the motor operations. Segments of the "planned" path
+  // get pressure advance and go through the input shaper, if configured.
+  bool send_segment(const struct LinearSegmentSteps &segment,
+                    bool planned = true);
+  // Send segment without pressure advance; used by send_segment().
+  bool queue_segment(const struct LinearSegmentSteps &segment, bool planned);
+  // Planned segments are collected and sent in bulk; send what is pending.
+  bool flush_segments();
+  void advance_extruder(struct LinearSegmentSteps *segment);
+  bool take_back_extruder_advance(HardwareMapping::AuxBitmap aux_bits);
+
+  void plan_buffered_targets();
+  bool issue_next_motor_move();
+  void discard_pending_targets();
+  bool machine_move(const AxesRegister &axis, float feedrate,
+                    HardwareMapping::AuxBitmap aux_bits);
+  bool plan_target(const AxesRegister &axis, float feedrate,
+                   HardwareMapping::AuxBitmap aux_bits);
+  void update_delta_position();
+  bool can_merge_with_previous(const AxesRegister &axis, float feedrate,
+                               HardwareMapping::AuxBitmap aux_bits);
+  void target_position_mm(const AxisTarget<real> *target, AxesRegister *pos);
+  void bring_path_to_halt(HardwareMapping::AuxBitmap aux_bits);
+
+  // Path blending: move along the path of requests, rounding corners within
+  // the requested tolerance.
+  bool path_move(PlannerRequest request);
+  bool move_around_corner(const PlannerRequest &corner,
+                          const PlannerRequest &next);
+  bool flush_blend_corner();
+  void last_target_mm(const AxesRegister &fallback, AxesRegister *pos);
+
+  // Entry points of the public interface. If the planner runs in its own
+  // thread, these hand over to it or synchronize with it.
+  bool EnqueueBatch(const PlannerTarget *targets, int count);
+  void BringPathToHalt();
+  void RequestPathHalt();
+  int QueueFullFd();
+  void trace_halt();
+  void SetPathBlending(float tolerance_mm);
 
   float acceleration_for_move(const int *axis_steps,
-                              enum GCodeParserAxis defining_axis) {
-    return max_axis_accel_[defining_axis];
-    // TODO: we need to scale the acceleration if one of the other axes could't
-    // deal with it. Look at axis steps for that.
-  }
+                              enum GCodeParserAxis defining_axis);
+  float curve_feedrate_limit(const AxesRegister &from, const AxesRegister &to,
+                             double radius);
+
+  float jerk_for_move(const int *axis_steps,
+                      enum GCodeParserAxis defining_axis);
 
   // Avoid division by zero if there is no config defined for axis.
-  double axis_delta_to_mm(const AxisTarget *pos, enum GCodeParserAxis axis) {
-    if (cfg_->steps_per_mm[axis] != 0.0)
-      return (double)pos->delta_steps[axis] / cfg_->steps_per_mm[axis];
+  real axis_delta_to_mm(const AxisTarget<real> *pos, GCodeParserAxis axis) {
+    if (cfg_->steps_per_mm[axis] != 0)
+      return (real)pos->delta_steps[axis] / cfg_->steps_per_mm[axis];
     return 0.0;
   }
 
-  double euclidian_speed(const struct AxisTarget *t);
+  real euclidian_speed(const AxisTarget<real> *t);
+
+  // With kinematics other than cartesian, motors move differently than the
+  // axes; limit speed and acceleration so that the motors stay within the
+  // limits of the axis they are mapped to.
+  void limit_to_motors(AxisTarget<real> *t);
+
+  // Factor from speeds on the defining axis to speeds of the motor with the
+  // most steps, which is what the motor operations expect.
+  real motor_speed_ratio(const int *axis_steps, int defining_steps);
 
   void GetCurrentPosition(AxesRegister *pos);
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
+  bool DirectDriveToEndstop(GCodeParserAxis axis, float distance,
+                            float v0, float v1, const EndstopSwitch &endstop,
+                            int *steps, bool *triggered);
   void SetExternalPosition(GCodeParserAxis axis, float pos);
+  void GetStats(PlannerStats *stats);
+
+  // Segment that moves "steps" along a single axis, within the speed limits.
+  LinearSegmentSteps direct_drive_segment(GCodeParserAxis axis, int steps,
+                                          float v0, float v1);
+
+  // -- planner thread
+  void planner_thread_loop();
+  void submit_request(const PlannerRequest &request) {
+    submit_requests(&request, 1);
+  }
+  void submit_requests(const PlannerRequest *requests, int count);
+  void wake_planner_thread();
+  void wait_planner_thread_idle();
 
   // Given the desired target speed of the defining axis and the steps to be
   // performed on all axes, determine if we need to scale down as to not exceed
   // the individual maximum speed constraints on any axis. Return the new speed
   // of the defining axis.
-  double clamp_to_limits(enum GCodeParserAxis defining_axis,
-                         const double target_value,
-                         const int *axis_steps);
+  real clamp_to_limits(enum GCodeParserAxis defining_axis,
+                       const real target_value,
+                       const int *axis_steps);
 
 private:
   const struct MachineControlConfig *const cfg_;
@@ -104,62 +238,149 @@ private:
   MotorOperations *const motor_ops_;
 
   // Next buffered positions. Written by incoming gcode, read by outgoing
-  // motor movements.
-  RingDeque<AxisTarget, 4> planning_buffer_;
+  // motor movements. The first element is always the last position we
+  // sent to the motors, all following are pending to be planned.
+  RingDeque<AxisTarget<real>, PLANNER_MAX_LOOKAHEAD + 2> planning_buffer_;
+
+  // Index in planning_buffer_ up to which the entry speeds are final: they
+  // can not be improved by any future target, so the reverse pass can stop
+  // there.
+  unsigned planned_;
 
   // Pre-calculated per axis limits in steps, steps/s, steps/s^2
   // All arrays are indexed by axis.
   AxesRegister max_axis_speed_;   // max travel speed hz
   AxesRegister max_axis_accel_;   // acceleration hz/s
+  AxesRegister max_axis_jerk_;    // jerk hz/s^2; 0 for no limit.
   float highest_accel_;           // hightest accel of all axes.
 
+  // Limits of each motor, from the axis it is mapped to. Only needed if
+  // motors don't move the axes one by one.
+  const bool motors_are_axes_;
+  float max_motor_speed_[BEAGLEG_NUM_MOTORS];
+  float max_motor_accel_[BEAGLEG_NUM_MOTORS];
+  float max_motor_jerk_[BEAGLEG_NUM_MOTORS];
+
+  // With delta kinematics, the position_steps of X, Y and Z are the
+  // carriages of the towers; the effector position is kept here.
+  DeltaKinematics *delta_;
+  float delta_position_[3];
+
   HardwareMapping::AuxBitmap last_aux_bits_;  // last enqueued aux bits.
 
+  // Pressure advance of the extruder; see advance_extruder().
+  const float pressure_advance_;
+  int extruder_motor_;        // First motor mapped to AXIS_E, or -1.
+  int extruder_advance_;      // Steps the extruder is currently ahead.
+
   bool path_halted_;
   bool position_known_;
+
+  // Positions of the targets that have been merged into the last target in
+  // the planning buffer. They all need to stay within the merge tolerance
+  // if we want to extend that target further.
+  AxesRegister merged_points_[kMaxMergedTargets];
+  int merged_count_;
+
+  // With path blending, we can only move to a target once we know where the
+  // path continues after it. Until then, it is held back here.
+  float path_blending_;   // Tolerance for new requests. Caller thread only.
+  bool have_blend_corner_;
+  PlannerRequest blend_corner_;
+
+  // If configured, planning and sending to the motors happens in a separate
+  // thread. The caller then only hands over requests through a lock-free
+  // queue; the mutex and condition variables are only used to sleep when
+  // there is nothing to do or the queue is full.
+  std::thread *planner_thread_;
+  SPSCQueue<PlannerRequest, kPlannerRequestQueueSize> requests_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;   // planner thread waits on this
+  std::condition_variable work_consumed_;    // caller waits on this.
+  std::atomic<bool> planner_idle_;     // Planner thread waits for work.
+  std::atomic<bool> caller_waiting_;   // Caller waits for space or idle.
+  std::atomic<bool> shutdown_;
+  std::atomic<bool> aborted_;          // Motor queue refused a segment.
+  int room_fd_;                        // Signaled by the planner thread...
+  std::atomic<bool> room_wanted_;      // ...if the caller waits for room.
+
+  // Updated by whoever does the planning, read by GetStats().
+  std::mutex stats_mutex_;
+  PlannerStats stats_;
+
+  PlannerTraceWriter *trace_;   // If non-NULL, record inputs and outputs.
+  InputShaper *shaper_;         // If non-NULL, shapes outgoing segments.
+
+  // Planned segments not yet sent out.
+  LinearSegmentSteps pending_segments_[kMaxPendingSegments];
+  int pending_count_;
 };
 
-// Speed relative to defining axis
-static double get_speed_factor_for_axis(const struct AxisTarget *t,
-                                        enum GCodeParserAxis request_axis) {
-  if (t->delta_steps[t->defining_axis] == 0) return 0.0;
-  return 1.0 * t->delta_steps[request_axis] / t->delta_steps[t->defining_axis];
+// Given that we want to travel "s" steps, start with speed "v0",
+// accelerate peak speed v1 and slow down to "v2" with acceleration "a",
+// what is v1 ?
+template <typename real>
+static real get_peak_speed(int s, real v0, real v2, real a) {
+  return std::sqrt(v2*v2 + v0*v0 + 2 * a * s) / std::sqrt(real(2));
 }
 
-// Get the speed for a particular axis. Depending on the direction, this can
-// be positive or negative.
-static double get_speed_for_axis(const struct AxisTarget *target,
-                                 enum GCodeParserAxis request_axis) {
-  return target->speed * get_speed_factor_for_axis(target, request_axis);
+// Time it takes to change speed by "dv" with acceleration "a" and jerk "j".
+// With a jerk limit (j > 0), the acceleration is ramped in and out; if "dv"
+// is small, we never reach the full acceleration.
+template <typename real>
+static real speed_change_time(real dv, real a, real j) {
+  if (j <= 0) return dv / a;
+  if (dv >= a * a / j) return dv / a + a / j;
+  return 2 * std::sqrt(dv / j);
 }
 
-// Given that we want to travel "s" steps, start with speed "v0",
-// accelerate peak speed v1 and slow down to "v2" with acceleration "a",
-// what is v1 ?
-static double get_peak_speed(int s, double v0, double v2, double a) {
-  return std::sqrt(v2*v2 + v0*v0 + 2 * a * s) / std::sqrt(2.0);
+// Distance needed to change speed between "v_from" and "v_to", in either
+// direction. The S-curve of a jerk limited change is symmetric, so the
+// average speed is the same as with constant acceleration, it just takes
+// longer.
+template <typename real>
+static real speed_change_distance(real v_from, real v_to, real a, real j) {
+  if (j <= 0) return std::fabs(v_to*v_to - v_from*v_from) / (2 * a);
+  return (v_from + v_to) / 2 * speed_change_time(std::fabs(v_to - v_from), a, j);
 }
 
-static double euclid_distance(double x, double y, double z) {
-  return std::sqrt(x*x + y*y + z*z);
+// Highest speed we can reach from "v" within distance "s" - or, the other way
+// round, the highest speed from which we can still come down to "v".
+template <typename real>
+static real reachable_speed(real v, real s, real a, real j) {
+  const real unlimited = std::sqrt(v*v + 2 * a * s);
+  if (j <= 0) return unlimited;
+  // There is no closed form with the jerk limit; the speed is between "v"
+  // and what we reach with constant acceleration.
+  real lo = v, hi = unlimited;
+  for (int i = 0; i < 32; ++i) {
+    const real mid = (lo + hi) / 2;
+    if (speed_change_distance(v, mid, a, j) <= s) lo = mid; else hi = mid;
+  }
+  return lo;
 }
 
-// Number of steps to accelerate or decelerate (negative "a") from speed
-// v0 to speed v1. Modifies v1 if we can't reach the speed with the allocated
-// number of steps.
-static double steps_for_speed_change(double a, double v0, double *v1,
-                                     int max_steps) {
-  // s = v0 * t + a/2 * t^2
-  // v1 = v0 + a*t
-  const double t = (*v1 - v0) / a;
-  // TODO:
-  if (t < 0) Log_error("Error condition: t=%.1f INSUFFICIENT LOOKAHEAD\n", t);
-  double steps = a/2 * t*t + v0 * t;
-  if (steps <= max_steps) return steps;
-  // Ok, we would need more steps than we have available. We correct the speed to what
-  // we actually can reach.
-  *v1 = std::sqrt(v0*v0 + 2 * a * max_steps);
-  return max_steps;
+// Like get_peak_speed(), but with speed changes limited by jerk "j" and the
+// peak speed limited to "v_max".
+template <typename real>
+static real get_jerk_limited_peak_speed(int s, real v0, real v2, real a, real j,
+                                        real v_max) {
+  real lo = std::max(v0, v2);
+  real hi = std::min(v_max, get_peak_speed(s, v0, v2, a));
+  if (hi <= lo || speed_change_distance(v0, hi, a, j)
+      + speed_change_distance(hi, v2, a, j) <= s)
+    return hi;
+  for (int i = 0; i < 32; ++i) {
+    const real mid = (lo + hi) / 2;
+    if (speed_change_distance(v0, mid, a, j)
+        + speed_change_distance(mid, v2, a, j) <= s) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
+template <typename real>
+static real euclid_distance(real x, real y, real z) {
+  return std::sqrt(x*x + y*y + z*z);
 }
 
 // Returns true, if all results in zero movement
@@ -173,90 +394,95 @@ static bool subtract_steps(struct LinearSegmentSteps *value,
   return has_nonzero;
 }
 
-static bool within_acceptable_range(double new_val, double old_val,
-                                    double fraction) {
-  const double max_diff = fraction * old_val;
-  if (new_val < old_val - max_diff) return false;
-  if (new_val > old_val + max_diff) return false;
-  return true;
+// Convert a speed or acceleration on the defining axis of "t" in steps into
+// euclidian space mm. And back.
+// Moves without euclidian length (e.g. only the extruder) always join their
+// neighbors at a full stop; they stay in steps of their defining axis.
+template <typename real>
+static real defining_to_euclid(const AxisTarget<real> *t, real value) {
+  if (t->len <= 0) return value;
+  return value * t->len / abs(t->delta_steps[t->defining_axis]);
+}
+template <typename real>
+static real euclid_to_defining(const AxisTarget<real> *t, real value) {
+  if (t->len <= 0) return value;
+  return value * abs(t->delta_steps[t->defining_axis]) / t->len;
 }
 
-// Determine the fraction of the speed that "from" should decelerate
-// to at the end of its travel.
-// The way trapezoidal moves work, be still have to decelerate to zero in
-// most times, which is inconvenient. TODO(hzeller): speed matching is not
-// cutting it :)
-static double determine_joining_speed(const struct AxisTarget *from,
-                                      const struct AxisTarget *to,
-                                      const double threshold,
-                                      const double speed_tune_angle) {
-  // the dot product of the vectors
-  const double dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
-  const double mag = from->len * to->len;
-  if (dot == 0) return 0.0;         // orthogonal 90 degree, full stop
-  if (dot < 0) return 0.0;          // turning around, full stop
-  const double dotmag = dot / mag;
-  if (within_acceptable_range(1.0, dotmag, 1e-5))
-    return to->speed;               // codirectional 0 degree, keep accelerating
-
-  // the angle between the vectors
-  const double rad2deg = 180.0 / M_PI;
-  const double angle = std::fabs(std::acos(dotmag) * rad2deg);
-
-  if (angle >= 45.0)
-    return 0.0;                     // angle to large, come to full stop
-  if (angle <= threshold) {         // in tolerance, keep accelerating
-    if (dot < 1) {                  // speed tune segments less than 1mm (i.e. arcs)
-      const double deg2rad = M_PI / 180.0;
-      const double angle_speed_adj = std::cos((angle + speed_tune_angle) * deg2rad);
-      return to->speed * angle_speed_adj;
-    }
-    return to->speed;
+// Determine the highest speed with which we can go from "from" to "to".
+// Returned is the speed in euclidian space in mm/s.
+//
+// We use the junction deviation model: pretend the corner would be rounded
+// by a circle that just deviates "deviation" mm from the corner point and
+// determine the speed we can go around that circle without exceeding the
+// centripetal acceleration. This gives a continuous speed for every angle:
+// full speed going straight, zero when turning around.
+// If the speed is zero, "stop" tells why.
+template <typename real>
+static real determine_joining_speed(const AxisTarget<real> *from,
+                                    const AxisTarget<real> *to,
+                                    const float deviation,
+                                    JunctionStop *stop) {
+  *stop = NO_STOP;
+  // Only for moves in euclidian space we know what to do.
+  if (from->len <= 0 || to->len <= 0) {
+    *stop = STOP_NON_EUCLIDIAN;
+    return 0.0;
   }
 
-  // The angle between the from and to segments is < 45 degrees but greater
-  // than the threshold. Use the "old" logic to determine the joining speed
-  //
-  // Our goal is to figure out what our from defining speed should
-  // be at the end of the move.
-  bool is_first = true;
-  double from_defining_speed = from->speed;
-  const int from_defining_steps = from->delta_steps[from->defining_axis];
-  for (const GCodeParserAxis axis : AllAxes()) {
-    const int from_delta = from->delta_steps[axis];
-    const int to_delta = to->delta_steps[axis];
-
-    // Quick integer decisions
-    if (from_delta == 0 && to_delta == 0) continue;   // uninteresting: no move.
-    if (from_delta == 0 || to_delta == 0) return 0.0; // accel from/to zero
-    if ((from_delta < 0 && to_delta > 0) || (from_delta > 0 && to_delta < 0))
-      return 0.0;  // turing around
-
-    double to_speed = get_speed_for_axis(to, axis);
-    // What would this speed translated to our defining axis be ?
-    double speed_conversion = 1.0 * from_defining_steps / from_delta;
-    double goal = to_speed * speed_conversion;
-    if (goal < 0.0) return 0.0;
-    if (is_first || within_acceptable_range(goal, from_defining_speed, 1e-5)) {
-      if (goal < from_defining_speed) from_defining_speed = goal;
-      is_first = false;
-    } else {
-      return 0.0;  // Too far off.
-    }
+  // The cosine of the angle between the incoming and the reverse outgoing
+  // direction; the corner gets sharper as it approaches 1.
+  const real cos_theta = -(from->dx*to->dx + from->dy*to->dy
+                           + from->dz*to->dz) / (from->len * to->len);
+  if (cos_theta > real(0.999999)) {     // turning around, full stop.
+    *stop = STOP_REVERSAL;
+    return 0;
   }
-
-  return from_defining_speed;
+  if (cos_theta < real(-0.999999))   // straight, keep going.
+    return defining_to_euclid(to, to->speed);
+
+  // Acceleration both moves are able to do in euclidian space.
+  const real accel = std::min(defining_to_euclid(from, from->accel),
+                              defining_to_euclid(to, to->accel));
+  const real sin_half_theta = std::sqrt((1 - cos_theta) / 2);
+  const real radius = deviation * sin_half_theta / (1 - sin_half_theta);
+  if (radius <= 0) *stop = STOP_CORNER;
+  return std::sqrt(accel * radius);
 }
 
-Planner::Impl::Impl(const MachineControlConfig *config,
-                    HardwareMapping *hardware_mapping,
-                    MotorOperations *motor_backend)
+PlannerStats::PlannerStats()
+  : targets(0), merged_targets(0),
+    accel_segments(0), travel_segments(0), decel_segments(0),
+    stops_path_start(0), stops_reversal(0), stops_non_euclidian(0),
+    stops_corner(0), lookahead_limited(0),
+    requested_seconds(0), planned_seconds(0) {}
+
+template <typename real>
+PlannerBase<real>::Impl::Impl(const MachineControlConfig *config,
+                              HardwareMapping *hardware_mapping,
+                              MotorOperations *motor_backend)
   : cfg_(config), hardware_mapping_(hardware_mapping),
-    motor_ops_(motor_backend),
-    highest_accel_(-1), path_halted_(true), position_known_(true) {
+    motor_ops_(motor_backend), planned_(0),
+    highest_accel_(-1),
+    motors_are_axes_(!hardware_mapping->IsCoreXY()), delta_(NULL),
+    pressure_advance_(config->pressure_advance),
+    extruder_motor_(-1), extruder_advance_(0),
+    path_halted_(true), position_known_(true),
+    merged_count_(0), path_blending_(0), have_blend_corner_(false),
+    planner_thread_(NULL), planner_idle_(false), caller_waiting_(false),
+    shutdown_(false), aborted_(false), room_fd_(-1), room_wanted_(false),
+    trace_(NULL), shaper_(NULL),
+    pending_count_(0) {
+  if (hardware_mapping_->GetKinematics()
+      == HardwareMapping::Kinematics::DELTA) {
+    delta_ = new DeltaKinematics(cfg_->delta_radius, cfg_->delta_rod_length,
+                                 cfg_->delta_segment_tolerance);
+  }
+  delta_position_[0] = delta_position_[1] = delta_position_[2] = 0;
+
   // Initial machine position. We assume the homed position here, which is
   // wherever the endswitch is for each axis.
-  struct AxisTarget *init_axis = planning_buffer_.append();
+  AxisTarget<real> *init_axis = planning_buffer_.append();
   bzero(init_axis, sizeof(*init_axis));
   for (const GCodeParserAxis axis : AllAxes()) {
     HardwareMapping::AxisTrigger trigger = cfg_->homing_trigger[axis];
@@ -271,21 +497,80 @@ Planner::Impl::Impl(const MachineControlConfig *config,
     max_axis_speed_[i] = cfg_->max_feedrate[i] * cfg_->steps_per_mm[i];
     const float accel = cfg_->acceleration[i] * cfg_->steps_per_mm[i];
     max_axis_accel_[i] = accel;
+    max_axis_jerk_[i] = cfg_->max_jerk[i] * cfg_->steps_per_mm[i];
     if (accel > highest_accel_)
       highest_accel_ = accel;
     if (accel < lowest_accel)
       lowest_accel = accel;
   }
+
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    max_motor_speed_[motor] = max_motor_accel_[motor] = 0;
+    max_motor_jerk_[motor] = 0;
+    for (const GCodeParserAxis i : AllAxes()) {
+      if (hardware_mapping_->GetMotorMap(i) & (1 << motor)) {
+        max_motor_speed_[motor] = max_axis_speed_[i];
+        max_motor_accel_[motor] = max_axis_accel_[i];
+        max_motor_jerk_[motor] = max_axis_jerk_[i];
+      }
+    }
+  }
+
+  for (int motor = BEAGLEG_NUM_MOTORS - 1; motor >= 0; --motor) {
+    if (hardware_mapping_->GetMotorMap(AXIS_E) & (1 << motor))
+      extruder_motor_ = motor;
+  }
+
+  // Motors are shaped like the axis they are moving.
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (cfg_->shaper_type[axis] == InputShaper::NONE)
+      continue;
+    if (shaper_ == NULL) shaper_ = new InputShaper(motor_ops_);
+    for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+      if (hardware_mapping_->GetMotorMap(axis) & (1 << motor)) {
+        shaper_->SetMotorShaper(motor, cfg_->shaper_type[axis],
+                                cfg_->shaper_frequency[axis],
+                                cfg_->shaper_damping[axis]);
+      }
+    }
+  }
+
+  // Only after setting the initial position; it is not an input we
+  // need to replay.
+  if (!cfg_->planner_trace_file.empty()) {
+    trace_ = PlannerTraceWriter::Create(cfg_->planner_trace_file.c_str());
+  }
+
+  if (cfg_->threaded_planner) {
+    room_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    planner_thread_ = new std::thread(&Impl::planner_thread_loop, this);
+  }
 }
 
-Planner::Impl::~Impl() {
-  bring_path_to_halt();
+template <typename real>
+PlannerBase<real>::Impl::~Impl() {
+  if (planner_thread_) {
+    wait_planner_thread_idle();
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      shutdown_ = true;
+    }
+    work_available_.notify_one();
+    planner_thread_->join();
+    delete planner_thread_;
+  }
+  if (room_fd_ >= 0) close(room_fd_);
+  bring_path_to_halt(hardware_mapping_->GetAuxBits());
+  delete trace_;
+  delete delta_;
+  delete shaper_;
 }
 
 // Assign steps to all the motors responsible for given axis.
-void Planner::Impl::assign_steps_to_motors(struct LinearSegmentSteps *command,
-                                           enum GCodeParserAxis axis,
-                                           int steps) {
+template <typename real>
+void PlannerBase<real>::Impl::assign_steps_to_motors(struct LinearSegmentSteps *command,
+                                                     enum GCodeParserAxis axis,
+                                                     int steps) {
   hardware_mapping_->AssignMotorSteps(axis, steps, command);
 }
 
@@ -293,14 +578,15 @@ void Planner::Impl::assign_steps_to_motors(struct LinearSegmentSteps *command,
 // speed, what's the speed of the defining_axis so that every speed respects i's
 // bounds? The defining axis should be rescaled with this maximum offset.
 // offset = speed_limit[i] / speed[i]
-double Planner::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
-                                      const double target_speed,
-                                      const int *axis_steps) {
-  double ratio, max_offset = 1, offset;
+template <typename real>
+real PlannerBase<real>::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
+                                              const real target_speed,
+                                              const int *axis_steps) {
+  real ratio, max_offset = 1, offset;
   const FloatAxisConfig &max_axis_speed = cfg_->max_feedrate;
   const FloatAxisConfig &steps_per_mm = cfg_->steps_per_mm;
   for (const GCodeParserAxis i : AllAxes()) {
-    ratio = std::fabs((1.0 * axis_steps[i] * steps_per_mm[defining_axis])
+    ratio = std::fabs((real(axis_steps[i]) * steps_per_mm[defining_axis])
                       / (axis_steps[defining_axis] * steps_per_mm[i]));
     offset = ratio > 0 ? max_axis_speed[i] / (target_speed * ratio) : 1;
     if (offset < max_offset) max_offset = offset;
@@ -308,10 +594,101 @@ double Planner::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
   return target_speed * max_offset;
 }
 
-double Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
-  double speed_factor = 1.0;
+// Determine the acceleration of the defining axis, so that none of the
+// participating axes exceeds its own acceleration limit. Each axis accelerates
+// proportionally to its fraction of the defining axis steps, so an axis that
+// only does a few steps has little to contribute; axes that don't move
+// don't limit at all.
+template <typename real>
+float PlannerBase<real>::Impl::acceleration_for_move(const int *axis_steps,
+                                                     enum GCodeParserAxis defining_axis) {
+  const int defining_steps = abs(axis_steps[defining_axis]);
+  float accel = max_axis_accel_[defining_axis];
+  for (const GCodeParserAxis i : AllAxes()) {
+    const int steps = abs(axis_steps[i]);
+    if (steps == 0 || max_axis_accel_[i] <= 0) continue;
+    const float axis_limit = max_axis_accel_[i] * defining_steps / steps;
+    if (axis_limit < accel) accel = axis_limit;
+  }
+  return accel;
+}
+
+// Same for the jerk. Axes without jerk limit don't limit; if none of the
+// participating axes has one, the move is not jerk limited (0).
+template <typename real>
+float PlannerBase<real>::Impl::jerk_for_move(const int *axis_steps,
+                                             enum GCodeParserAxis defining_axis) {
+  const int defining_steps = abs(axis_steps[defining_axis]);
+  float jerk = 0;
+  for (const GCodeParserAxis i : AllAxes()) {
+    const int steps = abs(axis_steps[i]);
+    if (steps == 0 || max_axis_jerk_[i] <= 0) continue;
+    const float axis_limit = max_axis_jerk_[i] * defining_steps / steps;
+    if (jerk <= 0 || axis_limit < jerk) jerk = axis_limit;
+  }
+  return jerk;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::limit_to_motors(AxisTarget<real> *t) {
+  struct LinearSegmentSteps motor_steps = {};
+  for (const GCodeParserAxis a : AllAxes()) {
+    assign_steps_to_motors(&motor_steps, a, t->delta_steps[a]);
+  }
+  const real defining_steps = abs(t->delta_steps[t->defining_axis]);
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    const real ratio = abs(motor_steps.steps[motor]) / defining_steps;
+    if (ratio <= 0) continue;
+    if (max_motor_speed_[motor] > 0 && t->speed * ratio > max_motor_speed_[motor])
+      t->speed = max_motor_speed_[motor] / ratio;
+    if (max_motor_accel_[motor] > 0 && t->accel * ratio > max_motor_accel_[motor])
+      t->accel = max_motor_accel_[motor] / ratio;
+    if (max_motor_jerk_[motor] > 0
+        && (t->jerk <= 0 || t->jerk * ratio > max_motor_jerk_[motor]))
+      t->jerk = max_motor_jerk_[motor] / ratio;
+  }
+}
+
+template <typename real>
+real PlannerBase<real>::Impl::motor_speed_ratio(const int *axis_steps,
+                                                int defining_steps) {
+  if (motors_are_axes_ || defining_steps == 0) return 1;
+  struct LinearSegmentSteps motor_steps = {};
+  for (const GCodeParserAxis a : AllAxes()) {
+    assign_steps_to_motors(&motor_steps, a, axis_steps[a]);
+  }
+  int max_motor_steps = 0;
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    max_motor_steps = std::max(max_motor_steps, abs(motor_steps.steps[motor]));
+  }
+  return max_motor_steps > 0 ? real(max_motor_steps) / defining_steps : 1;
+}
+
+// Highest feedrate (mm/s) on a curve with the given radius (mm) while moving
+// from "from" to "to", so that the centripetal acceleration v^2/r stays within
+// the acceleration of the XYZ axes that take part. A slow axis that does not
+// move, such as Z on an XY arc, does not limit.
+template <typename real>
+float PlannerBase<real>::Impl::curve_feedrate_limit(const AxesRegister &from,
+                                                    const AxesRegister &to,
+                                                    double radius) {
+  float limit = std::numeric_limits<float>::max();
+  for (int i = 0; i < 3; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+    if (cfg_->steps_per_mm[a] == 0 || cfg_->acceleration[a] <= 0) continue;
+    if (std::lround(from[a] * cfg_->steps_per_mm[a])
+        == std::lround(to[a] * cfg_->steps_per_mm[a]))
+      continue;   // No steps on this axis.
+    limit = std::min(limit, (float)std::sqrt(cfg_->acceleration[a] * radius));
+  }
+  return limit;
+}
+
+template <typename real>
+real PlannerBase<real>::Impl::euclidian_speed(const AxisTarget<real> *t) {
+  real speed_factor = 1.0;
   if (t->len > 0) {
-    const double axis_len_mm = axis_delta_to_mm(t, t->defining_axis);
+    const real axis_len_mm = axis_delta_to_mm(t, t->defining_axis);
     speed_factor = std::fabs(axis_len_mm) / t->len;
   }
   return t->speed * speed_factor;
@@ -319,30 +696,20 @@ double Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
 
 // Move the given number of machine steps for each axis.
 //
-// This will be up to three segments: accelerating from last_pos speed to
-// target speed, regular travel, and decelerating to the speed that the
-// next segment is never forced to decelerate, but stays at speed or accelerate.
+// This will be up to three segments: accelerating from the entry speed "v0"
+// to the target speed, regular travel, and decelerating to the exit speed
+// "v1" that the planning determined for the junction to the next move.
 //
 // The segments are sent to the motor operations backend.
 //
-// Since we calculate the deceleration, this modifies the speed of target_pos
-// to reflect what the last speed was at the end of the move.
+// Speed changes that amount to less than half a step are not worth a separate
+// segment; in that case, the move exits with a slightly different speed than
+// planned and the actually reached speed is returned in "v1".
 //
 // Returns true if move was executed, false if aborted
-bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
-                                       struct AxisTarget *target_pos,
-                                       const struct AxisTarget *upcoming) {
-  bool ret = true;
-  if (target_pos->delta_steps[target_pos->defining_axis] == 0) {
-    if (last_aux_bits_ != target_pos->aux_bits) {
-      // Special treatment: bits changed since last time, let's push them through.
-      struct LinearSegmentSteps bit_set_command = {};
-      bit_set_command.aux_bits = target_pos->aux_bits;
-      ret = motor_ops_->Enqueue(bit_set_command);
-      last_aux_bits_ = target_pos->aux_bits;
-    }
-    return ret;
-  }
+template <typename real>
+bool PlannerBase<real>::Impl::move_machine_steps(const AxisTarget<real> *target_pos,
+                                                 real v0, real *v1) {
   struct LinearSegmentSteps accel_command = {};
   struct LinearSegmentSteps move_command = {};
   struct LinearSegmentSteps decel_command = {};
@@ -357,115 +724,73 @@ bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
   memcpy(&accel_command, &move_command, sizeof(accel_command));
   memcpy(&decel_command, &move_command, sizeof(decel_command));
 
-  // Always start from the last steps/sec speed to avoid motion glitches.
-  // The planner will use that speed to determine what the peak speed for
-  // this move is and if we need to accel to reach the desired target speed.
-  const double last_speed = last_pos->speed;
-
-  // We need to arrive at a speed that the upcoming move does not have
-  // to decelerate further (after all, it has a fixed feed-rate it should not
-  // go over).
-  double next_speed = determine_joining_speed(target_pos, upcoming,
-                                             cfg_->threshold_angle,
-                                             cfg_->speed_tune_angle);
-  // Clamp the next speed to insure that this segment does not go over.
-  if (next_speed > target_pos->speed)
-    next_speed = target_pos->speed;
-
   const int *axis_steps = target_pos->delta_steps;  // shortcut.
   const int abs_defining_axis_steps = abs(axis_steps[defining_axis]);
-  const double a = acceleration_for_move(axis_steps, defining_axis);
-  const double peak_speed = get_peak_speed(abs_defining_axis_steps,
-                                          last_speed, next_speed, a);
-  assert(peak_speed > 0);
-
-  // TODO: if we only have < 5 steps or so, we should not even consider
-  // accelerating or decelerating, but just do one speed.
-
-  if (peak_speed < target_pos->speed) {
-    target_pos->speed = peak_speed;  // Don't manage to accelerate to desired v
-  }
-
-  // Make sure the target feedrate for the move is clamped to what all the
-  // moving axes can reach.
-  double target_feedrate = target_pos->speed / cfg_->steps_per_mm[defining_axis];
-  target_feedrate = clamp_to_limits(defining_axis, target_feedrate, axis_steps);
-  target_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
-
-  const double accel_fraction =
-    (last_speed < target_pos->speed)
-    ? steps_for_speed_change(a, last_speed, &target_pos->speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-  // We only decelerate if the upcoming speed is _slower_
-  double dummy_next_speed = next_speed;  // Don't care to modify; we don't have
-  const double decel_fraction =
-    (next_speed < target_pos->speed)
-    ? steps_for_speed_change(-a, target_pos->speed, &dummy_next_speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-#if 0
-  // Useful debugging info.
-  // TODO: we get a decel glitch when the last_pos has accelerated to a speed
-  // that is faster than the target can decelerate from.
-  if (dummy_next_speed != next_speed) {
-    fprintf(stderr, "  \033[1m\033[31mGLITCH\033[0m "
-                    "- move too short for full decel (reached v1: %10.2f)\n",
-            dummy_next_speed);
+  const real a = target_pos->accel;
+  const real j = target_pos->jerk;
+
+  // The planning passes made sure that we can reach v1 from v0 within this
+  // move; whatever is left is available to accelerate to the desired speed.
+  real peak_speed = j > 0
+    ? get_jerk_limited_peak_speed(abs_defining_axis_steps, v0, *v1, a, j,
+                                  target_pos->speed)
+    : get_peak_speed(abs_defining_axis_steps, v0, *v1, a);
+  if (peak_speed > target_pos->speed) peak_speed = target_pos->speed;
+  if (peak_speed < v0) peak_speed = v0;    // Rounding errors or infeasible.
+  if (peak_speed < *v1) peak_speed = *v1;
+
+  real accel_steps = speed_change_distance(v0, peak_speed, a, j);
+  real decel_steps = speed_change_distance(peak_speed, *v1, a, j);
+  if (accel_steps + decel_steps > abs_defining_axis_steps + 1) {
+    // Only if we got an entry speed that we can't slow down from in time.
+    accel_steps = 0;
+    decel_steps = abs_defining_axis_steps;
+  } else if (accel_steps + decel_steps > abs_defining_axis_steps) {
+    // Rounding errors when we never reach the travel speed; more likely in
+    // single precision.
+    decel_steps = abs_defining_axis_steps - accel_steps;
   }
-#endif
-
-  assert(accel_fraction + decel_fraction <= 1.0 + 1e-3);
-
-#if 0
-  // fudging: if we have tiny acceleration segments, don't do these at all
-  // but only do speed; otherwise we have a lot of rattling due to many little
-  // segments of acceleration/deceleration (e.g. for G2/G3).
-  // This is not optimal. Ideally, we would actually calculate in terms of
-  // jerk and optimize to stay within that constraint.
-  const int accel_decel_steps
-    = (accel_fraction + decel_fraction) * abs_defining_axis_steps;
-  const double accel_decel_mm
-    = (accel_decel_steps / cfg_->steps_per_mm[defining_axis]);
-  const char do_accel = (accel_decel_mm > 2 || accel_decel_steps > 16);
-#else
-  const char do_accel = 1;
-#endif
-
-  bool has_accel = false;
-  bool has_move = false;
-  bool has_decel = false;
 
-  if (do_accel && accel_fraction * abs_defining_axis_steps > 0) {
-    has_accel = true;
-    accel_command.v0 = (float)last_speed;        // Last speed of defining axis
-    accel_command.v1 = (float)target_pos->speed; // New speed of defining axis
+  // Whether a speed change is worth it is decided by the distance it takes
+  // with constant acceleration. With a jerk limit, even a tiny speed change
+  // (e.g. from rounding) takes a couple of steps.
+  bool has_accel =
+    std::lround(speed_change_distance(v0, peak_speed, a, real(0))) > 0;
+  // If we come to a full stop, we always want a deceleration segment, so
+  // that we end with speed zero.
+  bool has_decel =
+    (std::lround(speed_change_distance(peak_speed, *v1, a, real(0))) > 0
+     || (*v1 == 0 && peak_speed > 0));
+
+  if (has_accel) {
+    accel_command.v0 = (float)v0;          // Last speed of defining axis
+    accel_command.v1 = (float)peak_speed;  // New speed of defining axis
 
     // Now map axis steps to actual motor driver
+    const real accel_fraction = accel_steps / abs_defining_axis_steps;
     for (const GCodeParserAxis a : AllAxes()) {
       const int accel_steps = std::lround(accel_fraction * axis_steps[a]);
       assign_steps_to_motors(&accel_command, a, accel_steps);
     }
   } else {
-    if (last_speed) target_pos->speed = last_speed; // No accel so use the last speed
+    peak_speed = v0;   // No accel so use the last speed
   }
 
-  move_command.v0 = (float)target_pos->speed;
-  move_command.v1 = (float)target_pos->speed;
+  move_command.v0 = (float)peak_speed;
+  move_command.v1 = (float)peak_speed;
 
-  if (do_accel && decel_fraction * abs_defining_axis_steps > 0) {
-    has_decel = true;
-    decel_command.v0 = (float)target_pos->speed;
-    decel_command.v1 = (float)next_speed;
-    target_pos->speed = next_speed;
+  if (has_decel) {
+    decel_command.v0 = (float)peak_speed;
+    decel_command.v1 = (float)*v1;
 
     // Now map axis steps to actual motor driver
+    const real decel_fraction = decel_steps / abs_defining_axis_steps;
     for (const GCodeParserAxis a : AllAxes()) {
       const int decel_steps = std::lround(decel_fraction * axis_steps[a]);
       assign_steps_to_motors(&decel_command, a, decel_steps);
     }
+  } else {
+    *v1 = peak_speed;  // No decel, so we exit with the travel speed.
   }
 
   // Move is everything that hasn't been covered in speed changes.
@@ -475,37 +800,485 @@ bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
     assign_steps_to_motors(&move_command, a, axis_steps[a]);
   }
   subtract_steps(&move_command, accel_command);
-  has_move = subtract_steps(&move_command, decel_command);
+  const bool has_move = subtract_steps(&move_command, decel_command);
+
+  // Everything so far is in steps of the defining axis; the motor operations
+  // work with the motor that has the most steps.
+  const real motor_ratio = motor_speed_ratio(axis_steps,
+                                             abs_defining_axis_steps);
+  if (motor_ratio != 1) {
+    for (LinearSegmentSteps *c : { &accel_command, &move_command,
+                                   &decel_command }) {
+      c->v0 *= motor_ratio;
+      c->v1 *= motor_ratio;
+    }
+  }
 
   if (cfg_->synchronous) motor_ops_->WaitQueueEmpty();
 
   // Make sure each segment gets added in case we get aborted
-  if (has_accel)        ret = motor_ops_->Enqueue(accel_command);
-  if (ret && has_move)  ret = motor_ops_->Enqueue(move_command);
-  if (ret && has_decel) ret = motor_ops_->Enqueue(decel_command);
+  const real jerk = target_pos->jerk * motor_ratio;
+  bool ret = true;
+  if (has_accel)
+    ret = enqueue_speed_change(accel_command,
+                               std::lround(accel_steps * motor_ratio), jerk);
+  if (ret && has_move)  ret = send_segment(move_command);
+  if (ret && has_decel)
+    ret = enqueue_speed_change(decel_command,
+                               std::lround(decel_steps * motor_ratio), jerk);
+  if (ret) ret = flush_segments();
 
   last_aux_bits_ = target_pos->aux_bits;
 
+  {
+    std::lock_guard<std::mutex> l(stats_mutex_);
+    // Rounding of the segment steps doesn't matter for these.
+    const real travel_steps = abs_defining_axis_steps
+      - (has_accel ? accel_steps : 0) - (has_decel ? decel_steps : 0);
+    stats_.requested_seconds += abs_defining_axis_steps / target_pos->speed;
+    if (has_accel) {
+      ++stats_.accel_segments;
+      stats_.planned_seconds += 2 * accel_steps / (v0 + peak_speed);
+    }
+    if (has_move) {
+      ++stats_.travel_segments;
+      if (travel_steps > 0 && peak_speed > 0)
+        stats_.planned_seconds += travel_steps / peak_speed;
+    }
+    if (has_decel) {
+      ++stats_.decel_segments;
+      if (peak_speed + *v1 > 0)
+        stats_.planned_seconds += 2 * decel_steps / (peak_speed + *v1);
+    }
+  }
+
   return ret;
 }
 
-// If we have enough data in the queue, issue motor move.
-bool Planner::Impl::issue_motor_move_if_possible() {
-  bool ret = true;
-  if (planning_buffer_.size() >= 3) {
-    ret = move_machine_steps(planning_buffer_[0],  // Current established position.
-                             planning_buffer_[1],  // Position we want to move to.
-                             planning_buffer_[2]); // Next upcoming.
-    planning_buffer_.pop_front();
+// Number of constant-acceleration pieces we use to approximate each of the
+// two acceleration ramps of a jerk limited speed change.
+static constexpr int kJerkRampPieces = 4;
+
+// Speed gain after time "t" into a jerk limited speed change of "dv" within
+// time "T". Acceleration ramps up linearly within "tj" to "ap", stays there,
+// and ramps down within "tj" at the end. The distance gained compared to
+// staying at the initial speed is returned in "distance".
+template <typename real>
+static real s_curve_gain(real t, real T, real tj, real ap,
+                         real dv, real *distance) {
+  if (t <= tj) {
+    *distance = ap * t*t*t / (6 * tj);
+    return ap * t*t / (2 * tj);
+  }
+  if (t < T - tj) {
+    const real c = t - tj;
+    *distance = ap * tj*tj / 6 + ap * tj / 2 * c + ap * c*c / 2;
+    return ap * tj / 2 + ap * c;
   }
+  // The ramp-down mirrors the ramp-up around the middle of the speed change.
+  const real u = T - t;
+  *distance = dv * T / 2 - (dv * u - ap * u*u*u / (6 * tj));
+  return dv - ap * u*u / (2 * tj);
+}
+
+// Enqueue a segment that changes speed from segment.v0 to segment.v1.
+//
+// Without jerk limit, this is a single segment with constant acceleration.
+// Otherwise, we shape an S-curve: the acceleration is ramped in and out
+// with at most the given jerk (steps/s^3 on the defining axis). The planning
+// already gave the speed change the time the ramps need (see
+// speed_change_time()), so the peak acceleration stays within the
+// acceleration limit as well.
+//
+// The motion backend only knows constant acceleration, so the ramps are
+// approximated by a couple of pieces of increasing/decreasing acceleration.
+template <typename real>
+bool PlannerBase<real>::Impl::enqueue_speed_change(const LinearSegmentSteps &segment,
+                                                   int defining_steps, real jerk) {
+  const real v0 = segment.v0;
+  const real v1 = segment.v1;
+  const real dv = std::fabs(v1 - v0);
+  if (jerk <= 0 || defining_steps < 2 * kJerkRampPieces + 1 || v0 + v1 <= 0)
+    return send_segment(segment);
+
+  // Duration as planned.
+  const real T = 2 * defining_steps / (v0 + v1);
+
+  // Time spent ramping acceleration in and out: j * tj * (T - tj) = dv
+  // The planned duration is long enough for that with the peak acceleration
+  // j * tj within limits. Only rounding to full steps can make it a tiny bit
+  // short; then we get a pure S-curve and exceed the jerk by that much.
+  const real discriminant = T*T - 4 * dv / jerk;
+  const real tj = discriminant > 0 ? (T - std::sqrt(discriminant)) / 2 : T/2;
+  const real ap = dv / (T - tj);  // peak acceleration.
+  const real direction = (v1 > v0) ? 1.0 : -1.0;
+
+  // Boundaries in time of all the pieces.
+  real times[2 * kJerkRampPieces + 2];
+  int count = 0;
+  for (int i = 1; i <= kJerkRampPieces; ++i)
+    times[count++] = tj * i / kJerkRampPieces;
+  // Constant acceleration in between. If that is shorter than a piece of the
+  // ramps, it is just part of the next piece.
+  if (T - 2 * tj > tj / kJerkRampPieces)
+    times[count++] = T - tj;
+  for (int i = 1; i <= kJerkRampPieces; ++i)
+    times[count++] = T - tj + tj * i / kJerkRampPieces;
+
+  struct LinearSegmentSteps piece = segment;
+  int done_steps = 0;
+  int done_motor_steps[BEAGLEG_NUM_MOTORS] = {0};
+  for (int i = 0; i < count; ++i) {
+    const bool is_last = (i == count - 1);
+    real distance;
+    const real gain = s_curve_gain(times[i], T, tj, ap, dv, &distance);
+    const int steps = is_last
+      ? defining_steps
+      : std::lround(v0 * times[i] + direction * distance);
+    if (steps <= done_steps) continue;   // Too short to matter; merge.
+    if (steps >= defining_steps && !is_last) continue;
+
+    piece.v1 = is_last ? segment.v1 : (float)(v0 + direction * gain);
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      const int motor_steps = is_last
+        ? segment.steps[m]
+        : (int)std::lround(1.0 * segment.steps[m] * steps / defining_steps);
+      piece.steps[m] = motor_steps - done_motor_steps[m];
+      done_motor_steps[m] = motor_steps;
+    }
+    if (!send_segment(piece))
+      return false;
+    piece.v0 = piece.v1;
+    done_steps = steps;
+  }
+  return true;
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::send_segment(const LinearSegmentSteps &in,
+                                           bool planned) {
+  LinearSegmentSteps segment = in;
+  if (pressure_advance_ > 0 && extruder_motor_ >= 0 && planned)
+    advance_extruder(&segment);
+  if (!queue_segment(segment, planned))
+    return false;
+
+  if (planned && extruder_advance_ != 0 && segment.v1 == 0) {
+    // The last segments were too short to fully take back the advance.
+    return take_back_extruder_advance(segment.aux_bits);
+  }
+  return true;
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::queue_segment(const LinearSegmentSteps &segment,
+                                            bool planned) {
+  if (trace_) {
+    PlannerTraceRecord record;
+    record.type = PlannerTraceRecord::SEGMENT;
+    record.segment = segment;
+    trace_->Write(record);
+  }
+  if (planned) {
+    if (pending_count_ == kMaxPendingSegments && !flush_segments())
+      return false;
+    pending_segments_[pending_count_++] = segment;
+    return true;
+  }
+  return flush_segments() && motor_ops_->Enqueue(segment);
+}
+
+// At the end of the path, the extruder is still ahead. Move it back on its
+// own, accelerating and decelerating within its limits. This is part of the
+// planned path, so it goes through the input shaper like everything else.
+template <typename real>
+bool PlannerBase<real>::Impl::take_back_extruder_advance(
+  HardwareMapping::AuxBitmap aux_bits) {
+  const int steps = abs(extruder_advance_);
+  const int direction = extruder_advance_ > 0 ? -1 : 1;
+  extruder_advance_ = 0;
+  const float max_speed = max_axis_speed_[AXIS_E];
+  const float accel = max_axis_accel_[AXIS_E];
+
+  // Accelerate for half of the way, unless we reach the maximum speed
+  // earlier. For a single step, or without acceleration limit, we only
+  // decelerate.
+  int ramp_steps = accel > 0 ? steps / 2 : 0;
+  if (accel > 0 && max_speed > 0) {
+    ramp_steps = std::min(ramp_steps,
+                          (int)std::lround(max_speed * max_speed / (2 * accel)));
+  }
+  const int decel_steps = ramp_steps > 0 ? ramp_steps : steps;
+  const float peak_speed = accel > 0
+    ? std::sqrt(2 * accel * decel_steps)
+    : max_speed;   // No acceleration limit.
+
+  LinearSegmentSteps accel_command = {};
+  accel_command.aux_bits = aux_bits;
+  LinearSegmentSteps move_command = accel_command;
+  LinearSegmentSteps decel_command = accel_command;
+  accel_command.v1 = peak_speed;
+  move_command.v0 = move_command.v1 = peak_speed;
+  decel_command.v0 = peak_speed;
+  assign_steps_to_motors(&accel_command, AXIS_E, direction * ramp_steps);
+  assign_steps_to_motors(&move_command, AXIS_E,
+                         direction * (steps - ramp_steps - decel_steps));
+  assign_steps_to_motors(&decel_command, AXIS_E, direction * decel_steps);
+
+  if (ramp_steps > 0 && !queue_segment(accel_command, true))
+    return false;
+  if (steps - ramp_steps - decel_steps > 0 && !queue_segment(move_command, true))
+    return false;
+  return queue_segment(decel_command, true);
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::flush_segments() {
+  if (pending_count_ == 0)
+    return true;
+  const int count = pending_count_;
+  pending_count_ = 0;
+  return shaper_
+    ? shaper_->Enqueue(pending_segments_, count)
+    : motor_ops_->EnqueueMany(pending_segments_, count);
+}
+
+// The pressure in the nozzle, and with it the flow, lags behind the extruder
+// motor: it takes a while to build up when speeding up and oozes out when
+// slowing down. Pressure advance keeps the extruder ahead by the extrusion
+// speed times the pressure advance factor. So while accelerating, the
+// extruder gets extra steps, while decelerating, fewer; at a stop of the path,
+// the extruder is back to where it was planned.
+// Only printing moves are advanced, not retracts or travel.
+template <typename real>
+void PlannerBase<real>::Impl::advance_extruder(LinearSegmentSteps *segment) {
+  const int extruder_steps = segment->steps[extruder_motor_];
+  int other_steps = 0;
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    if (hardware_mapping_->GetMotorMap(AXIS_E) & (1 << motor))
+      continue;
+    other_steps = std::max(other_steps, abs(segment->steps[motor]));
+  }
+  int target_advance = 0;
+  if (extruder_steps > 0 && other_steps > 0) {
+    // Speeds are given for the motor with the most steps.
+    const float extrusion_speed = segment->v1 * extruder_steps
+      / std::max(other_steps, extruder_steps);
+    target_advance = std::lround(pressure_advance_ * extrusion_speed);
+  }
+
+  // Don't let the extruder become the motor with the most steps, that
+  // would change the timing of the segment. What doesn't fit now is
+  // caught up with in the following segments.
+  const int limit = std::max(other_steps, abs(extruder_steps));
+  const int advance = std::max(-limit - extruder_steps,
+                               std::min(limit - extruder_steps,
+                                        target_advance - extruder_advance_));
+  if (advance == 0)
+    return;
+  assign_steps_to_motors(segment, AXIS_E, advance);
+  extruder_advance_ += advance;
+}
+
+// Update the entry speeds of all targets in the planning buffer.
+//
+// We don't know yet what comes after the last target, so we have to assume
+// that we need to come to a full stop there. The reverse pass goes from the
+// end of the buffer backwards and determines the maximum entry speed with
+// which each move can still decelerate to whatever the next move allows.
+// The forward pass then limits entry speeds to what we actually can reach by
+// accelerating from the previous move.
+//
+// Entry speeds that are limited by the joining speed or by acceleration
+// in the forward pass can not get any better with more targets coming in,
+// so we remember that position in planned_ and don't revisit it.
+//
+// All of this happens in euclidian space, as the entry speeds are.
+template <typename real>
+void PlannerBase<real>::Impl::plan_buffered_targets() {
+  const unsigned last = planning_buffer_.size() - 1;
+  if (last <= planned_) return;
+
+  // Reverse pass.
+  real next_entry_speed = 0.0;
+  for (unsigned i = last; i > planned_; --i) {
+    AxisTarget<real> *t = planning_buffer_[i];
+    const real s = defining_to_euclid(t, real(abs(t->delta_steps[t->defining_axis])));
+    const real v = reachable_speed(next_entry_speed, s,
+                                   defining_to_euclid(t, t->accel),
+                                   defining_to_euclid(t, t->jerk));
+    t->entry_speed = std::min(t->max_entry_speed, v);
+    next_entry_speed = t->entry_speed;
+  }
+
+  // Forward pass.
+  for (unsigned i = planned_; i < last; ++i) {
+    const AxisTarget<real> *current = planning_buffer_[i];
+    AxisTarget<real> *next = planning_buffer_[i+1];
+    if (i > 0 && current->entry_speed < next->entry_speed) {
+      const real s = defining_to_euclid(
+        current, real(abs(current->delta_steps[current->defining_axis])));
+      const real v = reachable_speed(current->entry_speed, s,
+                                     defining_to_euclid(current, current->accel),
+                                     defining_to_euclid(current, current->jerk));
+      if (v < next->entry_speed) {
+        next->entry_speed = v;
+        planned_ = i + 1;   // Acceleration limited: optimal up to here.
+      }
+    }
+    if (next->entry_speed == next->max_entry_speed)
+      planned_ = i + 1;
+  }
+}
+
+// Send the oldest pending target in the buffer to the motors.
+template <typename real>
+bool PlannerBase<real>::Impl::issue_next_motor_move() {
+  assert(planning_buffer_.size() > 1);
+  const AxisTarget<real> *target = planning_buffer_[1];
+  real exit_speed = 0.0;
+  if (planning_buffer_.size() > 2) exit_speed = planning_buffer_[2]->entry_speed;
+  // The motors go by the steps of the defining axis of this move.
+  real v1 = euclid_to_defining(target, exit_speed);
+  const bool ret = move_machine_steps(
+    target, euclid_to_defining(target, target->entry_speed), &v1);
+  if (planning_buffer_.size() > 2) {
+    // This is now fixed: it is the speed we left the previous move with.
+    planning_buffer_[2]->entry_speed = defining_to_euclid(target, v1);
+  }
+  planning_buffer_.pop_front();
+  if (planned_ > 1) --planned_;
   return ret;
 }
 
-bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
+// Something went wrong sending segments to the motors (e.g. E-Stop). Don't
+// send any of the still pending targets; we continue from the last known
+// target position.
+template <typename real>
+void PlannerBase<real>::Impl::discard_pending_targets() {
+  have_blend_corner_ = false;
+  while (planning_buffer_.size() > 1)
+    planning_buffer_.pop_front();
+  planning_buffer_[0]->entry_speed = 0;
+  planned_ = 0;
+  path_halted_ = true;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::target_position_mm(const AxisTarget<real> *target,
+                                                 AxesRegister *pos) {
+  for (const GCodeParserAxis a : AllAxes()) {
+    (*pos)[a] = cfg_->steps_per_mm[a] != 0
+      ? target->position_steps[a] / cfg_->steps_per_mm[a]
+      : 0;
+  }
+}
+
+// Squared distance of point "p" to the line segment from "start" to "end",
+// in the space of all axes.
+static double distance_to_segment_sq(const AxesRegister &p,
+                                     const AxesRegister &start,
+                                     const AxesRegister &end) {
+  double len_sq = 0, dot = 0;
+  for (const GCodeParserAxis a : AllAxes()) {
+    len_sq += (end[a] - start[a]) * (end[a] - start[a]);
+    dot += (p[a] - start[a]) * (end[a] - start[a]);
+  }
+  const double t = len_sq > 0 ? std::max(0.0, std::min(1.0, dot / len_sq)) : 0;
+  double dist_sq = 0;
+  for (const GCodeParserAxis a : AllAxes()) {
+    const double d = p[a] - (start[a] + t * (end[a] - start[a]));
+    dist_sq += d * d;
+  }
+  return dist_sq;
+}
+
+// Check if the last, not yet issued, target can be replaced with a straight
+// move from where it started to the new position without any of the
+// positions in-between deviating more than the merge tolerance.
+template <typename real>
+bool PlannerBase<real>::Impl::can_merge_with_previous(const AxesRegister &axis,
+                                                      float feedrate,
+                                                      HardwareMapping::AuxBitmap aux) {
+  if (cfg_->merge_tolerance <= 0 || planning_buffer_.size() < 2 || delta_)
+    return false;
+  const AxisTarget<real> *previous = planning_buffer_.back();
+  if (previous->feedrate != feedrate || previous->aux_bits != aux
+      || merged_count_ >= kMaxMergedTargets)
+    return false;
+
+  AxesRegister start, end, corner;
+  target_position_mm(planning_buffer_[planning_buffer_.size() - 2], &start);
+  target_position_mm(previous, &corner);
+  for (const GCodeParserAxis a : AllAxes()) {
+    end[a] = cfg_->steps_per_mm[a] != 0 ? axis[a] : 0;
+  }
+  const real tolerance_sq = cfg_->merge_tolerance * cfg_->merge_tolerance;
+  if (distance_to_segment_sq(corner, start, end) > tolerance_sq)
+    return false;
+  for (int i = 0; i < merged_count_; ++i) {
+    if (distance_to_segment_sq(merged_points_[i], start, end) > tolerance_sq)
+      return false;
+  }
+  return true;
+}
+
+// Plan a straight move to "axis". With delta kinematics, a straight move of
+// the effector is split into segments that are short enough to be straight
+// for the carriages as well.
+template <typename real>
+bool PlannerBase<real>::Impl::machine_move(const AxesRegister &axis, float feedrate,
+                                           HardwareMapping::AuxBitmap aux_bits) {
+  if (!delta_)
+    return plan_target(axis, feedrate, aux_bits);
+
+  AxesRegister start;
+  last_target_mm(axis, &start);
+  const float dx = axis[AXIS_X] - start[AXIS_X];
+  const float dy = axis[AXIS_Y] - start[AXIS_Y];
+  const float xy_len = sqrtf(dx*dx + dy*dy);
+  AxesRegister piece;
+  float done = 0;   // Fraction of the move.
+  while (done < 1) {
+    const float length = delta_->SegmentLength(start[AXIS_X] + done * dx,
+                                               start[AXIS_Y] + done * dy);
+    done = (xy_len > length) ? std::min(1.0f, done + length / xy_len) : 1;
+    for (const GCodeParserAxis a : AllAxes()) {
+      piece[a] = (done < 1) ? start[a] + done * (axis[a] - start[a]) : axis[a];
+    }
+    if (!plan_target(piece, feedrate, aux_bits))
+      return false;
+  }
+  return true;
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::plan_target(const AxesRegister &axis, float feedrate,
+                                          HardwareMapping::AuxBitmap aux_bits) {
   assert(position_known_);   // call SetExternalPosition() after DirectDrive()
+
+  float carriage[3];
+  if (delta_ && !delta_->CartesianToCarriages(axis[AXIS_X], axis[AXIS_Y],
+                                              axis[AXIS_Z], carriage)) {
+    Log_error("Position (%.3f, %.3f, %.3f) out of reach of delta. Ignored.",
+              axis[AXIS_X], axis[AXIS_Y], axis[AXIS_Z]);
+    return true;
+  }
+
+  // Many tiny moves on a straight line are better dealt with as one: replace
+  // the last target with one that goes straight to the new position.
+  const bool merge = can_merge_with_previous(axis, feedrate, aux_bits);
+  if (merge) {
+    target_position_mm(planning_buffer_.back(), &merged_points_[merged_count_]);
+    ++merged_count_;
+    planning_buffer_.pop_back();
+    if (planned_ > planning_buffer_.size() - 1)
+      planned_ = planning_buffer_.size() - 1;
+  }
+
   // We always have a previous position.
-  struct AxisTarget *previous = planning_buffer_.back();
-  struct AxisTarget *new_pos = planning_buffer_.append();
+  AxisTarget<real> *previous = planning_buffer_.back();
+  AxisTarget<real> *new_pos = planning_buffer_.append();
   int max_steps = -1;
   enum GCodeParserAxis defining_axis = AXIS_X;
 
@@ -513,7 +1286,8 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   // step, but we never accumulate the error, as we always use the absolute
   // position as reference.
   for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = std::lround(axis[a] * cfg_->steps_per_mm[a]);
+    const float pos = (delta_ && a <= AXIS_Z) ? carriage[a] : axis[a];
+    new_pos->position_steps[a] = std::lround(pos * cfg_->steps_per_mm[a]);
     new_pos->delta_steps[a] = new_pos->position_steps[a] - previous->position_steps[a];
 
     // The defining axis is the one that has to travel the most steps. It defines
@@ -528,12 +1302,15 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   if (max_steps == 0) {
     // Nothing to do, ignore this move.
     planning_buffer_.pop_back();
+    merged_count_ = 0;
     return true;
   }
 
   assert(max_steps > 0);
 
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
+  if (!merge) merged_count_ = 0;
+  new_pos->feedrate = feedrate;
+  new_pos->aux_bits = aux_bits;
   new_pos->defining_axis = defining_axis;
 
   // Work out the real units values for the euclidian axes now to avoid
@@ -541,6 +1318,14 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   new_pos->dx = axis_delta_to_mm(new_pos, AXIS_X);
   new_pos->dy = axis_delta_to_mm(new_pos, AXIS_Y);
   new_pos->dz = axis_delta_to_mm(new_pos, AXIS_Z);
+  if (delta_) {
+    // The speed is about the effector, not the carriages.
+    new_pos->dx = axis[AXIS_X] - delta_position_[0];
+    new_pos->dy = axis[AXIS_Y] - delta_position_[1];
+    new_pos->dz = axis[AXIS_Z] - delta_position_[2];
+    for (int i = 0; i < 3; ++i)
+      delta_position_[i] = axis[(GCodeParserAxis) (AXIS_X + i)];
+  }
   new_pos->len = euclid_distance(new_pos->dx, new_pos->dy, new_pos->dz);
 
   // Work out the desired euclidian travel speed in steps/s on the defining axis.
@@ -549,31 +1334,92 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   if (new_pos->speed > max_axis_speed_[defining_axis])
     new_pos->speed = max_axis_speed_[defining_axis];
 
-  bool ret = issue_motor_move_if_possible();
-  if (ret) path_halted_ = false;
-  return ret;
+  // Make sure the target feedrate for the move is clamped to what all the
+  // moving axes can reach.
+  const real target_feedrate
+    = clamp_to_limits(defining_axis,
+                      new_pos->speed / cfg_->steps_per_mm[defining_axis],
+                      new_pos->delta_steps);
+  new_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
+  new_pos->accel = acceleration_for_move(new_pos->delta_steps, defining_axis);
+  new_pos->jerk = jerk_for_move(new_pos->delta_steps, defining_axis);
+  if (!motors_are_axes_) limit_to_motors(new_pos);
+
+  // If we come from a halt, we start with speed zero. Otherwise, we might
+  // be able to join the previous move with some speed, but never faster
+  // than any of these two moves wants to go.
+  JunctionStop stop = NO_STOP;
+  if (planning_buffer_.size() == 2) {
+    new_pos->max_entry_speed = 0.0;
+  } else {
+    new_pos->max_entry_speed = determine_joining_speed(
+      previous, new_pos, cfg_->junction_deviation, &stop);
+    new_pos->max_entry_speed = std::min(
+      new_pos->max_entry_speed,
+      std::min(defining_to_euclid(previous, previous->speed),
+               defining_to_euclid(new_pos, new_pos->speed)));
+  }
+  new_pos->entry_speed = new_pos->max_entry_speed;
+
+  {
+    std::lock_guard<std::mutex> l(stats_mutex_);
+    ++stats_.targets;
+    if (merge) ++stats_.merged_targets;
+    if (planning_buffer_.size() == 2) ++stats_.stops_path_start;
+    switch (stop) {
+    case NO_STOP: break;
+    case STOP_NON_EUCLIDIAN: ++stats_.stops_non_euclidian; break;
+    case STOP_REVERSAL:      ++stats_.stops_reversal; break;
+    case STOP_CORNER:        ++stats_.stops_corner; break;
+    }
+  }
+
+  plan_buffered_targets();
+  path_halted_ = false;
+
+  // Once we have enough targets to look ahead, send out the oldest.
+  if ((int)planning_buffer_.size() - 1 > cfg_->lookahead) {
+    // The exit speed of the move is final only if the planning got that far.
+    const AxisTarget<real> *next = planning_buffer_[2];
+    if (planned_ < 2 && next->entry_speed < next->max_entry_speed) {
+      std::lock_guard<std::mutex> l(stats_mutex_);
+      ++stats_.lookahead_limited;
+    }
+    if (!issue_next_motor_move()) {
+      discard_pending_targets();
+      return false;
+    }
+  }
+  return true;
 }
 
-void Planner::Impl::bring_path_to_halt() {
+template <typename real>
+void PlannerBase<real>::Impl::bring_path_to_halt(HardwareMapping::AuxBitmap aux_bits) {
+  if (!flush_blend_corner()) return;
   if (path_halted_) return;
-  // Enqueue a new position that is the same position as the last
-  // one seen, but zero speed. That will allow the previous segment to
-  // slow down. Enqueue.
-  struct AxisTarget *previous = planning_buffer_.back();
-  struct AxisTarget *new_pos = planning_buffer_.append();
-  for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = previous->position_steps[a];
-    new_pos->delta_steps[a] = 0;
-  }
-  new_pos->defining_axis = AXIS_X;
-  new_pos->speed = 0;
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
-  new_pos->dx = new_pos->dy = new_pos->dz = new_pos->len = 0.0;
-  issue_motor_move_if_possible();
+  // The planning always assumes that we have to come to a full stop after
+  // the last target, so we can just send out everything we have.
+  while (planning_buffer_.size() > 1) {
+    if (!issue_next_motor_move()) {
+      discard_pending_targets();
+      return;
+    }
+  }
+  planned_ = 0;
+
+  if (last_aux_bits_ != aux_bits) {
+    // Special treatment: bits changed since last time, let's push them through.
+    struct LinearSegmentSteps bit_set_command = {};
+    bit_set_command.aux_bits = aux_bits;
+    send_segment(bit_set_command);
+    flush_segments();
+    last_aux_bits_ = bit_set_command.aux_bits;
+  }
   path_halted_ = true;
 }
 
-void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
+template <typename real>
+void PlannerBase<real>::Impl::GetCurrentPosition(AxesRegister *pos) {
   pos->zero();
   PhysicalStatus physical_status;
   if (!motor_ops_->GetPhysicalStatus(&physical_status))
@@ -587,13 +1433,17 @@ void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
       (*pos)[a] = hardware_mapping_->GetAxisSteps(a, physical_status) / cfg_->steps_per_mm[a];
     }
   }
+  if (delta_) {
+    const float carriage[3] = { (*pos)[AXIS_X], (*pos)[AXIS_Y], (*pos)[AXIS_Z] };
+    delta_->CarriagesToCartesian(carriage, &(*pos)[AXIS_X], &(*pos)[AXIS_Y],
+                                 &(*pos)[AXIS_Z]);
+  }
 }
 
-int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
-                               float v0, float v1) {
-  bring_path_to_halt();     // Precondition. Let's just do it for good measure.
-  position_known_ = false;
-
+template <typename real>
+LinearSegmentSteps
+PlannerBase<real>::Impl::direct_drive_segment(GCodeParserAxis axis, int steps,
+                                              float v0, float v1) {
   const float steps_per_mm = cfg_->steps_per_mm[axis];
 
   struct LinearSegmentSteps move_command = {};
@@ -607,57 +1457,561 @@ int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
 
   move_command.aux_bits = hardware_mapping_->GetAuxBits();
 
-  const int segment_move_steps = std::lround(distance * steps_per_mm);
-  assign_steps_to_motors(&move_command, axis, segment_move_steps);
+  assign_steps_to_motors(&move_command, axis, steps);
+
+  // With CoreXY, the motors move the axis together, each at the axis speed.
+  // Not faster than they can go though.
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    if (move_command.steps[motor] == 0 || max_motor_speed_[motor] <= 0)
+      continue;
+    move_command.v0 = std::min(move_command.v0, max_motor_speed_[motor]);
+    move_command.v1 = std::min(move_command.v1, max_motor_speed_[motor]);
+  }
+  return move_command;
+}
+
+template <typename real>
+int PlannerBase<real>::Impl::DirectDrive(GCodeParserAxis axis, float distance,
+                                         float v0, float v1) {
+  BringPathToHalt();     // Precondition. Let's just do it for good measure.
+  if (trace_) {
+    PlannerTraceRecord record;
+    record.type = PlannerTraceRecord::DIRECT_DRIVE;
+    record.axis = axis;
+    record.aux_bits = hardware_mapping_->GetAuxBits();
+    record.value = distance;
+    record.v0 = v0;
+    record.v1 = v1;
+    trace_->Write(record);
+  }
+  position_known_ = false;
+
+  const int segment_move_steps = std::lround(distance * cfg_->steps_per_mm[axis]);
+  const LinearSegmentSteps move_command =
+    direct_drive_segment(axis, segment_move_steps, v0, v1);
 
-  motor_ops_->Enqueue(move_command);
+  // Not shaped: homing and probing moves need to stop right at the switch.
+  send_segment(move_command, false);
   motor_ops_->WaitQueueEmpty();
 
   return segment_move_steps;
 }
 
-void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
+template <typename real>
+bool PlannerBase<real>::Impl::DirectDriveToEndstop(GCodeParserAxis axis,
+                                                   float distance,
+                                                   float v0, float v1,
+                                                   const EndstopSwitch &endstop,
+                                                   int *steps,
+                                                   bool *triggered) {
+  BringPathToHalt();     // Precondition. Let's just do it for good measure.
+  const float steps_per_mm = cfg_->steps_per_mm[axis];
+  const int segment_move_steps = std::lround(distance * steps_per_mm);
+  const LinearSegmentSteps move_command =
+    direct_drive_segment(axis, segment_move_steps, v0, v1);
+
+  float deceleration = max_axis_accel_[axis];
+  int defining_motor = 0;
+  for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
+    if (move_command.steps[motor] == 0) continue;
+    if (max_motor_accel_[motor] > 0)
+      deceleration = std::min(deceleration, max_motor_accel_[motor]);
+    if (abs(move_command.steps[motor]) > abs(move_command.steps[defining_motor]))
+      defining_motor = motor;
+  }
+  if (move_command.steps[defining_motor] == 0)
+    return false;
+
+  HomingResult result;
+  position_known_ = false;
+  if (!motor_ops_->MoveUntilEndstop(move_command, endstop, deceleration,
+                                    &result))
+    return false;
+
+  *steps = std::lround(1.0 * segment_move_steps * result.steps[defining_motor]
+                       / move_command.steps[defining_motor]);
+  *triggered = result.triggered;
+
+  // Only now we know how far we went; replays just drive that distance.
+  if (trace_) {
+    PlannerTraceRecord record;
+    record.type = PlannerTraceRecord::DIRECT_DRIVE;
+    record.axis = axis;
+    record.aux_bits = move_command.aux_bits;
+    record.value = *steps / steps_per_mm;
+    record.v0 = v0;
+    record.v1 = v1;
+    trace_->Write(record);
+  }
+  return true;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   assert(path_halted_);   // Precondition.
   position_known_ = true;
+  if (trace_) {
+    PlannerTraceRecord record;
+    record.type = PlannerTraceRecord::EXTERNAL_POSITION;
+    record.axis = axis;
+    record.value = pos;
+    trace_->Write(record);
+  }
 
-  const int motor_position = std::lround(pos * cfg_->steps_per_mm[axis]);
-  planning_buffer_.back()->position_steps[axis] = motor_position;
-  planning_buffer_[0]->position_steps[axis] = motor_position;
+  const int axis_position = std::lround(pos * cfg_->steps_per_mm[axis]);
+  planning_buffer_.back()->position_steps[axis] = axis_position;
+  planning_buffer_[0]->position_steps[axis] = axis_position;
 
-  const uint8_t motormap_for_axis = hardware_mapping_->GetMotorMap(axis);
+  // The motors that move this axis; depending on the kinematics, their
+  // position is determined by other axes as well.
+  struct LinearSegmentSteps affected = {};
+  struct LinearSegmentSteps motor_position = {};
+  assign_steps_to_motors(&affected, axis, 1);
+  for (const GCodeParserAxis a : AllAxes()) {
+    assign_steps_to_motors(&motor_position, a,
+                           planning_buffer_.back()->position_steps[a]);
+  }
   for (int motor = 0; motor < BEAGLEG_NUM_MOTORS; ++motor) {
-    if (motormap_for_axis & (1 << motor))
-      motor_ops_->SetExternalPosition(motor, motor_position);
+    if (affected.steps[motor] != 0)
+      motor_ops_->SetExternalPosition(motor, motor_position.steps[motor]);
+  }
+  if (delta_) update_delta_position();
+}
+
+// With delta kinematics, the external positions of X, Y and Z are the
+// carriage positions, e.g. after homing the towers. Determine where that
+// puts the effector.
+template <typename real>
+void PlannerBase<real>::Impl::update_delta_position() {
+  float carriage[3];
+  for (int i = 0; i < 3; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+    carriage[i] = cfg_->steps_per_mm[a] != 0
+      ? planning_buffer_.back()->position_steps[a] / cfg_->steps_per_mm[a]
+      : 0;
+  }
+  delta_->CarriagesToCartesian(carriage, &delta_position_[0],
+                               &delta_position_[1], &delta_position_[2]);
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::GetStats(PlannerStats *stats) {
+  std::lock_guard<std::mutex> l(stats_mutex_);
+  *stats = stats_;
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::path_move(PlannerRequest request) {
+  if (request.curve_radius > 0) {
+    // Only now we know where the move starts, thus the axes it uses.
+    AxesRegister start;
+    if (have_blend_corner_)
+      start = blend_corner_.target;
+    else
+      last_target_mm(request.target, &start);
+    request.feedrate = std::min(request.feedrate,
+                                curve_feedrate_limit(start, request.target,
+                                                     request.curve_radius));
+  }
+  if (request.blend_tolerance <= 0) {
+    return (flush_blend_corner() &&
+            machine_move(request.target, request.feedrate, request.aux_bits));
+  }
+  bool ret = true;
+  if (have_blend_corner_)
+    ret = move_around_corner(blend_corner_, request);
+  if (ret) {
+    blend_corner_ = request;
+    have_blend_corner_ = true;
+  }
+  return ret;
+}
+
+// Nothing more to round: go all the way to the held back corner.
+template <typename real>
+bool PlannerBase<real>::Impl::flush_blend_corner() {
+  if (!have_blend_corner_) return true;
+  have_blend_corner_ = false;
+  return machine_move(blend_corner_.target, blend_corner_.feedrate,
+                      blend_corner_.aux_bits);
+}
+
+// Position of the last target we moved to, in mm. Axes that don't have a
+// step configuration don't move, so we take their value from "fallback".
+template <typename real>
+void PlannerBase<real>::Impl::last_target_mm(const AxesRegister &fallback,
+                                             AxesRegister *pos) {
+  const AxisTarget<real> *last = planning_buffer_.back();
+  for (const GCodeParserAxis a : AllAxes()) {
+    (*pos)[a] = cfg_->steps_per_mm[a] != 0
+      ? last->position_steps[a] / cfg_->steps_per_mm[a]
+      : fallback[a];
+  }
+  if (delta_) {
+    for (int i = 0; i < 3; ++i)
+      (*pos)[(GCodeParserAxis) (AXIS_X + i)] = delta_position_[i];
+  }
+}
+
+// Move from the last position towards the "corner", but replace the corner
+// with an arc that is tangent to both legs of the path and deviates at most
+// the blend tolerance from the corner. We stop at the end of the arc on the
+// leg towards "next".
+template <typename real>
+bool PlannerBase<real>::Impl::move_around_corner(const PlannerRequest &corner,
+                                                 const PlannerRequest &next) {
+  AxesRegister start;
+  last_target_mm(corner.target, &start);
+  const AxesRegister &c = corner.target;
+  const AxesRegister &n = next.target;
+
+  double in[3], out[3];   // Unit vectors of the legs in XYZ space.
+  double len_in = 0, len_out = 0;
+  for (int i = 0; i < 3; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+    in[i] = c[a] - start[a];
+    out[i] = n[a] - c[a];
+    len_in += in[i] * in[i];
+    len_out += out[i] * out[i];
+  }
+  len_in = std::sqrt(len_in);
+  len_out = std::sqrt(len_out);
+  if (len_in < 1e-6 || len_out < 1e-6)   // One of the legs is not in space.
+    return machine_move(c, corner.feedrate, corner.aux_bits);
+
+  double cos_turn = 0;
+  for (int i = 0; i < 3; ++i) {
+    in[i] /= len_in;
+    out[i] /= len_out;
+    cos_turn += in[i] * out[i];
+  }
+  if (cos_turn > 0.999999 || cos_turn < -0.999999)  // Straight or turn around
+    return machine_move(c, corner.feedrate, corner.aux_bits);
+
+  // The arc touches the legs at distance d from the corner. With the inner
+  // angle theta between the legs, its radius r = d * tan(theta/2) and the
+  // distance of the arc to the corner is r / sin(theta/2) - r.
+  const double turn = std::acos(cos_turn);
+  const double half_theta = (M_PI - turn) / 2;
+  const double tolerance = std::min(corner.blend_tolerance,
+                                    next.blend_tolerance);
+  double d = tolerance / (std::tan(half_theta)
+                          * (1.0 / std::sin(half_theta) - 1.0));
+  // Legs are shared with the neighboring corners, so each can use half.
+  d = std::min(d, std::min(len_in / 2, len_out / 2));
+  const double radius = d * std::tan(half_theta);
+
+  AxesRegister arc_start, arc_end;
+  for (const GCodeParserAxis a : AllAxes()) {
+    arc_start[a] = c[a] + (start[a] - c[a]) * d / len_in;
+    arc_end[a] = c[a] + (n[a] - c[a]) * d / len_out;
+  }
+  if (!machine_move(arc_start, corner.feedrate, corner.aux_bits))
+    return false;
+
+  // Don't go faster around the arc than the centripetal acceleration allows.
+  const float feedrate = std::min(
+    std::min(corner.feedrate, next.feedrate),
+    std::min(curve_feedrate_limit(start, c, radius),
+             curve_feedrate_limit(c, n, radius)));
+
+  // Points on the arc: from its center, we start in direction of the
+  // corner and rotate towards the direction of the incoming leg.
+  double center[3], to_start[3];
+  double bisector[3], bisector_len = 0;
+  for (int i = 0; i < 3; ++i) {
+    bisector[i] = out[i] - in[i];
+    bisector_len += bisector[i] * bisector[i];
+  }
+  bisector_len = std::sqrt(bisector_len);
+  for (int i = 0; i < 3; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+    center[i] = c[a] + bisector[i] / bisector_len
+      * radius / std::sin(half_theta);
+    to_start[i] = (arc_start[a] - center[i]) / radius;
+  }
+  const int chords = (int) std::ceil(turn / kMaxBlendChordTurn);
+  for (int k = 1; k < chords; ++k) {
+    const double phi = turn * k / chords;
+    AxesRegister pos;
+    for (const GCodeParserAxis a : AllAxes()) {
+      pos[a] = arc_start[a] + (arc_end[a] - arc_start[a]) * k / chords;
+    }
+    for (int i = 0; i < 3; ++i) {
+      const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+      pos[a] = center[i] + radius * (std::cos(phi) * to_start[i]
+                                     + std::sin(phi) * in[i]);
+    }
+    if (!machine_move(pos, feedrate, corner.aux_bits))
+      return false;
+  }
+  return machine_move(arc_end, feedrate, corner.aux_bits);
+}
+
+template <typename real>
+bool PlannerBase<real>::Impl::EnqueueBatch(const PlannerTarget *targets,
+                                           int count) {
+  const HardwareMapping::AuxBitmap aux_bits = hardware_mapping_->GetAuxBits();
+  PlannerRequest requests[kMaxSubmitChunk];
+  for (int start = 0; start < count; start += kMaxSubmitChunk) {
+    const int chunk = std::min(count - start, kMaxSubmitChunk);
+    for (int i = 0; i < chunk; ++i) {
+      const PlannerTarget &target = targets[start + i];
+      if (trace_) {
+        PlannerTraceRecord record;
+        record.type = PlannerTraceRecord::TARGET;
+        record.target = target.position;
+        record.feedrate = target.speed;
+        record.curve_radius = target.curve_radius;
+        record.aux_bits = aux_bits;
+        trace_->Write(record);
+      }
+      PlannerRequest &request = requests[i];
+      request.type = PlannerRequest::MOVE;
+      request.target = target.position;
+      request.feedrate = target.speed;
+      request.curve_radius = target.curve_radius;
+      request.aux_bits = aux_bits;
+      request.blend_tolerance = path_blending_;
+    }
+
+    if (!planner_thread_) {
+      for (int i = 0; i < chunk; ++i) {
+        if (!path_move(requests[i])) return false;
+      }
+      continue;
+    }
+
+    if (aborted_) {
+      // The planner thread drops everything that is still in the queue. Once
+      // it is done with that, we report the abort and start afresh.
+      wait_planner_thread_idle();
+      aborted_ = false;
+      return false;
+    }
+    submit_requests(requests, chunk);
+  }
+  return true;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::trace_halt() {
+  if (!trace_) return;
+  PlannerTraceRecord record;
+  record.type = PlannerTraceRecord::HALT;
+  record.aux_bits = hardware_mapping_->GetAuxBits();
+  trace_->Write(record);
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::BringPathToHalt() {
+  trace_halt();
+  if (planner_thread_) {
+    // Once the planner thread is idle, we can safely access its state from
+    // this thread.
+    wait_planner_thread_idle();
+  }
+  bring_path_to_halt(hardware_mapping_->GetAuxBits());
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::RequestPathHalt() {
+  trace_halt();
+  if (!planner_thread_) {
+    bring_path_to_halt(hardware_mapping_->GetAuxBits());
+    return;
+  }
+  PlannerRequest request;
+  request.type = PlannerRequest::HALT;
+  request.aux_bits = hardware_mapping_->GetAuxBits();
+  submit_request(request);
+}
+
+template <typename real>
+int PlannerBase<real>::Impl::QueueFullFd() {
+  if (room_fd_ < 0) return -1;
+  if (room_wanted_) return room_fd_;   // Planner thread did not signal yet.
+  if (requests_.size() < kRequestsHighWater) return -1;
+
+  uint64_t stale;   // From the last time; we start waiting afresh.
+  while (read(room_fd_, &stale, sizeof(stale)) > 0) {}
+  room_wanted_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // The planner thread might have gone below the low water mark before it
+  // saw that we are waiting; then it will not tell us anymore.
+  if (requests_.size() <= kRequestsLowWater) {
+    room_wanted_ = false;
+    return -1;
+  }
+  return room_fd_;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::SetPathBlending(float tolerance_mm) {
+  if (trace_) {
+    PlannerTraceRecord record;
+    record.type = PlannerTraceRecord::PATH_BLENDING;
+    record.value = tolerance_mm;
+    trace_->Write(record);
+  }
+  path_blending_ = tolerance_mm;
+}
+
+// Handing over between the caller and the planner thread. The queue itself
+// is lock-free; we only take the mutex if the other side might be asleep.
+// Each side first publishes its own state, then checks the other side's;
+// the seq_cst fences make sure that at least one of them sees the other.
+template <typename real>
+void PlannerBase<real>::Impl::submit_requests(const PlannerRequest *requests,
+                                              int count) {
+  for (int i = 0; i < count; ++i) {
+    while (!requests_.TryPush(requests[i])) {
+      wake_planner_thread();  // It might not know about the earlier ones yet.
+      std::unique_lock<std::mutex> l(mutex_);
+      caller_waiting_ = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      work_consumed_.wait(l, [this]() { return !requests_.full(); });
+      caller_waiting_ = false;
+    }
+  }
+  wake_planner_thread();
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::wake_planner_thread() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (planner_idle_) {
+    std::lock_guard<std::mutex> l(mutex_);
+    work_available_.notify_one();
+  }
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::wait_planner_thread_idle() {
+  std::unique_lock<std::mutex> l(mutex_);
+  caller_waiting_ = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  work_consumed_.wait(l, [this]() {
+      return planner_idle_ && requests_.empty();
+    });
+  caller_waiting_ = false;
+}
+
+template <typename real>
+void PlannerBase<real>::Impl::planner_thread_loop() {
+  PlannerRequest request;
+  for (;;) {
+    if (requests_.TryPop(&request)) {
+      if (aborted_) {
+        // Drop everything until the caller picked up the abort.
+      } else if (request.type == PlannerRequest::MOVE) {
+        if (!path_move(request))
+          aborted_ = true;
+      } else {
+        bring_path_to_halt(request.aux_bits);
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (caller_waiting_) {
+        std::lock_guard<std::mutex> l(mutex_);
+        work_consumed_.notify_one();
+      }
+      if (room_wanted_ && requests_.size() <= kRequestsLowWater
+          && room_wanted_.exchange(false)) {
+        const uint64_t one = 1;
+        if (write(room_fd_, &one, sizeof(one)) < 0) {
+          Log_error("Can't wake up caller: %s", strerror(errno));
+        }
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    planner_idle_ = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    work_consumed_.notify_one();
+    work_available_.wait(l, [this]() {
+        return shutdown_ || !requests_.empty();
+      });
+    planner_idle_ = false;
+    if (shutdown_ && requests_.empty())
+      return;
   }
 }
 
 // -- public interface
 
-Planner::Planner(const MachineControlConfig *config,
-                 HardwareMapping *hardware_mapping,
-                 MotorOperations *motor_backend)
+template <typename real>
+PlannerBase<real>::PlannerBase(const MachineControlConfig *config,
+                               HardwareMapping *hardware_mapping,
+                               MotorOperations *motor_backend)
   : impl_(new Impl(config, hardware_mapping, motor_backend)) {
 }
 
-Planner::~Planner() { delete impl_; }
+template <typename real>
+PlannerBase<real>::~PlannerBase() { delete impl_; }
+
+template <typename real>
+bool PlannerBase<real>::Enqueue(const AxesRegister &target_pos, float speed,
+                                float curve_radius) {
+  const PlannerTarget target = { target_pos, speed, curve_radius };
+  return impl_->EnqueueBatch(&target, 1);
+}
+
+template <typename real>
+bool PlannerBase<real>::EnqueueBatch(const PlannerTarget *targets, int count) {
+  return impl_->EnqueueBatch(targets, count);
+}
 
-bool Planner::Enqueue(const AxesRegister &target_pos, float speed) {
-  return impl_->machine_move(target_pos, speed);
+template <typename real>
+void PlannerBase<real>::BringPathToHalt() {
+  impl_->BringPathToHalt();
 }
 
-void Planner::BringPathToHalt() {
-  impl_->bring_path_to_halt();
+template <typename real>
+void PlannerBase<real>::RequestPathHalt() {
+  impl_->RequestPathHalt();
 }
 
-void Planner::GetCurrentPosition(AxesRegister *pos) {
+template <typename real>
+int PlannerBase<real>::QueueFullFd() {
+  return impl_->QueueFullFd();
+}
+
+template <typename real>
+void PlannerBase<real>::SetPathBlending(float tolerance_mm) {
+  impl_->SetPathBlending(tolerance_mm);
+}
+
+template <typename real>
+void PlannerBase<real>::GetCurrentPosition(AxesRegister *pos) {
   impl_->GetCurrentPosition(pos);
 }
 
-int Planner::DirectDrive(GCodeParserAxis axis, float distance,
-                          float v0, float v1) {
+template <typename real>
+int PlannerBase<real>::DirectDrive(GCodeParserAxis axis, float distance,
+                                   float v0, float v1) {
   return impl_->DirectDrive(axis, distance, v0, v1);
 }
 
-void Planner::SetExternalPosition(GCodeParserAxis axis, float pos) {
+template <typename real>
+bool PlannerBase<real>::DirectDriveToEndstop(GCodeParserAxis axis,
+                                             float distance,
+                                             float v0, float v1,
+                                             const EndstopSwitch &endstop,
+                                             int *steps, bool *triggered) {
+  return impl_->DirectDriveToEndstop(axis, distance, v0, v1, endstop,
+                                     steps, triggered);
+}
+
+template <typename real>
+void PlannerBase<real>::SetExternalPosition(GCodeParserAxis axis, float pos) {
   impl_->SetExternalPosition(axis, pos);
 }
+
+template <typename real>
+void PlannerBase<real>::GetStats(PlannerStats *stats) {
+  impl_->GetStats(stats);
+}
+
+template class PlannerBase<float>;
+template class PlannerBase<double>;
@@ -19,32 +19,113 @@
 #ifndef _BEAGLEG_PLANNER_H_
 #define _BEAGLEG_PLANNER_H_
 
+#include <stdint.h>
+
 #include "gcode-parser/gcode-parser.h"  // AxesRegister
 
 struct MachineControlConfig;
 class HardwareMapping;
 class MotorOperations;
+struct EndstopSwitch;
+
+// Upper limit of targets the planner can hold back to look ahead.
+enum { PLANNER_MAX_LOOKAHEAD = 512 };
+
+// Counters of what the planner did, to see where speed is lost, e.g. to
+// tune junction-deviation-mm or the lookahead.
+struct PlannerStats {
+  PlannerStats();
+
+  int64_t targets;              // Targets enqueued ...
+  int64_t merged_targets;       // ... of which merged into the previous one.
+
+  // Segments sent to the motors, by type.
+  int64_t accel_segments;
+  int64_t travel_segments;
+  int64_t decel_segments;
+
+  // Junctions between moves at which we have to come to a full stop,
+  // by reason.
+  int64_t stops_path_start;     // First move after the path was halted.
+  int64_t stops_reversal;       // Going back on the same line.
+  int64_t stops_non_euclidian;  // A move without X, Y or Z (e.g. only E).
+  int64_t stops_corner;         // Any corner if junction deviation is zero.
+
+  // Moves that had to be sent to the motors before the planner knew
+  // how fast they could exit; with a longer lookahead, they would be faster.
+  int64_t lookahead_limited;
+
+  // Time the moves would take at their requested feedrate (clamped to the
+  // axis limits), and the time they take as planned with acceleration.
+  // requested_seconds / planned_seconds is the fraction of the requested
+  // feedrate we achieve.
+  double requested_seconds;
+  double planned_seconds;
+};
+
+// A target position with the parameters of PlannerBase::Enqueue(), to hand
+// over many targets at once with PlannerBase::EnqueueBatch().
+struct PlannerTarget {
+  AxesRegister position;
+  float speed;
+  float curve_radius;
+};
 
 // The planner receives a sequence of desired target positions.
 // It then plans acceleration and speed profile for the physical
 // machine, and emits these to the MotorOperations backend.
-class Planner {
+//
+// With MachineControlConfig::threaded_planner, planning and emitting happens
+// in a separate thread, so that a caller is not blocked while the motor queue
+// is full. The Planner must then still only be called from one thread.
+//
+// The template parameter is the floating point type used for the planning
+// math; use the Planner typedef below.
+template <typename real>
+class PlannerBase {
 public:
   // The planner writes out motor operations to the backend.
-  Planner(const MachineControlConfig *config,
-          HardwareMapping *hardware_mapping,
-          MotorOperations *motor_backend);
-  ~Planner();
+  PlannerBase(const MachineControlConfig *config,
+              HardwareMapping *hardware_mapping,
+              MotorOperations *motor_backend);
+  ~PlannerBase();
 
   // Enqueue a new target position to go to in a linear movement from
   // the current position.
+  // If the move is a piece of a curve, "curve_radius" is its radius of
+  // curvature in mm; the speed is then limited to what the centripetal
+  // acceleration allows, sqrt(acceleration * radius). 0: no curve.
   // Returns true if successful, false if aborted
-  bool Enqueue(const AxesRegister &target_pos, float speed);
+  bool Enqueue(const AxesRegister &target_pos, float speed,
+               float curve_radius = 0);
+
+  // Enqueue "count" targets in this order, like calling Enqueue() for each
+  // of them, but with less overhead of handing over to the planner thread.
+  // Returns true if successful, false if aborted.
+  bool EnqueueBatch(const PlannerTarget *targets, int count);
 
   // Flush the queue and wait until all remaining motor
   // operations have been flushed.
   void BringPathToHalt();
 
+  // Like BringPathToHalt(), but if the planner runs in its own thread, only
+  // schedule the halt after the already enqueued targets and return
+  // immediately. Use this where nothing depends on the path being halted,
+  // e.g. if there is just no more input for a while.
+  void RequestPathHalt();
+
+  // If the planner runs in its own thread and has a lot of targets queued up
+  // that it did not get to yet, returns a file descriptor that becomes
+  // readable once there is room again. Callers that must not block, such as
+  // an event loop, can then hold off enqueueing until that happens.
+  // Returns -1 if there is enough room to go ahead.
+  int QueueFullFd();
+
+  // Set the tolerance in mm within which corners of the path of following
+  // Enqueue()d targets can be rounded to keep up speed. 0 (the default):
+  // follow the path exactly.
+  void SetPathBlending(float tolerance_mm);
+
   // Get the latest position enqueued to the motors.
   // TODO(Leonardo): get actual position of the motor at this moment.
   void GetCurrentPosition(AxesRegister *pos);
@@ -60,13 +141,41 @@ public:
   // Returns the number of steps the stepmotor for that axis did.
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
 
+  // Like DirectDrive(), but the motion hardware watches the "endstop" and
+  // stops right away once it triggers, decelerating with the acceleration
+  // of the axis. No round trips to the host while moving.
+  // Long moves might end short of "distance" without trigger; just call
+  // again. The number of steps the axis actually did is stored in "steps",
+  // whether the endstop triggered in "triggered".
+  // Returns false if the hardware can't watch endstops or was aborted.
+  bool DirectDriveToEndstop(GCodeParserAxis axis, float distance,
+                            float v0, float v1, const EndstopSwitch &endstop,
+                            int *steps, bool *triggered);
+
   // Set the current absolute position of the given axis from an
   // machine move outside of the control of the Planner.
   // Precondition: BringPathToHalt() had been called before.
   void SetExternalPosition(GCodeParserAxis axis, float pos);
 
+  // Get the counters accumulated since start. Can be called while the
+  // planner thread is running.
+  void GetStats(PlannerStats *stats);
+
 private:
   class Impl;
   Impl *const impl_;
 };
+
+// Instantiated in planner.cc
+extern template class PlannerBase<float>;
+extern template class PlannerBase<double>;
+
+// Single precision is considerably faster on the BeagleBone's VFP, double
+// precision is the reference. Choose with -DBEAGLEG_PLANNER_SINGLE_PRECISION
+#ifdef BEAGLEG_PLANNER_SINGLE_PRECISION
+typedef PlannerBase<float> Planner;
+#else
+typedef PlannerBase<double> Planner;
+#endif
+
 #endif
@@ -0,0 +1,259 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmark of the host side of the motion pipeline:
+// Planner::Enqueue() -> MotionQueueMotorOperations -> MotionQueue, and of
+// MotionQueueMotorOperations alone on dense acceleration segments.
+// Synthetic paths are sent through a DummyMotionQueue, so only the CPU time
+// on the host is measured. Run on the target hardware to get useful numbers,
+// and compare between commits.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/logging.h"
+
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "planner.h"
+
+static int64_t now_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+namespace {
+// Time spent in a stage of the pipeline. Time is inclusive of the stages
+// further down.
+struct StageStats {
+  StageStats() : calls(0), nanos(0) {}
+  int64_t calls;
+  int64_t nanos;
+};
+
+class TimingMotionQueue : public MotionQueue {
+public:
+  TimingMotionQueue(MotionQueue *delegate, StageStats *stats)
+    : delegate_(delegate), stats_(stats) {}
+
+  bool Enqueue(MotionSegment *segment) final {
+    const int64_t start = now_nanos();
+    const bool result = delegate_->Enqueue(segment);
+    stats_->nanos += now_nanos() - start;
+    stats_->calls++;
+    return result;
+  }
+  void WaitQueueEmpty() final { delegate_->WaitQueueEmpty(); }
+  void MotorEnable(bool on) final { delegate_->MotorEnable(on); }
+  void Shutdown(bool flush_queue) final { delegate_->Shutdown(flush_queue); }
+  void SetSpeedFactor(float factor, float ramp_seconds) final {
+    delegate_->SetSpeedFactor(factor, ramp_seconds);
+  }
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    return delegate_->GetPendingElements(head_item_progress);
+  }
+  void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left) final {
+    delegate_->GetExecutingSegment(segment, loops_left);
+  }
+
+private:
+  MotionQueue *const delegate_;
+  StageStats *const stats_;
+};
+
+class TimingMotorOperations : public MotorOperations {
+public:
+  TimingMotorOperations(MotorOperations *delegate, StageStats *stats)
+    : delegate_(delegate), stats_(stats) {}
+
+  bool Enqueue(const LinearSegmentSteps &segment) final {
+    const int64_t start = now_nanos();
+    const bool result = delegate_->Enqueue(segment);
+    stats_->nanos += now_nanos() - start;
+    stats_->calls++;
+    return result;
+  }
+  bool EnqueueMany(const LinearSegmentSteps *segments, int count) final {
+    const int64_t start = now_nanos();
+    const bool result = delegate_->EnqueueMany(segments, count);
+    stats_->nanos += now_nanos() - start;
+    stats_->calls += count;
+    return result;
+  }
+  void MotorEnable(bool on) final { delegate_->MotorEnable(on); }
+  void WaitQueueEmpty() final { delegate_->WaitQueueEmpty(); }
+  bool GetPhysicalStatus(PhysicalStatus *status) final {
+    return delegate_->GetPhysicalStatus(status);
+  }
+  void SetExternalPosition(int axis, int steps) final {
+    delegate_->SetExternalPosition(axis, steps);
+  }
+  void SetSpeedFactor(float factor, float ramp_seconds) final {
+    delegate_->SetSpeedFactor(factor, ramp_seconds);
+  }
+
+private:
+  MotorOperations *const delegate_;
+  StageStats *const stats_;
+};
+
+// Generates the next target of a synthetic path. Returns feedrate in mm/s.
+typedef float (*PathGenerator)(int i, AxesRegister *pos);
+
+// Long straight moves around a 50mm square.
+float SquarePath(int i, AxesRegister *pos) {
+  (*pos)[AXIS_X] = ((i + 1) % 4 < 2) ? 50 : 0;
+  (*pos)[AXIS_Y] = (i % 4 < 2) ? 50 : 0;
+  return 100;
+}
+
+// Circle with radius 20mm made of 0.1mm chords, as CAM output would have.
+float ArcPath(int i, AxesRegister *pos) {
+  const float radius = 20;
+  const float angle = i * 0.1 / radius;
+  (*pos)[AXIS_X] = radius * cosf(angle);
+  (*pos)[AXIS_Y] = radius * sinf(angle);
+  return 50;
+}
+
+// Zig-zag infill: 10mm lines, 0.5mm apart.
+float ZigZagPath(int i, AxesRegister *pos) {
+  (*pos)[AXIS_X] = (i % 2) ? 10 : 0;
+  (*pos)[AXIS_Y] = 0.5 * ((i + 1) / 2 % 100);
+  return 80;
+}
+
+// Configuration of a typical small machine.
+void InitBenchConfig(MachineControlConfig *config) {
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+    config->steps_per_mm[axis] = 160;
+    config->max_feedrate[axis] = 200;
+    config->acceleration[axis] = 1000;
+  }
+  config->require_homing = false;
+}
+}  // namespace
+
+static void RunBenchmark(const char *name, PathGenerator path,
+                         const MachineControlConfig &config, int targets) {
+  HardwareMapping hardware;
+  hardware.AddMotorMapping(AXIS_X, 1, false);
+  hardware.AddMotorMapping(AXIS_Y, 2, false);
+  hardware.AddMotorMapping(AXIS_Z, 3, false);
+
+  StageStats motor_ops_stats, backend_stats;
+  DummyMotionQueue dummy_queue;
+  TimingMotionQueue backend(&dummy_queue, &backend_stats);
+  MotionQueueMotorOperations queue_motor_ops(&hardware, &backend);
+  TimingMotorOperations motor_ops(&queue_motor_ops, &motor_ops_stats);
+  Planner planner(&config, &hardware, &motor_ops);
+
+  AxesRegister pos;
+  const int64_t start = now_nanos();
+  for (int i = 0; i < targets; ++i) {
+    const float feedrate = path(i, &pos);
+    planner.Enqueue(pos, feedrate);
+  }
+  planner.BringPathToHalt();
+  const int64_t total_nanos = now_nanos() - start;
+
+  const double seconds = total_nanos / 1e9;
+  printf("%-8s %8d %11.0f %11.0f %9.0f %9.0f %9.0f\n", name, targets,
+         targets / seconds, backend_stats.calls / seconds,
+         1.0 * (total_nanos - motor_ops_stats.nanos) / targets,
+         1.0 * (motor_ops_stats.nanos - backend_stats.nanos) / targets,
+         1.0 * backend_stats.nanos / targets);
+}
+
+// Only MotionQueueMotorOperations: accelerating and decelerating segments
+// as the planner emits them on short moves, plus long moves that are split.
+static void RunSegmentBenchmark(const char *name, bool long_moves,
+                                int segments) {
+  HardwareMapping hardware;
+  DummyMotionQueue backend;
+  MotionQueueMotorOperations motor_ops(&hardware, &backend);
+
+  LinearSegmentSteps segment = {};
+  const int64_t start = now_nanos();
+  for (int i = 0; i < segments; ++i) {
+    const float v = 1000 + (i % 50) * 400;   // steps/s
+    const int steps = long_moves ? 100000 : 20 + i % 30;
+    const bool accel = i % 2 == 0;
+    segment.v0 = accel ? v - 300 : v;
+    segment.v1 = accel ? v : v - 300;
+    segment.steps[0] = steps;
+    segment.steps[1] = steps / 3;
+    motor_ops.Enqueue(segment);
+  }
+  const int64_t total_nanos = now_nanos() - start;
+  printf("%-8s %8d %9.0f\n", name, segments, 1.0 * total_nanos / segments);
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n"
+          "\t-n <targets>   : Number of targets per path (default 100000)\n"
+          "\t-l <lookahead> : Planner lookahead (default from config)\n"
+          "\t-t             : Run planner in its own thread (stages overlap).\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  MachineControlConfig config;
+  InitBenchConfig(&config);
+  int targets = 100000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:t")) != -1) {
+    switch (opt) {
+    case 'n': targets = atoi(optarg); break;
+    case 'l': config.lookahead = atoi(optarg); break;
+    case 't': config.threaded_planner = true; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (targets <= 0
+      || config.lookahead < 1 || config.lookahead > PLANNER_MAX_LOOKAHEAD) {
+    return usage(argv[0]);
+  }
+
+  Log_init("/dev/null");
+
+  // Per-target time is split into the stages: planner, motor operations
+  // (conversion into MotionSegments), queue backend (Dummy: only overhead).
+  printf("%-8s %8s %11s %11s %9s %9s %9s\n", "path", "targets",
+         "targets/s", "segments/s", "ns:plan", "ns:m-ops", "ns:queue");
+  RunBenchmark("lines", SquarePath, config, targets);
+  RunBenchmark("arcs", ArcPath, config, targets);
+  RunBenchmark("zigzag", ZigZagPath, config, targets);
+
+  // Time to convert a LinearSegmentSteps into MotionSegments.
+  printf("\n%-8s %8s %9s\n", "segment", "segments", "ns:m-ops");
+  RunSegmentBenchmark("accel", false, targets);
+  RunSegmentBenchmark("split", true, targets / 10);
+  return 0;
+}
@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <gtest/gtest.h>
 
@@ -14,6 +18,8 @@
 #include "gcode-machine-control.h"
 #include "hardware-mapping.h"
 #include "motor-operations.h"
+#include "planner-trace.h"
+#include "delta-kinematics.h"
 
 // Using different steps/mm speeds results in problems right now.
 // TODO: This should work being set to 1
@@ -31,8 +37,6 @@ static void InitTestConfig(struct MachineControlConfig *c) {
     c->acceleration[axis] = 100;  // mm/s^2
     c->max_feedrate[axis] = 10000;
   }
-  c->threshold_angle = 0;
-  c->speed_tune_angle = 0;
   c->require_homing = false;
 }
 
@@ -87,6 +91,7 @@ public:
   void WaitQueueEmpty() final {}
   bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
   void SetExternalPosition(int axis, int steps) final {}
+  void SetSpeedFactor(float factor, float ramp_seconds) final {}
 
   const std::vector<LinearSegmentSteps> &segments() { return collected_; }
 
@@ -126,34 +131,55 @@ private:
   std::vector<LinearSegmentSteps> collected_;
 };
 
-class PlannerHarness {
+template <typename PlannerType>
+class PlannerHarnessBase {
 public:
-  // If angle or config is not set, assumes default. Takes ownership of
-  // config.
-  PlannerHarness(float threshold_angle = 0,
-                 float speed_tune_angle = 0,
-                 MachineControlConfig *config = NULL)
+  // If junction deviation or config is not set, assumes default. Takes
+  // ownership of config.
+  PlannerHarnessBase(float junction_deviation = 0.01,
+                     MachineControlConfig *config = NULL,
+                     HardwareMapping::Kinematics kinematics
+                     = HardwareMapping::Kinematics::CARTESIAN)
     : config_(config ? config : new MachineControlConfig()),
       motor_ops_(*config_), finished_(false) {
     if (!config) {
       InitTestConfig(config_);
-      config_->threshold_angle = threshold_angle;
-      config_->speed_tune_angle = speed_tune_angle;
+      config_->junction_deviation = junction_deviation;
     }
     simulated_hardware_.AddMotorMapping(AXIS_X, 1, false);
     simulated_hardware_.AddMotorMapping(AXIS_Y, 2, false);
     simulated_hardware_.AddMotorMapping(AXIS_Z, 3, false);
-    planner_ = new Planner(config_, &simulated_hardware_, &motor_ops_);
+    simulated_hardware_.AddMotorMapping(AXIS_E, 4, false);
+    simulated_hardware_.SetKinematics(kinematics);
+    planner_ = new PlannerType(config_, &simulated_hardware_, &motor_ops_);
   }
-  ~PlannerHarness() {
+  ~PlannerHarnessBase() {
     delete planner_;
     delete config_;
   }
 
-  void Enqueue(const AxesRegister &target, float feed) {
+  void Enqueue(const AxesRegister &target, float feed,
+               float curve_radius = 0) {
     assert(!finished_);   // Can only call if segments() has not been called.
     //fprintf(stderr, "NewPos: (%.1f, %.1f)\n", target[AXIS_X], target[AXIS_Y]);
-    planner_->Enqueue(target, feed);
+    planner_->Enqueue(target, feed, curve_radius);
+  }
+
+  void EnqueueBatch(const std::vector<PlannerTarget> &targets) {
+    assert(!finished_);
+    planner_->EnqueueBatch(targets.data(), targets.size());
+  }
+
+  void RequestPathHalt() { planner_->RequestPathHalt(); }
+  int QueueFullFd() { return planner_->QueueFullFd(); }
+  void SetPathBlending(float tolerance) {
+    planner_->SetPathBlending(tolerance);
+  }
+
+  PlannerStats stats() {
+    PlannerStats result;
+    planner_->GetStats(&result);
+    return result;
   }
 
   const std::vector<LinearSegmentSteps> &segments() {
@@ -169,8 +195,33 @@ private:
   FakeMotorOperations motor_ops_;
   HardwareMapping simulated_hardware_;
   bool finished_;
-  Planner *planner_;
+  PlannerType *planner_;
 };
+typedef PlannerHarnessBase<Planner> PlannerHarness;
+
+// Factor from the speed in steps/s of the axis with the most steps in
+// "segment" to mm/s in euclidian space, with the steps/mm of
+// InitTestConfig(). The steps of each segment are rounded, so the direction
+// is only that exact; the relative error is returned in "uncertainty".
+static float EuclidFactor(const LinearSegmentSteps &segment,
+                          float *uncertainty) {
+  MachineControlConfig config;
+  InitTestConfig(&config);
+  int defining_steps = 0;
+  int fewest_steps = 0;
+  float len = 0;
+  for (int i = 0; i <= AXIS_Z; ++i) {
+    const GCodeParserAxis axis = (GCodeParserAxis) i;
+    const float d = segment.steps[i] / config.steps_per_mm[axis];
+    len += d * d;
+    defining_steps = std::max(defining_steps, abs(segment.steps[i]));
+    if (segment.steps[i] != 0 &&
+        (fewest_steps == 0 || abs(segment.steps[i]) < fewest_steps))
+      fewest_steps = abs(segment.steps[i]);
+  }
+  *uncertainty = fewest_steps > 0 ? 1.0f / fewest_steps : 0;
+  return defining_steps > 0 ? sqrtf(len) / defining_steps : 1;
+}
 
 // Conditions that we expect in all moves.
 static void VerifyCommonExpectations(
@@ -184,13 +235,16 @@ static void VerifyCommonExpectations(
   EXPECT_EQ(0, segments[0].v0);
   EXPECT_EQ(0, segments[segments.size()-1].v1);
 
-  // The joining speeds between segments match.
+  // The joining speeds between segments match. Segments can have different
+  // defining axes, so we compare the speed in euclidian space.
   for (size_t i = 0; i < segments.size()-1; ++i) {
-    // Let's determine the speed in euclidian space.
-#if 1
-    EXPECT_EQ(segments[i].v1, segments[i+1].v0)
+    float uncertainty_v1, uncertainty_v0;
+    const float v1 = segments[i].v1 * EuclidFactor(segments[i], &uncertainty_v1);
+    const float v0 = segments[i+1].v0 * EuclidFactor(segments[i+1],
+                                                     &uncertainty_v0);
+    EXPECT_NEAR(v1, v0, (0.01 + uncertainty_v1 + uncertainty_v0)
+                * std::max(v1, v0) + 1e-3)
       << "Joining speed between " << i << " and " << (i+1);
-#endif
   }
 }
 
@@ -223,6 +277,137 @@ TEST(PlannerTest, SimpleMove_ReachesFullSpeed) {
   VerifyCommonExpectations(plantest.segments());
 }
 
+// With a jerk limit, acceleration is ramped in and out: we get more segments
+// with smoothly changing acceleration, but the start and end speeds stay the
+// same.
+TEST(PlannerTest, SimpleMove_JerkLimitedSCurve) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  for (int i = 0; i <= AXIS_Z; ++i) {
+    config->max_jerk[(GCodeParserAxis)i] = 1000;  // mm/s^3
+  }
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 10);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+  ASSERT_GT((int)segments.size(), 3);
+
+  // Acceleration of each segment; X is our only and defining axis.
+  std::vector<double> accel;
+  int total_steps = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    ASSERT_GT(s.steps[0], 0);
+    total_steps += s.steps[0];
+    accel.push_back((1.0*s.v1*s.v1 - 1.0*s.v0*s.v0) / (2.0 * s.steps[0]));
+  }
+  EXPECT_EQ(100 * 1000, total_steps);
+
+  // Acceleration is ramped in, out and then into deceleration.
+  EXPECT_GT(accel[0], 0);
+  EXPECT_LT(accel[0], accel[1]);
+  EXPECT_LT(accel[accel.size()-1], 0);
+  EXPECT_GT(accel[accel.size()-1], accel[accel.size()-2]);
+
+  // The ramps take extra time, the peak stays within the acceleration limit.
+  const double max_accel = 100 * 1000;  // steps/s^2
+  for (size_t i = 0; i < accel.size(); ++i) {
+    EXPECT_LE(std::fabs(accel[i]), 1.001 * max_accel) << "Segment " << i;
+  }
+}
+
+// Jerk limits of all participating axes apply, not only the one of the
+// defining axis.
+TEST(PlannerTest, JerkLimitedByParticipatingAxes) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->max_jerk[AXIS_Y] = 1000;  // mm/s^3; X, the defining axis, has none.
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 10);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+  // Accelerating and decelerating in pieces, not just accel/travel/decel.
+  EXPECT_GT((int)segments.size(), 3);
+}
+
+// Acceleration in mm/s^2 of the given motor within the segment.
+static double SegmentAccelMM(const LinearSegmentSteps &s, int defining_motor,
+                             int motor, float steps_per_mm) {
+  const double defining_accel
+    = (1.0*s.v1*s.v1 - 1.0*s.v0*s.v0) / (2.0 * abs(s.steps[defining_motor]));
+  const double fraction = 1.0 * s.steps[motor] / s.steps[defining_motor];
+  return defining_accel * fraction / steps_per_mm;
+}
+
+// A slow accelerating Z-axis should not slow down XY moves, but needs to
+// limit the acceleration of moves it participates in.
+TEST(PlannerTest, AccelerationLimitedByParticipatingAxes) {
+  const float kSlowZAccel = 1.0;  // mm/s^2
+  {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->acceleration[AXIS_Z] = kSlowZAccel;
+    PlannerHarness plantest(0, config);
+    AxesRegister pos;
+    pos[AXIS_X] = 10;
+    pos[AXIS_Y] = 1;
+    plantest.Enqueue(pos, 10);
+    const LinearSegmentSteps &accel = plantest.segments()[0];
+    // X is the defining axis; it gets its full acceleration.
+    EXPECT_NEAR(100.0, SegmentAccelMM(accel, 0, 0, 1000), 1.0);
+  }
+
+  {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->acceleration[AXIS_Z] = kSlowZAccel;
+    PlannerHarness plantest(0, config);
+    AxesRegister pos;
+    pos[AXIS_X] = 10;
+    pos[AXIS_Z] = 0.5;
+    plantest.Enqueue(pos, 10);
+    const LinearSegmentSteps &accel = plantest.segments()[0];
+    // Z participates, and should now accelerate as fast as it can, but not
+    // faster.
+    EXPECT_NEAR(kSlowZAccel, SegmentAccelMM(accel, 0, 2, 16000), 0.01);
+    EXPECT_LT(SegmentAccelMM(accel, 0, 0, 1000), 100.0);
+  }
+}
+
+// Many tiny segments in a straight line, as they are typically emitted by
+// CAM programs. With enough lookahead, we should never slow down in between,
+// but reach the programmed feed.
+TEST(PlannerTest, ManySmallSegments_ReachFullSpeed) {
+  PlannerHarness plantest;
+
+  const float kFeedrate = 10;        // mm/s. Reached after 0.5mm.
+  AxesRegister pos;
+  for (int i = 1; i <= 400; ++i) {
+    pos[AXIS_X] = i * 0.05;
+    plantest.Enqueue(pos, kFeedrate);
+  }
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+
+  float max_speed = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    if (i > 0) {
+      EXPECT_GT(segments[i].v0, 0) << "Unexpected stop at segment " << i;
+    }
+    if (segments[i].v1 > max_speed) max_speed = segments[i].v1;
+  }
+  EXPECT_FLOAT_EQ(kFeedrate * 1000, max_speed);
+}
+
 // When we move axes, they should try to reach the speed the user requested
 // unless there is maximum speed an axis can do (very typical in CNC machines
 // in which the Z axis is much slower than X or Y).
@@ -266,7 +451,7 @@ static void parametrizedAxisClamping(GCodeParserAxis defining_axis,
   config->steps_per_mm[AXIS_Y] = 1000;
   config->steps_per_mm[defining_axis] *= 12.345;
 
-  PlannerHarness plantest(0, 0, config);
+  PlannerHarness plantest(0, config);
 
   // Let's do a diagonal move.
   // First: AXIS_X shall be dominant
@@ -316,16 +501,15 @@ TEST(PlannerTest, SimpleMove_AxisSpeedLimitClampsOverallSpeed_YY) {
   parametrizedAxisClamping(AXIS_Y, AXIS_Y);
 }
 
-static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
-                                                   float speed_tune_angle,
+static std::vector<LinearSegmentSteps> DoAngleMove(float junction_deviation,
                                                    float start_angle,
                                                    float delta_angle) {
   const float kFeedrate = 3000.0f;  // Never reached. We go from accel to decel.
 #if 0
-  fprintf(stderr, "DoAngleMove(%.1f, %.1f, %.1f)\n",
-          threshold_angle, start_angle, delta_angle);
+  fprintf(stderr, "DoAngleMove(%.3f, %.1f, %.1f)\n",
+          junction_deviation, start_angle, delta_angle);
 #endif
-  PlannerHarness plantest(threshold_angle, speed_tune_angle);
+  PlannerHarness plantest(junction_deviation);
   const float kSegmentLen = 100;
 
   float radangle = 2 * M_PI * start_angle / 360;
@@ -344,31 +528,89 @@ static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
 }
 
 TEST(PlannerTest, CornerMove_90Degrees) {
-  const float kThresholdAngle = 5.0f;
-  const float kSpeedTuneAngle = 0.0f;
-  std::vector<LinearSegmentSteps> segments =
-    DoAngleMove(kThresholdAngle, kSpeedTuneAngle, 0, 90);
+  std::vector<LinearSegmentSteps> segments = DoAngleMove(0.01, 0, 90);
   ASSERT_EQ(4, (int)segments.size());
 
-  // This is a 90 degree move, we expect to slow down all the way to zero
-  // in the elbow.
+  // This is a 90 degree move. We need to slow down considerably, but
+  // don't have to come to a full stop in the elbow.
+  EXPECT_GT(segments[1].v1, 0);
+  EXPECT_LT(segments[1].v1, 0.1 * segments[0].v1);
+}
+
+// Going around a corner from X to Y, each with different steps/mm. The
+// joining speed is the same in mm/s on both sides of the corner, and within
+// what the junction deviation allows.
+TEST(PlannerTest, CornerMove_DifferentStepsPerMm) {
+  MachineControlConfig config;
+  InitTestConfig(&config);
+  ASSERT_NE(config.steps_per_mm[AXIS_X], config.steps_per_mm[AXIS_Y]);
+  const float kDeviation = 0.01;
+  std::vector<LinearSegmentSteps> segments = DoAngleMove(kDeviation, 0, 90);
+  ASSERT_EQ(4, (int)segments.size());
+  ASSERT_EQ(0, segments[1].steps[AXIS_Y]);   // X ..
+  ASSERT_EQ(0, segments[2].steps[AXIS_X]);   // .. then Y.
+
+  const float exit_speed = segments[1].v1 / config.steps_per_mm[AXIS_X];
+  const float entry_speed = segments[2].v0 / config.steps_per_mm[AXIS_Y];
+  EXPECT_NEAR(exit_speed, entry_speed, 1e-3 * exit_speed);
+
+  // Speed on a circle with 90 degrees that deviates kDeviation from the corner.
+  const float sin_half_theta = sqrtf(0.5);
+  const float radius = kDeviation * sin_half_theta / (1 - sin_half_theta);
+  const float junction_speed = sqrtf(config.acceleration[AXIS_X] * radius);
+  EXPECT_NEAR(junction_speed, exit_speed, 1e-3 * junction_speed);
+  EXPECT_NEAR(junction_speed, entry_speed, 1e-3 * junction_speed);
+}
+
+TEST(PlannerTest, CornerMove_NoJunctionDeviation) {
+  // Without allowed deviation, we have to stop in every corner.
+  std::vector<LinearSegmentSteps> segments = DoAngleMove(0, 0, 90);
+  ASSERT_EQ(4, (int)segments.size());
   EXPECT_EQ(0, segments[1].v1);
   EXPECT_EQ(segments[1].v1, segments[2].v0);
+
+  // .. but still plow through in a straight line.
+  segments = DoAngleMove(0, 30, 0);
+  for (size_t i = 0; i < segments.size() - 1; ++i) {
+    EXPECT_GT(segments[i].v1, 0);
+  }
+}
+
+TEST(PlannerTest, CornerMove_TurnAround) {
+  std::vector<LinearSegmentSteps> segments = DoAngleMove(0.01, 0, 180);
+  ASSERT_EQ(4, (int)segments.size());
+  EXPECT_EQ(0, segments[1].v1);
 }
 
-void testShallowAngleAllStartingPoints(float threshold, float testing_angle) {
-  const float kSpeedTuneAngle = 0.0f;
+TEST(PlannerTest, CornerMove_SharperCornersAreSlower) {
+  // The joining speed continuously goes down the sharper the corner is,
+  // there is no point where we suddenly have to come to a full stop.
+  float last_speed = -1;
+  for (float angle = 5; angle < 180; angle += 5) {
+    std::vector<LinearSegmentSteps> segments = DoAngleMove(0.01, 0, angle);
+    // Slowest point in the middle of our path is the corner.
+    float joining_speed = segments[0].v1;
+    for (size_t i = 1; i < segments.size() - 1; ++i) {
+      joining_speed = std::min(joining_speed, segments[i].v1);
+    }
+    EXPECT_GT(joining_speed, 0) << "At angle " << angle;
+    if (last_speed >= 0) {
+      EXPECT_LT(joining_speed, last_speed) << "At angle " << angle;
+    }
+    last_speed = joining_speed;
+  }
+}
+
+void testShallowAngleAllStartingPoints(float testing_angle) {
   // Essentially, we go around the circle as starting segments.
-  for (float angle = 0; angle < 360; angle += threshold/2) {
+  for (float angle = 0; angle < 360; angle += 2.5) {
     std::vector<LinearSegmentSteps> segments =
-      DoAngleMove(threshold, kSpeedTuneAngle, angle, testing_angle);
+      DoAngleMove(0.01, angle, testing_angle);
 
     // Depending on the two move angles we expect 2 to 4 segments.
     // 2 segments (first move euclid speed is faster than the second)
     //   1- accel of the first move to the angle
     //   2- decel of the second move
-    //      Note that the planner will output a GLITCH about the second move
-    //      being too short for full decel.
     // 3 segments (first move euclid speed is slower than the second)
     //   1- accel of the first move to the angle
     //   2- accel of the second move
@@ -393,17 +635,604 @@ void testShallowAngleAllStartingPoints(float threshold, float testing_angle) {
   }
 }
 
-// these tests don't work currently.
 TEST(PlannerTest, CornerMove_Shallow_PositiveAngle) {
-  const float kThresholdAngle = 5.0f;
-  const float kTestingAngle = 0.7 * kThresholdAngle;
-  testShallowAngleAllStartingPoints(kThresholdAngle, kTestingAngle);
+  testShallowAngleAllStartingPoints(3.5);
 }
 
 TEST(PlannerTest, CornerMove_Shallow_NegativeAngle) {
-  const float kThresholdAngle = 5.0f;
-  const float kTestingAngle = -0.7 * kThresholdAngle;
-  testShallowAngleAllStartingPoints(kThresholdAngle, kTestingAngle);
+  testShallowAngleAllStartingPoints(-3.5);
+}
+
+// Move 10mm along X, then turn 90 degrees and move 10mm along Y.
+static std::vector<LinearSegmentSteps> DoSquareCorner(float blend_tolerance) {
+  PlannerHarness plantest;
+  plantest.SetPathBlending(blend_tolerance);
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 100);
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 100);
+  return plantest.segments();
+}
+
+// Lowest speed at any joint in the path in mm/s in the XY plane. The
+// joining speed is given in steps/s of the defining axis of the next segment.
+static float SlowestJoiningSpeed(const std::vector<LinearSegmentSteps> &segs) {
+  const float x_steps_per_mm = 1000, y_steps_per_mm = 4000;
+  float slowest = -1;
+  for (size_t i = 1; i < segs.size(); ++i) {
+    const float dx = segs[i].steps[0] / x_steps_per_mm;
+    const float dy = segs[i].steps[1] / y_steps_per_mm;
+    const float defining_steps = std::max(abs(segs[i].steps[0]),
+                                          abs(segs[i].steps[1]));
+    const float v = segs[i].v0 / defining_steps * sqrtf(dx*dx + dy*dy);
+    if (slowest < 0 || v < slowest) slowest = v;
+  }
+  return slowest;
+}
+
+TEST(PlannerTest, PathBlending_RoundedCornerIsFaster) {
+  const float kTolerance = 0.5;
+  const std::vector<LinearSegmentSteps> exact = DoSquareCorner(0);
+  const std::vector<LinearSegmentSteps> blended = DoSquareCorner(kTolerance);
+  VerifyCommonExpectations(blended);
+
+  // Rounding the corner with a radius of ~1.2mm allows for much higher
+  // speed than the junction deviation of 0.01mm.
+  EXPECT_GT(SlowestJoiningSpeed(blended), 4 * SlowestJoiningSpeed(exact));
+
+  // We still end up at the same place, and the path comes as close to the
+  // corner as the tolerance allows.
+  int x = 0, y = 0;
+  float closest_to_corner = 100;
+  for (const LinearSegmentSteps &s : blended) {
+    x += s.steps[0];
+    y += s.steps[1];
+    closest_to_corner = std::min(closest_to_corner,
+                                 hypotf(x / 1000.0f - 10, y / 4000.0f));
+  }
+  EXPECT_EQ(10 * 1000, x);
+  EXPECT_EQ(10 * 4000, y);
+  // (Points of the path are on the arc, but not necessarily in its middle)
+  EXPECT_GT(closest_to_corner, kTolerance - 0.002);
+  EXPECT_LT(closest_to_corner, kTolerance + 0.02);
+}
+
+// Straight paths, and paths after switching off blending, are unchanged.
+TEST(PlannerTest, PathBlending_NoCornerNoChange) {
+  PlannerHarness exact;
+  PlannerHarness blended;
+  blended.SetPathBlending(0.5);
+  AxesRegister pos;
+  for (int i = 0; i < 10; ++i) {
+    pos[AXIS_X] += 1;
+    exact.Enqueue(pos, 100);
+    blended.Enqueue(pos, 100);
+  }
+  blended.SetPathBlending(0);
+  pos[AXIS_Y] = 10;
+  exact.Enqueue(pos, 100);
+  blended.Enqueue(pos, 100);
+
+  ASSERT_EQ(exact.segments().size(), blended.segments().size());
+  for (size_t i = 0; i < exact.segments().size(); ++i) {
+    EXPECT_EQ(exact.segments()[i].v1, blended.segments()[i].v1);
+    EXPECT_EQ(exact.segments()[i].steps[0], blended.segments()[i].steps[0]);
+  }
+}
+
+// Many tiny moves along a line, each deviating a little bit from it.
+static std::vector<LinearSegmentSteps> DoWobblyLine(float merge_tolerance,
+                                                    float wobble) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->merge_tolerance = merge_tolerance;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 200; ++i) {
+    pos[AXIS_X] = 0.1 * i;
+    pos[AXIS_Y] = 0.05 * i + ((i % 2) ? wobble : 0);
+    plantest.Enqueue(pos, 10);
+  }
+  pos[AXIS_X] = 20;   // End exactly on line.
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 10);
+  return plantest.segments();
+}
+
+TEST(PlannerTest, MergeCollinearSegments) {
+  const std::vector<LinearSegmentSteps> unmerged = DoWobblyLine(0, 0.001);
+  const std::vector<LinearSegmentSteps> merged = DoWobblyLine(0.002, 0.001);
+  VerifyCommonExpectations(merged);
+  EXPECT_GE(unmerged.size(), 200u);   // At least one segment per target.
+  // We can merge a limited number of targets at once.
+  EXPECT_LT(merged.size(), unmerged.size() / 8);
+
+  // Both end up at the same position.
+  int x = 0, y = 0;
+  for (const LinearSegmentSteps &s : merged) {
+    x += s.steps[0];
+    y += s.steps[1];
+  }
+  EXPECT_EQ(20 * 1000, x);
+  EXPECT_EQ(10 * 4000, y);
+}
+
+TEST(PlannerTest, MergeCollinearSegments_NotBeyondTolerance) {
+  const std::vector<LinearSegmentSteps> unmerged = DoWobblyLine(0, 0.01);
+  const std::vector<LinearSegmentSteps> merged = DoWobblyLine(0.002, 0.01);
+  ASSERT_EQ(unmerged.size(), merged.size());
+  for (size_t i = 0; i < unmerged.size(); ++i) {
+    EXPECT_EQ(unmerged[i].v1, merged[i].v1);
+    EXPECT_EQ(unmerged[i].steps[0], merged[i].steps[0]);
+  }
+}
+
+static std::vector<LinearSegmentSteps> DoZigZagPath(bool threaded,
+                                                    bool batched = false) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->threaded_planner = threaded;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  std::vector<PlannerTarget> batch;
+  // More targets than fit in the queue to the planner thread at once.
+  for (int i = 0; i < 1000; ++i) {
+    pos[AXIS_X] += 1;
+    pos[AXIS_Y] = (i % 2) ? 0.5 : 0;
+    if (batched) {
+      batch.push_back({ pos, 100, 0 });
+    } else {
+      plantest.Enqueue(pos, 100);
+    }
+    if (i == 500 || i == 999) {
+      plantest.EnqueueBatch(batch);
+      batch.clear();
+    }
+    if (i == 500) plantest.RequestPathHalt();
+  }
+  return plantest.segments();
+}
+
+// Running the planner in its own thread should not change what is planned.
+TEST(PlannerTest, ThreadedPlanner_SameSegmentsAsSynchronous) {
+  const std::vector<LinearSegmentSteps> expected = DoZigZagPath(false);
+  const std::vector<LinearSegmentSteps> threaded = DoZigZagPath(true);
+  VerifyCommonExpectations(threaded);
+  ASSERT_EQ(expected.size(), threaded.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i].v0, threaded[i].v0) << "Segment " << i;
+    EXPECT_EQ(expected[i].v1, threaded[i].v1) << "Segment " << i;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      EXPECT_EQ(expected[i].steps[m], threaded[i].steps[m]) << "Segment " << i;
+    }
+  }
+}
+
+// Handing over targets in batches should not change what is planned.
+TEST(PlannerTest, EnqueueBatch_SameSegmentsAsSingleTargets) {
+  const std::vector<LinearSegmentSteps> expected = DoZigZagPath(false);
+  for (const bool threaded : { false, true }) {
+    const std::vector<LinearSegmentSteps> batched
+      = DoZigZagPath(threaded, true);
+    ASSERT_EQ(expected.size(), batched.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_EQ(expected[i].v0, batched[i].v0) << "Segment " << i;
+      EXPECT_EQ(expected[i].v1, batched[i].v1) << "Segment " << i;
+      for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+        EXPECT_EQ(expected[i].steps[m], batched[i].steps[m])
+          << "Segment " << i;
+      }
+    }
+  }
+}
+
+// An event loop waits for the file descriptor instead of blocking in
+// Enqueue(); it becomes readable once the planner thread caught up.
+TEST(PlannerTest, QueueFullFd_ReadableOnceThereIsRoom) {
+  for (const bool threaded : { false, true }) {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->threaded_planner = threaded;
+    PlannerHarness plantest(0, config);
+    AxesRegister pos;
+    for (int i = 0; i < 1000; ++i) {
+      const int fd = plantest.QueueFullFd();
+      if (fd >= 0) {
+        EXPECT_TRUE(threaded);
+        struct pollfd wait_for_room = { fd, POLLIN, 0 };
+        ASSERT_EQ(1, poll(&wait_for_room, 1, 10000));
+        EXPECT_EQ(-1, plantest.QueueFullFd());
+      }
+      pos[AXIS_X] += 1;
+      pos[AXIS_Y] = (i % 2) ? 0.5 : 0;
+      plantest.Enqueue(pos, 100);
+    }
+  }
+}
+
+// A mix of long and short moves, corners and jerk limited S-curves.
+template <typename PlannerType>
+static std::vector<LinearSegmentSteps> DoMixedPath() {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->max_jerk[AXIS_X] = 1000;
+  PlannerHarnessBase<PlannerType> plantest(0.01, config);
+  AxesRegister pos;
+  for (int i = 0; i < 200; ++i) {
+    const float angle = i * 0.05;
+    pos[AXIS_X] = 20 * cosf(angle) + ((i % 50 == 0) ? 30 : 0);
+    pos[AXIS_Y] = 20 * sinf(angle);
+    pos[AXIS_Z] = (i % 10) * 0.1;
+    plantest.Enqueue(pos, (i % 3 == 0) ? 100 : 20);
+  }
+  return plantest.segments();
+}
+
+// Travel segments of a single step are left over from rounding the steps of
+// the speed changes. They come and go with tiny differences in the speeds;
+// add their step to the segment before.
+static std::vector<LinearSegmentSteps> WithoutRoundingGlitches(
+  const std::vector<LinearSegmentSteps> &segments) {
+  std::vector<LinearSegmentSteps> result;
+  for (const LinearSegmentSteps &s : segments) {
+    int max_steps = 0;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m)
+      max_steps = std::max(max_steps, abs(s.steps[m]));
+    if (max_steps > 1 || s.v0 != s.v1 || result.empty()) {
+      result.push_back(s);
+      continue;
+    }
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m)
+      result.back().steps[m] += s.steps[m];
+  }
+  return result;
+}
+
+// Planning in single precision needs to emit the same segments as the
+// double precision reference, give or take rounding to the next step.
+TEST(PlannerTest, SinglePrecision_MatchesDoublePrecision) {
+  const std::vector<LinearSegmentSteps> expected
+    = WithoutRoundingGlitches(DoMixedPath<PlannerBase<double> >());
+  const std::vector<LinearSegmentSteps> all_single
+    = DoMixedPath<PlannerBase<float> >();
+  VerifyCommonExpectations(all_single);
+  const std::vector<LinearSegmentSteps> single
+    = WithoutRoundingGlitches(all_single);
+  ASSERT_EQ(expected.size(), single.size());
+  int expected_pos[BEAGLEG_NUM_MOTORS] = {0};
+  int single_pos[BEAGLEG_NUM_MOTORS] = {0};
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(expected[i].v0, single[i].v0, 1e-3 * expected[i].v0 + 1e-3)
+      << "Segment " << i;
+    EXPECT_NEAR(expected[i].v1, single[i].v1, 1e-3 * expected[i].v1 + 1e-3)
+      << "Segment " << i;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      expected_pos[m] += expected[i].steps[m];
+      single_pos[m] += single[i].steps[m];
+      // Both the end of a speed change and a piece of its S-curve can be
+      // rounded to the other step.
+      EXPECT_NEAR(expected_pos[m], single_pos[m], 2)
+        << "Segment " << i << ", motor " << m;
+    }
+  }
+  // Targets themselves are always exact.
+  for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+    EXPECT_EQ(expected_pos[m], single_pos[m]);
+  }
+}
+
+// Going along a curve that is mostly in X direction, with some Y.
+static float MaxSpeedOnCurve(float radius,
+                             MachineControlConfig *config = NULL) {
+  PlannerHarness plantest(0.01, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 100; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    pos[AXIS_Y] = i * 0.01;
+    plantest.Enqueue(pos, 50, radius);
+  }
+  float max_speed = 0;
+  for (const LinearSegmentSteps &s : plantest.segments()) {
+    max_speed = std::max(max_speed, s.v1);
+  }
+  return max_speed / 1000;   // mm/s on X.
+}
+
+TEST(PlannerTest, CurveMove_SpeedLimitedByRadius) {
+  // With acceleration of 100mm/s^2, we can go 10mm/s around a 1mm radius
+  // and 20mm/s around 4mm.
+  EXPECT_NEAR(10, MaxSpeedOnCurve(1), 0.01);
+  EXPECT_NEAR(20, MaxSpeedOnCurve(4), 0.01);
+
+  // Larger radius: only limited by feedrate.
+  EXPECT_NEAR(50, MaxSpeedOnCurve(100), 0.01);
+  EXPECT_NEAR(50, MaxSpeedOnCurve(0), 0.01);
+}
+
+TEST(PlannerTest, CurveMove_NotLimitedByAxisNotMoving) {
+  // A slow Z does not matter for an arc in the XY plane.
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->acceleration[AXIS_Z] = 1.0;
+  EXPECT_NEAR(10, MaxSpeedOnCurve(1, config), 0.01);
+}
+
+TEST(PlannerTest, Stats_SegmentsAndStops) {
+  PlannerHarness plantest(0);   // No junction deviation: stop in corners.
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_X] = 20;    // straight on.
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_X] = 5;     // back.
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_Y] = 10;    // corner.
+  plantest.Enqueue(pos, 10);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+
+  const PlannerStats stats = plantest.stats();
+  EXPECT_EQ(4, stats.targets);
+  EXPECT_EQ(1, stats.stops_path_start);
+  EXPECT_EQ(1, stats.stops_reversal);
+  EXPECT_EQ(1, stats.stops_corner);
+  EXPECT_EQ(0, stats.stops_non_euclidian);
+  EXPECT_EQ((int64_t)segments.size(),
+            stats.accel_segments + stats.travel_segments + stats.decel_segments);
+  EXPECT_EQ(3, stats.accel_segments);
+  EXPECT_EQ(3, stats.decel_segments);
+
+  // 45mm at 10mm/s; we lose some of it accelerating.
+  EXPECT_NEAR(4.5, stats.requested_seconds, 0.01);
+  EXPECT_GT(stats.planned_seconds, stats.requested_seconds);
+}
+
+TEST(PlannerTest, Stats_LookaheadLimited) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead = 2;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 400; ++i) {
+    pos[AXIS_X] = i * 0.05;
+    plantest.Enqueue(pos, 10);
+  }
+  plantest.segments();
+  const PlannerStats stats = plantest.stats();
+  EXPECT_GT(stats.lookahead_limited, 0);
+  // Never reaching the feedrate.
+  EXPECT_LT(stats.requested_seconds / stats.planned_seconds, 0.5);
+
+  PlannerHarness deep_lookahead;
+  pos.zero();
+  for (int i = 1; i <= 400; ++i) {
+    pos[AXIS_X] = i * 0.05;
+    deep_lookahead.Enqueue(pos, 10);
+  }
+  deep_lookahead.segments();
+  EXPECT_EQ(0, deep_lookahead.stats().lookahead_limited);
+  EXPECT_GT(deep_lookahead.stats().requested_seconds
+            / deep_lookahead.stats().planned_seconds, 0.9);
+}
+
+// Motor 1 (A) is mapped to X, motor 2 (B) to Y.
+TEST(PlannerTest, CoreXY_MotorStepsAndSpeedLimits) {
+  MachineControlConfig *config = new MachineControlConfig();
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+    config->steps_per_mm[axis] = 100;
+    config->acceleration[axis] = 1000;
+    config->max_feedrate[axis] = 100;
+  }
+  config->require_homing = false;
+  config->junction_deviation = 0;
+  PlannerHarness plantest(0, config, HardwareMapping::Kinematics::COREXY);
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 1000);   // A = X + Y; B = X - Y
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 1000);
+  pos[AXIS_X] = 20;
+  pos[AXIS_Y] = 20;
+  plantest.Enqueue(pos, 1000);   // Diagonal: only A moves, twice as far.
+
+  int a_steps[3] = {0}, b_steps[3] = {0};
+  int move = 0;
+  for (const LinearSegmentSteps &s : plantest.segments()) {
+    a_steps[move] += s.steps[0];
+    b_steps[move] += s.steps[1];
+    // Neither motor faster than its axis allows (100mm/s * 100 steps/mm)
+    EXPECT_LE(s.v0, 10000 * 1.001);
+    EXPECT_LE(s.v1, 10000 * 1.001);
+    if (s.v1 == 0) ++move;   // All moves end at a stop (corners).
+  }
+  ASSERT_EQ(3, move);
+  EXPECT_EQ(1000, a_steps[0]);
+  EXPECT_EQ(1000, b_steps[0]);
+  EXPECT_EQ(1000, a_steps[1]);
+  EXPECT_EQ(-1000, b_steps[1]);
+  EXPECT_EQ(2000, a_steps[2]);
+  EXPECT_EQ(0, b_steps[2]);
+}
+
+// The extruder is ahead by the pressure advance times the extrusion speed.
+TEST(PlannerTest, PressureAdvance_ExtruderAheadWhileMoving) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->steps_per_mm[AXIS_E] = 1000;
+  config->acceleration[AXIS_E] = 100;
+  config->max_feedrate[AXIS_E] = 10000;
+  config->pressure_advance = 0.1;
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  pos[AXIS_E] = 10;
+  plantest.Enqueue(pos, 50);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_EQ(3u, segments.size());
+
+  // At 50mm/s, the extruder is at 5mm/s, 5000 steps/s: 500 steps ahead.
+  const int kE = 3;  // Motor 4.
+  EXPECT_EQ(segments[0].steps[0] / 10 + 500, segments[0].steps[kE]);
+  EXPECT_EQ(segments[1].steps[0] / 10, segments[1].steps[kE]);
+  EXPECT_EQ(segments[2].steps[0] / 10 - 500, segments[2].steps[kE]);
+
+  int extruder_steps = 0;
+  for (const LinearSegmentSteps &s : segments) extruder_steps += s.steps[kE];
+  EXPECT_EQ(10000, extruder_steps);
+}
+
+// With a lot of pressure advance, the deceleration at the end is too short
+// to take it all back. The extruder then moves back on its own, within its
+// acceleration limit, and comes to a stop.
+TEST(PlannerTest, PressureAdvance_RemainingAdvanceTakenBackSmoothly) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->steps_per_mm[AXIS_E] = 1000;
+  config->acceleration[AXIS_E] = 100;
+  config->max_feedrate[AXIS_E] = 10000;
+  config->pressure_advance = 6;
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  pos[AXIS_E] = 10;
+  plantest.Enqueue(pos, 50);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+
+  const int kE = 3;  // Motor 4.
+  int extruder_steps = 0;
+  int extruder_only = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const LinearSegmentSteps &s = segments[i];
+    extruder_steps += s.steps[kE];
+    if (s.steps[0] != 0) continue;
+    ++extruder_only;
+    ASSERT_LT(s.steps[kE], 0);   // Going back.
+    const double accel = std::fabs(1.0*s.v1*s.v1 - 1.0*s.v0*s.v0)
+      / (2.0 * abs(s.steps[kE]));
+    EXPECT_LE(accel, 1.001 * 100 * 1000) << "Segment " << i;
+    if (i > 0 && segments[i-1].steps[0] == 0) {
+      EXPECT_EQ(segments[i-1].v1, s.v0) << "Segment " << i;
+    }
+  }
+  EXPECT_GT(extruder_only, 1);
+  EXPECT_EQ(0, segments.back().v1);
+  EXPECT_EQ(10000, extruder_steps);
+}
+
+TEST(DeltaKinematics, ForwardIsInverseOfInverse) {
+  DeltaKinematics delta(100, 250, 0.01);
+  const float points[][3] = { {0, 0, 0}, {50, -30, 10}, {-80, 20, 100} };
+  for (const auto &p : points) {
+    float carriage[3], x, y, z;
+    ASSERT_TRUE(delta.CartesianToCarriages(p[0], p[1], p[2], carriage));
+    ASSERT_TRUE(delta.CarriagesToCartesian(carriage, &x, &y, &z));
+    EXPECT_NEAR(p[0], x, 1e-3);
+    EXPECT_NEAR(p[1], y, 1e-3);
+    EXPECT_NEAR(p[2], z, 1e-3);
+  }
+  float carriage[3];
+  EXPECT_FALSE(delta.CartesianToCarriages(400, 0, 0, carriage));
+
+  // Rods are steeper in the center, so we can go further in one segment.
+  EXPECT_GT(delta.SegmentLength(0, 0), delta.SegmentLength(80, 0));
+}
+
+// A straight move is split into segments, each a straight move of the
+// carriages, that end on the straight line.
+TEST(PlannerTest, Delta_StraightMoveIsSegmented) {
+  MachineControlConfig *config = new MachineControlConfig();
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+    config->steps_per_mm[axis] = 100;
+    config->acceleration[axis] = 1000;
+    config->max_feedrate[axis] = 200;
+  }
+  config->require_homing = false;
+  config->delta_radius = 100;
+  config->delta_rod_length = 250;
+  config->delta_segment_tolerance = 0.01;
+  PlannerHarness plantest(0.01, config, HardwareMapping::Kinematics::DELTA);
+  DeltaKinematics delta(100, 250, 0.01);
+
+  // Towers start at the home position: all carriages at zero.
+  float start[3], end[3], home[3] = { 0, 0, 0 };
+  ASSERT_TRUE(delta.CarriagesToCartesian(home, &start[0], &start[1],
+                                         &start[2]));
+  AxesRegister pos;
+  pos[AXIS_X] = 60;
+  pos[AXIS_Y] = -20;
+  pos[AXIS_Z] = start[2] - 5;
+  plantest.Enqueue(pos, 50);
+
+  int carriage_steps[3] = { 0, 0, 0 };
+  int stops = 0;
+  for (const LinearSegmentSteps &s : plantest.segments()) {
+    for (int i = 0; i < 3; ++i) carriage_steps[i] += s.steps[i];
+    if (s.v1 == 0) ++stops;
+  }
+  EXPECT_EQ(1, stops);   // Segments join without slowing down.
+  EXPECT_GT(plantest.stats().targets, 10);
+
+  ASSERT_TRUE(delta.CartesianToCarriages(pos[AXIS_X], pos[AXIS_Y],
+                                         pos[AXIS_Z], end));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_NEAR(end[i] * 100, carriage_steps[i], 1) << "Tower " << i;
+  }
+}
+
+TEST(PlannerTest, Trace_RecordsInputsAndSegments) {
+  char trace_file[] = "/tmp/planner-trace-XXXXXX";
+  close(mkstemp(trace_file));
+  std::vector<LinearSegmentSteps> segments;
+  {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->planner_trace_file = trace_file;
+    PlannerHarness plantest(0.01, config);
+    AxesRegister pos;
+    pos[AXIS_X] = 10;
+    plantest.Enqueue(pos, 10);
+    pos[AXIS_Y] = 10;
+    plantest.Enqueue(pos, 20, 5.0);
+    segments = plantest.segments();
+  }
+
+  PlannerTraceReader *trace = PlannerTraceReader::Create(trace_file);
+  ASSERT_TRUE(trace != NULL);
+  PlannerTraceRecord record;
+  std::vector<PlannerTraceRecord> targets;
+  std::vector<LinearSegmentSteps> traced_segments;
+  int halts = 0;
+  while (trace->Next(&record)) {
+    switch (record.type) {
+    case PlannerTraceRecord::TARGET: targets.push_back(record); break;
+    case PlannerTraceRecord::SEGMENT:
+      traced_segments.push_back(record.segment);
+      break;
+    case PlannerTraceRecord::HALT: halts++; break;
+    default: break;
+    }
+  }
+  delete trace;
+  unlink(trace_file);
+
+  ASSERT_EQ(2, (int)targets.size());
+  EXPECT_EQ(10, targets[0].target[AXIS_X]);
+  EXPECT_EQ(10, targets[0].feedrate);
+  EXPECT_EQ(10, targets[1].target[AXIS_Y]);
+  EXPECT_EQ(20, targets[1].feedrate);
+  EXPECT_EQ(5.0, targets[1].curve_radius);
+  EXPECT_EQ(1, halts);
+
+  ASSERT_EQ(segments.size(), traced_segments.size());
+  for (size_t i = 0; i < segments.size(); ++i) {
+    EXPECT_EQ(segments[i].v0, traced_segments[i].v0) << "Segment " << i;
+    EXPECT_EQ(segments[i].v1, traced_segments[i].v1) << "Segment " << i;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      EXPECT_EQ(segments[i].steps[m], traced_segments[i].steps[m]);
+    }
+  }
 }
 
 int main(int argc, char *argv[]) {
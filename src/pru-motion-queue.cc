@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common/logging.h"
 
@@ -46,6 +47,10 @@ using internal::QueueStatus;
 struct PRUCommunication {
   volatile QueueStatus status;
   volatile MotionSegment ring_buffer[QUEUE_LEN];
+  volatile uint32_t speed_factor;   // See SPEED_FACTOR_SHIFT
+  volatile uint32_t speed_ramp_loops;     // Loops per unit of factor change.
+  volatile uint32_t speed_ramp_progress;  // Used by PRU while ramping.
+  volatile uint32_t endstop_status;  // Last homing segment, see ENDSTOP_STATUS_*
 } __attribute__((packed));
 
 #ifdef DEBUG_QUEUE
@@ -56,7 +61,7 @@ static void DumpMotionSegment(volatile const struct MotionSegment *e,
   } else {
     MotionSegment copy = (MotionSegment&) *e;
     std::string line;
-    line = StringPrintf("enqueue[%02td]: dir:0x%02x s:(%5d + %5d + %5d) = %5d ",
+    line = StringPrintf("enqueue[%02td]: dir:0x%02x s:(%5d + %7u + %5d) = %7u ",
                         e - pru_data->ring_buffer, copy.direction_bits,
                         copy.loops_accel, copy.loops_travel, copy.loops_decel,
                         copy.loops_accel + copy.loops_travel + copy.loops_decel);
@@ -96,9 +101,17 @@ void PRUMotionQueue::ClearPRUAbort(unsigned int idx) {
   e->state = STATE_EMPTY;
 }
 
+// The PRU writes the status in one 32 bit word. Copy it instead of
+// dereferencing a pointer to the packed member.
+static QueueStatus ReadQueueStatus(volatile const PRUCommunication *pru_data) {
+  QueueStatus status;
+  memcpy(&status, (const void*) &pru_data->status, sizeof(status));
+  return status;
+}
+
 int PRUMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
   // Get data from the PRU
-  const struct QueueStatus status = *(struct QueueStatus*) &pru_data_->status;
+  const struct QueueStatus status = ReadQueueStatus(pru_data_);
   const unsigned int last_insert_index = RingbufferOffset(queue_pos_, -1);
   if (head_item_progress) {
     *head_item_progress = status.counter;
@@ -113,6 +126,23 @@ int PRUMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
   return queue_len;
 }
 
+void PRUMotionQueue::GetExecutingSegment(uint32_t *segment,
+                                         uint32_t *loops_left) {
+  // The PRU writes the status in one go. A slot is only filled again
+  // after the PRU moved on to the next; so if it is still at the same
+  // slot after we looked up its segment, the two belong together.
+  QueueStatus status = ReadQueueStatus(pru_data_);
+  for (;;) {
+    *segment = slot_segment_[status.index];
+    const QueueStatus again = ReadQueueStatus(pru_data_);
+    if (again.index == status.index) {
+      *loops_left = again.counter;
+      return;
+    }
+    status = again;
+  }
+}
+
 // Stop gap for compiler attempting to be overly clever when copying between
 // host and PRU memory.
 static void unaligned_memcpy(volatile void *dest, const void *src, size_t size) {
@@ -124,31 +154,57 @@ static void unaligned_memcpy(volatile void *dest, const void *src, size_t size)
   }
 }
 
-bool PRUMotionQueue::Enqueue(MotionSegment *element) {
-  const uint8_t state_to_send = element->state;
-  assert(state_to_send != STATE_EMPTY);  // forgot to set proper state ?
-  // Initially, we copy everything with 'STATE_EMPTY', then flip the state
-  // to avoid a race condition while copying.
-  element->state = STATE_EMPTY;
-
+bool PRUMotionQueue::WaitForFreeSlots(int count) {
   queue_pos_ %= QUEUE_LEN;
-  while (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
-    if (pru_data_->ring_buffer[queue_pos_].state == STATE_ABORT) {
-      ClearPRUAbort(queue_pos_);
-      return false;
+  // The PRU works through the slots in order, so they become free in order.
+  for (int i = 0; i < count; ++i) {
+    const unsigned int slot = RingbufferOffset(queue_pos_, i);
+    while (pru_data_->ring_buffer[slot].state != STATE_EMPTY) {
+      if (pru_data_->ring_buffer[slot].state == STATE_ABORT) {
+        ClearPRUAbort(slot);
+        return false;
+      }
+      pru_interface_->WaitEvent();
     }
-    pru_interface_->WaitEvent();
   }
+  return true;
+}
 
-  volatile MotionSegment *queue_element = &pru_data_->ring_buffer[queue_pos_++];
-  unaligned_memcpy(queue_element, element, sizeof(*queue_element));
+bool PRUMotionQueue::Enqueue(MotionSegment *element) {
+  return EnqueueMany(element, 1);
+}
 
-  // Fully initialized. Tell busy-waiting PRU by flipping the state.
-  queue_element->state = state_to_send;
+bool PRUMotionQueue::EnqueueMany(MotionSegment *elements, int count) {
+  assert(count <= QUEUE_LEN);
+  if (!WaitForFreeSlots(count))
+    return false;
 
+  // Initially, we copy everything with 'STATE_EMPTY', then flip the state
+  // to avoid a race condition while copying.
+  uint8_t state_to_send[QUEUE_LEN];
+  for (int i = 0; i < count; ++i) {
+    if (elements[i].endstop_trigger != ENDSTOP_NONE) {
+      pru_data_->endstop_status = 0;  // Nothing triggered yet.
+    }
+    state_to_send[i] = elements[i].state;
+    assert(state_to_send[i] != STATE_EMPTY);  // forgot to set proper state ?
+    slot_segment_[RingbufferOffset(queue_pos_, i)] = ++enqueued_segments_;
+    elements[i].state = STATE_EMPTY;
+    unaligned_memcpy(&pru_data_->ring_buffer[RingbufferOffset(queue_pos_, i)],
+                     &elements[i], sizeof(MotionSegment));
+  }
+
+  // Fully initialized. Tell busy-waiting PRU by flipping the states, in
+  // the order it executes them.
+  for (int i = 0; i < count; ++i) {
+    volatile MotionSegment *queue_element
+      = &pru_data_->ring_buffer[RingbufferOffset(queue_pos_, i)];
+    queue_element->state = state_to_send[i];
 #ifdef DEBUG_QUEUE
-  DumpMotionSegment(queue_element, pru_data_);
+    DumpMotionSegment(queue_element, pru_data_);
 #endif
+  }
+  queue_pos_ = RingbufferOffset(queue_pos_, count);
   return true;
 }
 
@@ -162,6 +218,14 @@ void PRUMotionQueue::WaitQueueEmpty() {
   }
 }
 
+bool PRUMotionQueue::GetEndstopTrigger(uint32_t *skipped_loops) {
+  const uint32_t status = pru_data_->endstop_status;
+  if (!(status & (1u << ENDSTOP_STATUS_TRIGGERED_BIT)))
+    return false;
+  *skipped_loops = status & ~(1u << ENDSTOP_STATUS_TRIGGERED_BIT);
+  return true;
+}
+
 void PRUMotionQueue::MotorEnable(bool on) {
   hardware_mapping_->EnableMotors(on);
 }
@@ -177,6 +241,12 @@ void PRUMotionQueue::Shutdown(bool flush_queue) {
   MotorEnable(false);
 }
 
+void PRUMotionQueue::SetSpeedFactor(float factor, float ramp_seconds) {
+  // The PRU picks this up with the next step.
+  pru_data_->speed_ramp_loops = internal::SpeedRampToLoops(ramp_seconds);
+  pru_data_->speed_factor = internal::SpeedFactorToFixedPoint(factor);
+}
+
 PRUMotionQueue::~PRUMotionQueue() {}
 
 PRUMotionQueue::PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru)
@@ -200,7 +270,20 @@ bool PRUMotionQueue::Init() {
   for (int i = 0; i < QUEUE_LEN; ++i) {
     pru_data_->ring_buffer[i].state = STATE_EMPTY;
   }
+  pru_data_->speed_factor = internal::SpeedFactorToFixedPoint(1.0f);
+  pru_data_->speed_ramp_loops = internal::SpeedRampToLoops(0);
+  pru_data_->speed_ramp_progress = 0;
+  pru_data_->endstop_status = 0;
   queue_pos_ = 0;
 
+  // The PRU only updates the status once it starts with a slot. Until then,
+  // it looks like the slot before the first one is done.
+  pru_data_->status.index = QUEUE_LEN - 1;
+  pru_data_->status.counter = 0;
+  enqueued_segments_ = 0;
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    slot_segment_[i] = 0;
+  }
+
   return pru_interface_->StartExecution();
 }
@@ -25,6 +25,10 @@
 struct MockPRUCommunication {
   internal::QueueStatus status;
   MotionSegment ring_buffer[QUEUE_LEN];
+  uint32_t speed_factor;
+  uint32_t speed_ramp_loops;
+  uint32_t speed_ramp_progress;
+  uint32_t endstop_status;
 } __attribute__((packed));
 
 class MockPRUInterface : public PruHardwareInterface {
@@ -59,6 +63,19 @@ public:
     mmap->status.counter = loops_left;
   }
 
+  // Simulate the endstop of the currently executed homing segment to
+  // trigger, skipping the given number of loops.
+  void SimEndstopTrigger(uint32_t skipped_loops) {
+    MotionSegment *segment = &mmap->ring_buffer[execution_index_];
+    assert(segment->endstop_trigger == ENDSTOP_LOW
+           || segment->endstop_trigger == ENDSTOP_HIGH);
+    segment->endstop_trigger = ENDSTOP_TRIGGERED;
+    mmap->endstop_status = skipped_loops | (1u << ENDSTOP_STATUS_TRIGGERED_BIT);
+  }
+
+  uint32_t speed_factor() const { return mmap->speed_factor; }
+  uint32_t speed_ramp_loops() const { return mmap->speed_ramp_loops; }
+
 private:
   struct MockPRUCommunication *mmap;
   unsigned int execution_index_;
@@ -135,6 +152,40 @@ TEST(PruMotionQueue, one_round_queue) {
   EXPECT_EQ(motion_backend.GetPendingElements(NULL), QUEUE_LEN);
 }
 
+TEST(PruMotionQueue, executing_segment) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  uint32_t segment_number, loops_left;
+  motion_backend.GetExecutingSegment(&segment_number, &loops_left);
+  EXPECT_EQ(0u, segment_number);  // Nothing executed yet.
+  EXPECT_EQ(0u, loops_left);
+
+  struct MotionSegment segment = {};
+  for (int i = 0; i < 3; ++i) {
+    segment.state = STATE_FILLED;
+    motion_backend.Enqueue(&segment);
+  }
+  motion_backend.GetExecutingSegment(&segment_number, &loops_left);
+  EXPECT_EQ(0u, segment_number);  // Not started yet.
+
+  pru_interface.SimRun(3, 0, false);
+  motion_backend.GetExecutingSegment(&segment_number, &loops_left);
+  EXPECT_EQ(3u, segment_number);
+  EXPECT_EQ(0u, loops_left);
+
+  // Numbers keep counting when slots are reused.
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    segment.state = STATE_FILLED;
+    motion_backend.Enqueue(&segment);
+  }
+  pru_interface.SimRun(QUEUE_LEN - 2, 42);
+  motion_backend.GetExecutingSegment(&segment_number, &loops_left);
+  EXPECT_EQ(3u + QUEUE_LEN - 2, segment_number);
+  EXPECT_EQ(42u, loops_left);
+}
+
 TEST(PruMotionQueue, exec_index_lt_queue_pos) {
   MotorsRegister absolute_pos_loops;
   MockPRUInterface pru_interface = MockPRUInterface();
@@ -158,6 +209,68 @@ TEST(PruMotionQueue, exec_index_lt_queue_pos) {
   EXPECT_EQ(motion_backend.GetPendingElements(NULL), 2);
 }
 
+TEST(PruMotionQueue, enqueue_many) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  struct MotionSegment segments[4] = {};
+  for (int round = 0; round < QUEUE_LEN; ++round) {
+    for (MotionSegment &segment : segments) segment.state = STATE_FILLED;
+    EXPECT_TRUE(motion_backend.EnqueueMany(segments, 4));
+    EXPECT_GE(motion_backend.GetPendingElements(NULL), 4);
+    // Fails if not all of them made it to the ring buffer.
+    pru_interface.SimRun(4, 0, false);
+    EXPECT_EQ(motion_backend.GetPendingElements(NULL), 0);
+  }
+}
+
+TEST(PruMotionQueue, endstop_trigger) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+  EXPECT_TRUE(motion_backend.SupportsEndstopWatch());
+
+  struct MotionSegment segment = {};
+  segment.state = STATE_FILLED;
+  segment.endstop_trigger = ENDSTOP_HIGH;
+  motion_backend.Enqueue(&segment);
+  pru_interface.SimRun(1, 0);
+  pru_interface.SimEndstopTrigger(1234);
+  uint32_t skipped = 0;
+  EXPECT_TRUE(motion_backend.GetEndstopTrigger(&skipped));
+  EXPECT_EQ(1234u, skipped);
+
+  // The next homing segment starts with a clean status.
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  EXPECT_FALSE(motion_backend.GetEndstopTrigger(&skipped));
+}
+
+TEST(PruMotionQueue, speed_factor) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+  EXPECT_EQ(1u << SPEED_FACTOR_SHIFT, pru_interface.speed_factor());
+
+  motion_backend.SetSpeedFactor(0.5, 0);
+  EXPECT_EQ(1u << (SPEED_FACTOR_SHIFT - 1), pru_interface.speed_factor());
+  EXPECT_EQ(1u, pru_interface.speed_ramp_loops());
+
+  // Only slowing down is supported. Tiny factors don't round to a stop.
+  motion_backend.SetSpeedFactor(2.0, 0);
+  EXPECT_EQ(1u << SPEED_FACTOR_SHIFT, pru_interface.speed_factor());
+  motion_backend.SetSpeedFactor(0.0001, 0);
+  EXPECT_EQ(1u, pru_interface.speed_factor());
+
+  // Feed hold, ramping down within a 1/4 second: each unit of the factor
+  // takes 1/(4 * 256) second worth of loops.
+  motion_backend.SetSpeedFactor(0, 0.25);
+  EXPECT_EQ(0u, pru_interface.speed_factor());
+  EXPECT_EQ(TIMER_FREQUENCY / (4u << SPEED_FACTOR_SHIFT),
+            pru_interface.speed_ramp_loops());
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
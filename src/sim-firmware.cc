@@ -85,6 +85,9 @@ plot "/tmp/foo.data" using 1:3 title "velocity Euclid" with lines ls 1, '' using
 #include <stdint.h>
 #include <strings.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "motion-queue.h"
 #include "motor-interface-constants.h"
@@ -163,6 +166,7 @@ static double euclid(double x, double y, double z) {
 
 // This simulates what happens in the PRU. For testing purposes.
 bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
+  ++segments_;
   if (segment->state == STATE_EXIT)
     return true;
   // setting output direction according to segment->direction_bits;
@@ -179,9 +183,11 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
                                       motor_speeds[Y_MOTOR],
                                       motor_speeds[Z_MOTOR]);
 
-#if JERK_EXPERIMENT
-  uint32_t jerk_index = 1;
-#endif
+  if (segment->endstop_trigger != ENDSTOP_NONE) {
+    endstop_triggered_ = false;
+    endstop_skipped_loops_ = 0;
+  }
+
   bool is_first = true;
   uint32_t remainder = 0;
   const char *msg = "";
@@ -207,35 +213,7 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
     // for display purposes.
     double hires_delay = 0;
 
-#if JERK_EXPERIMENT
-    if (segment->jerk_start > 0) {
-      if (is_first) {
-        msg = "# jerk";
-        fprintf(stderr, "jerk start: jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = false;
-      }
-      // TODO: index 0 ?
-      // TODO: is it 2* ?
-      segment->jerk_motion -= 2*segment->jerk_motion / ((3 * jerk_index) + 1);
-      --segment->jerk_start;
-      ++jerk_index;
-      delay_loops = segment->jerk_motion;
-      hires_delay = segment->jerk_motion;
-      if (hires_delay < 0) {
-        fprintf(stderr, "Got less than 0 at index %d\n", jerk_index);
-        segment->jerk_start = 0;
-        hires_delay = delay_loops = 30000;
-      }
-      if (segment->jerk_start == 0) {
-        fprintf(stderr, "jerk end  : jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = true;
-      }
-    }
-    else
-#endif
-      if (segment->loops_accel > 0) {
+    if (segment->loops_accel > 0) {
       if (is_first) {
         msg = "# accel.";
         fprintf(stderr, "SIM: Accel start _/ : accel-series-idx=%5u, "
@@ -266,7 +244,7 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
       hires_delay = segment->travel_delay_cycles;
       if (is_first) {
         msg = "# travel.";
-        fprintf(stderr, "SIM: travel      -- :                               timer-cycles=%6u     (%d loops)\n", delay_loops,
+        fprintf(stderr, "SIM: travel      -- :                               timer-cycles=%6u     (%u loops)\n", delay_loops,
                 segment->loops_travel);
         is_first = false;
       }
@@ -299,6 +277,62 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
     else {
       break;  // done.
     }
+
+    // Homing: once the endstop is pressed, skip acceleration and travel and
+    // decelerate for at most as many loops as we accelerated.
+    if ((segment->endstop_trigger == ENDSTOP_LOW
+         || segment->endstop_trigger == ENDSTOP_HIGH)
+        && IsEndstopPressed(segment->endstop_gpio)) {
+      segment->endstop_trigger = ENDSTOP_TRIGGERED;
+      const uint32_t remaining = segment->loops_accel + segment->loops_travel
+        + segment->loops_decel;
+      const uint32_t decel = std::min({ segment->accel_series_index, remaining,
+                                        (uint32_t) MAX_ACCEL_LOOPS });
+      endstop_triggered_ = true;
+      endstop_skipped_loops_ = remaining - decel;
+      segment->loops_accel = segment->loops_travel = 0;
+      segment->loops_decel = decel;
+      fprintf(stderr, "SIM: Endstop triggered, skipping %u loops\n",
+              endstop_skipped_loops_);
+      msg = "# endstop.";
+    }
+
+    // Speed factor ramps to the requested one by one unit each time the
+    // planned delays add up to the ramp loops; the delay loop counts in
+    // units of the factor. Factor zero holds until there is a speed again.
+    // Like the PRU, the ramp pauses while the segment changes speed in the
+    // same direction, which it tells by the loops left after this step.
+    const uint32_t requested_factor = requested_speed_factor_;
+    const bool accelerating = segment->loops_accel > 0;
+    const bool decelerating = !accelerating && segment->loops_travel == 0;
+    if (speed_factor_ == requested_factor) {
+      speed_ramp_progress_ = 0;
+    } else if (speed_factor_ < requested_factor ? accelerating
+               : decelerating) {
+      // Wait for the segment to be done with it.
+    } else {
+      const uint32_t ramp_loops = speed_ramp_loops_;
+      speed_ramp_progress_ += delay_loops;
+      while (speed_factor_ != requested_factor
+             && speed_ramp_progress_ >= ramp_loops) {
+        speed_ramp_progress_ -= ramp_loops;
+        if (speed_factor_ < requested_factor) ++speed_factor_;
+        else --speed_factor_;
+      }
+      if (speed_factor_ == requested_factor) speed_ramp_progress_ = 0;
+    }
+    if (speed_factor_ == 0) {
+      fprintf(stderr, "SIM: Feed hold at %.3fs\n", sim_time);
+      while (requested_speed_factor_ == 0) {
+        usleep(1000);
+      }
+      speed_factor_ = 1;
+    }
+    if (delay_loops > 0xffffff) delay_loops = 0xffffff;
+    delay_loops = ((delay_loops << SPEED_FACTOR_SHIFT) + speed_factor_ - 1)
+      / speed_factor_;
+    hires_delay = hires_delay * (1 << SPEED_FACTOR_SHIFT) / speed_factor_;
+
     double wait_time = 1.0 * delay_loops / TIMER_FREQUENCY;
     averager_->PushDeltaTime(1.0 * hires_delay / TIMER_FREQUENCY);
     double acceleration = averager_->GetAcceleration();
@@ -325,7 +359,11 @@ SimFirmwareQueue::SimFirmwareQueue(FILE *out, int relevant_motors)
     relevant_motors_(relevant_motors < MOTION_MOTOR_COUNT
                      ? relevant_motors
                      : MOTION_MOTOR_COUNT),
-    averager_(new Averager()) {
+    averager_(new Averager()), segments_(0),
+    requested_speed_factor_(internal::SpeedFactorToFixedPoint(1.0f)),
+    speed_ramp_loops_(internal::SpeedRampToLoops(0)),
+    speed_factor_(requested_speed_factor_), speed_ramp_progress_(0),
+    endstop_triggered_(false), endstop_skipped_loops_(0) {
   // Total time; speed; acceleration; delay_loops. [steps walked for all motors].
   printf("%12s %10s %12s %12s      ", "time", "timer-loop", "Euclid-speed", "Euclid-accel");
   for (int i = 0; i < relevant_motors_; ++i) {
@@ -337,6 +375,33 @@ SimFirmwareQueue::SimFirmwareQueue(FILE *out, int relevant_motors)
   fprintf(out_, "\n");
 }
 
+bool SimFirmwareQueue::GetEndstopTrigger(uint32_t *skipped_loops) {
+  if (!endstop_triggered_)
+    return false;
+  *skipped_loops = endstop_skipped_loops_;
+  return true;
+}
+
+void SimFirmwareQueue::SimulateEndstop(uint32_t gpio, int motor,
+                                       int position, bool at_max) {
+  endstops_.push_back({ gpio, motor, position, at_max });
+}
+
+bool SimFirmwareQueue::IsEndstopPressed(uint32_t gpio) const {
+  for (const SimulatedEndstop &e : endstops_) {
+    if (e.gpio != gpio) continue;
+    if (e.at_max ? sim_steps[e.motor] >= e.position
+                 : sim_steps[e.motor] <= e.position)
+      return true;
+  }
+  return false;
+}
+
+void SimFirmwareQueue::SetSpeedFactor(float factor, float ramp_seconds) {
+  speed_ramp_loops_ = internal::SpeedRampToLoops(ramp_seconds);
+  requested_speed_factor_ = internal::SpeedFactorToFixedPoint(factor);
+}
+
 SimFirmwareQueue::~SimFirmwareQueue() {
   delete averager_;
 }
@@ -21,6 +21,9 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <vector>
+
 class SimFirmwareQueue : public MotionQueue {
 public:
   SimFirmwareQueue(FILE *out, int relevant_motors = MOTION_MOTOR_COUNT);
@@ -30,16 +33,49 @@ public:
   void WaitQueueEmpty() final {}
   void MotorEnable(bool on) final {}
   void Shutdown(bool flush_queue) final {}
+  void SetSpeedFactor(float factor, float ramp_seconds) final;
   int GetPendingElements(uint32_t *head_item_progress) final {
     if (head_item_progress)
       *head_item_progress = 0;
     return 1;
   }
+  void GetExecutingSegment(uint32_t *segment, uint32_t *loops_left) final {
+    *segment = segments_;  // All executed right away.
+    *loops_left = 0;
+  }
+  bool SupportsEndstopWatch() final { return true; }
+  bool GetEndstopTrigger(uint32_t *skipped_loops) final;
+
+  // Simulate an endstop switch connected to "gpio", that is pressed while
+  // "motor" is at "position" steps or beyond; beyond is towards larger
+  // positions if "at_max", smaller otherwise. Homing segments watching this
+  // gpio see it at the level they wait for while pressed.
+  void SimulateEndstop(uint32_t gpio, int motor, int position, bool at_max);
 
 private:
   class Averager;
 
+  struct SimulatedEndstop {
+    uint32_t gpio;
+    int motor;
+    int position;
+    bool at_max;
+  };
+
+  bool IsEndstopPressed(uint32_t gpio) const;
+
   FILE *const out_;
   const int relevant_motors_;
   Averager *const averager_;
+  uint32_t segments_;
+
+  // Speed factor as requested and as currently applied; like in the PRU.
+  std::atomic<uint32_t> requested_speed_factor_;
+  std::atomic<uint32_t> speed_ramp_loops_;
+  uint32_t speed_factor_;
+  uint32_t speed_ramp_progress_;
+
+  std::vector<SimulatedEndstop> endstops_;
+  bool endstop_triggered_;               // In the last homing segment.
+  uint32_t endstop_skipped_loops_;
 };